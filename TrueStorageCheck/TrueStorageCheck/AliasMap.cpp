@@ -0,0 +1,62 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#include "AliasMap.hpp"
+
+#include <algorithm>
+#include <numeric>
+
+AliasMap::AliasMap()
+{
+	Clear();
+}
+
+void AliasMap::Clear()
+{
+	distances.clear();
+	aliasedSectors = lostSectors = firstBadAddress = 0;
+}
+
+void AliasMap::AddBadAddress(unsigned long long address)
+{
+	if (aliasedSectors + lostSectors == 0 || address < firstBadAddress)
+		firstBadAddress = address;
+}
+
+void AliasMap::AddAliased(unsigned long long address, unsigned long long foundAddress)
+{
+	AddBadAddress(address);
+	aliasedSectors++;
+
+	distances[address > foundAddress ? address - foundAddress : foundAddress - address]++;
+}
+
+void AliasMap::AddLost(unsigned long long address)
+{
+	AddBadAddress(address);
+	lostSectors++;
+}
+
+unsigned long long AliasMap::GetWrapModulus() const
+{
+	// Distances seen only a handful of times are noise (files not laid out exactly one after the other), skip them
+	unsigned long long minimumCount = std::max<unsigned long long>(1, aliasedSectors / 100);
+	unsigned long long modulus = 0;
+
+	for (const auto& distance : distances)
+	{
+		if (distance.second >= minimumCount)
+			modulus = std::gcd(modulus, distance.first);
+	}
+
+	return modulus;
+}
+
+unsigned long long AliasMap::GetRealCapacity() const
+{
+	unsigned long long modulus = GetWrapModulus();
+
+	return modulus != 0 ? modulus : firstBadAddress;
+}
@@ -0,0 +1,77 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#pragma once
+
+#include <map>
+
+/// <summary>
+/// What the bad sectors found while verifying tagged data say about the device
+/// </summary>
+/// <remarks>
+/// A wrapping fake returns, for address A, the data last written to A + k * realCapacity. The distances between
+/// where sectors should have come from and where their tags say they came from are multiples of the real capacity,
+/// so their greatest common divisor is the wrap modulus. Devices that drop writes only leave lost sectors behind,
+/// the lowest one marks where the real capacity ends.
+/// Addresses are positions in everything written by the test, which follow the device addresses closely enough
+/// for the distances to hold on a freshly formatted disk.
+/// </remarks>
+class AliasMap
+{
+public:
+	AliasMap();
+
+	/// <summary>
+	/// Forgets everything recorded so far
+	/// </summary>
+	void Clear();
+
+	/// <summary>
+	/// Records a sector holding the data of another address
+	/// </summary>
+	/// <param name="address">Address the sector was read from</param>
+	/// <param name="foundAddress">Address its tag says it was written to</param>
+	void AddAliased(unsigned long long address, unsigned long long foundAddress);
+
+	/// <summary>
+	/// Records a sector that holds no valid tag (zeros, garbage or corrupted data)
+	/// </summary>
+	/// <param name="address">Address the sector was read from</param>
+	void AddLost(unsigned long long address);
+
+	/// <summary>
+	/// Number of aliased / lost sectors recorded
+	/// </summary>
+	unsigned long long GetAliasedSectors() const { return aliasedSectors; }
+	unsigned long long GetLostSectors() const { return lostSectors; }
+
+	/// <summary>
+	/// Lowest address that didn't hold its own data
+	/// </summary>
+	/// <returns>Address or 0 if no bad sector was recorded</returns>
+	unsigned long long GetFirstBadAddress() const { return firstBadAddress; }
+
+	/// <summary>
+	/// Gets the distance at which the device wraps around
+	/// </summary>
+	/// <returns>Wrap modulus in bytes, 0 if no aliasing was seen</returns>
+	unsigned long long GetWrapModulus() const;
+
+	/// <summary>
+	/// Gets the estimated real capacity, the wrap modulus if the device wraps, otherwise the first bad address
+	/// </summary>
+	/// <returns>Capacity in bytes, 0 if nothing bad was recorded</returns>
+	unsigned long long GetRealCapacity() const;
+
+private:
+	// Alias distance -> number of sectors seen at that distance
+	std::map<unsigned long long, unsigned long long> distances;
+
+	unsigned long long aliasedSectors;
+	unsigned long long lostSectors;
+	unsigned long long firstBadAddress;
+
+	void AddBadAddress(unsigned long long address);
+};
@@ -0,0 +1,97 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#pragma once
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+// Unbuffered (FILE_FLAG_NO_BUFFERING / O_DIRECT) I/O needs sector aligned buffers, a page covers every sector size we care about
+const size_t IO_BUFFER_ALIGNMENT = 4096;
+
+/// <summary>
+/// Heap buffer aligned for unbuffered I/O, std::vector only gives us that by accident.
+/// Mimics the bits of std::vector we use so it can be dropped in place of one.
+/// </summary>
+class AlignedBuffer
+{
+public:
+	AlignedBuffer(size_t size = 0) : pData(nullptr), bufferSize(0), bufferCapacity(0) {
+		resize(size);
+	}
+
+	~AlignedBuffer() {
+		Free(pData);
+	}
+
+	AlignedBuffer(const AlignedBuffer&) = delete;
+	AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+	/// <summary>
+	/// Resizes the buffer, shrinking never reallocates and growing keeps the current content
+	/// </summary>
+	/// <param name="newSize">Size in bytes</param>
+	void resize(size_t newSize) {
+
+		if (newSize > bufferCapacity)
+		{
+			// Round up to the alignment, some allocators insist on it
+			size_t newCapacity = (newSize + IO_BUFFER_ALIGNMENT - 1) & ~(IO_BUFFER_ALIGNMENT - 1);
+			unsigned char* pNewData = Allocate(newCapacity);
+
+			if (pData != nullptr)
+			{
+				memcpy(pNewData, pData, bufferSize);
+				Free(pData);
+			}
+
+			pData = pNewData;
+			bufferCapacity = newCapacity;
+		}
+
+		bufferSize = newSize;
+	}
+
+	unsigned char* data() { return pData; }
+	const unsigned char* data() const { return pData; }
+	size_t size() const { return bufferSize; }
+
+	unsigned char& operator[](size_t i) { return pData[i]; }
+	const unsigned char& operator[](size_t i) const { return pData[i]; }
+
+private:
+	unsigned char* pData;
+	size_t bufferSize;
+	size_t bufferCapacity;
+
+	static unsigned char* Allocate(size_t size) {
+#ifdef _WIN32
+		void* p = _aligned_malloc(size, IO_BUFFER_ALIGNMENT);
+#else
+		void* p = nullptr;
+		if (posix_memalign(&p, IO_BUFFER_ALIGNMENT, size) != 0)
+			p = nullptr;
+#endif
+		if (p == nullptr)
+			throw std::bad_alloc();
+
+		return static_cast<unsigned char*>(p);
+	}
+
+	static void Free(unsigned char* p) {
+		if (p == nullptr)
+			return;
+#ifdef _WIN32
+		_aligned_free(p);
+#else
+		free(p);
+#endif
+	}
+};
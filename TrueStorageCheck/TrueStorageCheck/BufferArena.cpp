@@ -0,0 +1,232 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#include "BufferArena.hpp"
+
+#include "Platform.hpp"
+
+#include <algorithm>
+#include <cstdint>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+// Normal page size, buffers are rounded up to it
+const size_t ARENA_PAGE_SIZE = 4096;
+
+// Huge page size we align to for THP, the common x86/ARM size
+const size_t ARENA_HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+static size_t RoundUp(size_t size, size_t alignment)
+{
+	return (size + alignment - 1) / alignment * alignment;
+}
+
+#ifdef _WIN32
+
+/// <summary>
+/// Large pages need SeLockMemoryPrivilege, it has to be granted to the user but still needs enabling
+/// </summary>
+static bool EnableLockMemoryPrivilege()
+{
+	HANDLE hToken;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken))
+		return false;
+
+	TOKEN_PRIVILEGES privileges = {};
+	privileges.PrivilegeCount = 1;
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+	bool success = LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid)
+		&& AdjustTokenPrivileges(hToken, FALSE, &privileges, 0, NULL, NULL)
+		&& GetLastError() == ERROR_SUCCESS;
+
+	CloseHandle(hToken);
+	return success;
+}
+
+static unsigned char* MapMemory(size_t size, size_t* mappedSize, BufferArenaBacking* backing)
+{
+	size_t largePageSize = GetLargePageMinimum();
+
+	if (largePageSize != 0 && EnableLockMemoryPrivilege())
+	{
+		size_t largeSize = RoundUp(size, largePageSize);
+		void* p = VirtualAlloc(NULL, largeSize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+
+		if (p != NULL)
+		{
+			*mappedSize = largeSize;
+			*backing = BufferArenaBacking::HugePages;
+			return static_cast<unsigned char*>(p);
+		}
+	}
+
+	void* p = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+	if (p == NULL)
+		return nullptr;
+
+	*mappedSize = size;
+	*backing = BufferArenaBacking::Normal;
+	return static_cast<unsigned char*>(p);
+}
+
+static void UnmapMemory(unsigned char* p, size_t size)
+{
+	VirtualFree(p, 0, MEM_RELEASE);
+}
+
+#else
+
+static unsigned char* MapMemory(size_t size, size_t* mappedSize, BufferArenaBacking* backing)
+{
+	size_t hugeSize = RoundUp(size, ARENA_HUGE_PAGE_SIZE);
+	void* p;
+
+#ifdef MAP_HUGETLB
+	// Only works if huge pages were set aside (vm.nr_hugepages), most systems have none
+	p = mmap(nullptr, hugeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+	if (p != MAP_FAILED)
+	{
+		*mappedSize = hugeSize;
+		*backing = BufferArenaBacking::HugePages;
+		return static_cast<unsigned char*>(p);
+	}
+#endif
+
+	// Over-map so we can cut out a huge page aligned range, THP can't promote what isn't aligned
+	size_t overSize = hugeSize + ARENA_HUGE_PAGE_SIZE;
+	p = mmap(nullptr, overSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (p == MAP_FAILED)
+		return nullptr;
+
+	unsigned char* start = static_cast<unsigned char*>(p);
+	unsigned char* aligned = reinterpret_cast<unsigned char*>(RoundUp(reinterpret_cast<uintptr_t>(start), ARENA_HUGE_PAGE_SIZE));
+
+	if (aligned != start)
+		munmap(start, aligned - start);
+
+	size_t tail = (start + overSize) - (aligned + hugeSize);
+	if (tail != 0)
+		munmap(aligned + hugeSize, tail);
+
+	*mappedSize = hugeSize;
+	*backing = BufferArenaBacking::Normal;
+
+#ifdef MADV_HUGEPAGE
+	// Fails when THP is disabled, that's fine
+	if (madvise(aligned, hugeSize, MADV_HUGEPAGE) == 0)
+		*backing = BufferArenaBacking::TransparentHugePages;
+#endif
+
+	return aligned;
+}
+
+static void UnmapMemory(unsigned char* p, size_t size)
+{
+	munmap(p, size);
+}
+
+#endif
+
+BufferArena::BufferArena() : base(nullptr), mappedSize(0), bufferSize(0), bufferCount(0) {}
+
+BufferArena::~BufferArena()
+{
+	Unmap();
+}
+
+void BufferArena::Unmap()
+{
+	if (base != nullptr)
+		UnmapMemory(base, mappedSize);
+
+	base = nullptr;
+	mappedSize = 0;
+	bufferSize = 0;
+	bufferCount = 0;
+	freeBuffers.clear();
+
+	stats.reservedBytes = 0;
+	stats.backing = BufferArenaBacking::None;
+}
+
+bool BufferArena::Reserve(size_t size, size_t count)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (freeBuffers.size() != bufferCount)
+		return false;
+
+	Unmap();
+
+	if (size == 0 || count == 0)
+		return true;
+
+	size_t alignedSize = RoundUp(size, ARENA_PAGE_SIZE);
+	BufferArenaBacking backing;
+
+	base = MapMemory(alignedSize * count, &mappedSize, &backing);
+
+	if (base == nullptr)
+	{
+		mappedSize = 0;
+		return false;
+	}
+
+	bufferSize = alignedSize;
+	bufferCount = count;
+
+	// Handed out from the back, so the first buffer goes first
+	for (size_t i = count; i > 0; i--)
+		freeBuffers.push_back(base + (i - 1) * alignedSize);
+
+	stats.backing = backing;
+	stats.reservedBytes = mappedSize;
+	stats.peakReservedBytes = std::max<unsigned long long>(stats.peakReservedBytes, mappedSize);
+
+	return true;
+}
+
+unsigned char* BufferArena::Acquire()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (freeBuffers.empty())
+	{
+		stats.failedAcquireCount++;
+		return nullptr;
+	}
+
+	unsigned char* buffer = freeBuffers.back();
+	freeBuffers.pop_back();
+
+	stats.acquireCount++;
+	stats.inUseBytes += bufferSize;
+	stats.peakInUseBytes = std::max(stats.peakInUseBytes, stats.inUseBytes);
+
+	return buffer;
+}
+
+void BufferArena::Release(unsigned char* buffer)
+{
+	if (buffer == nullptr)
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	freeBuffers.push_back(buffer);
+	stats.inUseBytes -= bufferSize;
+}
+
+BufferArenaStats BufferArena::GetStats()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return stats;
+}
@@ -0,0 +1,120 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+/// <summary>
+/// What the arena memory is backed by
+/// </summary>
+enum class BufferArenaBacking
+{
+	// Nothing reserved yet
+	None = 0,
+	// Normal pages
+	Normal,
+	// Normal pages the kernel is asked to promote to huge pages (Linux THP)
+	TransparentHugePages,
+	// Explicit huge pages (MAP_HUGETLB on Linux, MEM_LARGE_PAGES on Windows)
+	HugePages
+};
+
+/// <summary>
+/// Memory usage of a BufferArena
+/// </summary>
+struct BufferArenaStats
+{
+	// Memory currently mapped by the arena, this is what a test holds on to while it runs
+	unsigned long long reservedBytes = 0;
+
+	// Highest reservedBytes seen
+	unsigned long long peakReservedBytes = 0;
+
+	// Buffers currently handed out, in bytes
+	unsigned long long inUseBytes = 0;
+
+	// Highest inUseBytes seen
+	unsigned long long peakInUseBytes = 0;
+
+	// Successful / failed (pool empty) Acquire calls
+	unsigned long long acquireCount = 0;
+	unsigned long long failedAcquireCount = 0;
+
+	BufferArenaBacking backing = BufferArenaBacking::None;
+};
+
+/// <summary>
+/// Fixed pool of equally sized I/O buffers carved out of a single mapping
+/// </summary>
+/// <remarks>
+/// Buffers are page aligned, which covers every sector size unbuffered I/O asks for. The mapping uses
+/// huge pages when the system lets us, the generate and compare loops walk the whole buffer on every
+/// chunk and a 64MB buffer is 16384 normal pages but only 32 huge ones.
+/// Being one mapping also means it can be registered with an IoQueue as a single buffer.
+/// </remarks>
+class BufferArena
+{
+public:
+	BufferArena();
+	~BufferArena();
+
+	BufferArena(const BufferArena&) = delete;
+	BufferArena& operator=(const BufferArena&) = delete;
+
+	/// <summary>
+	/// Maps count buffers of bufferSize bytes each, replacing the current pool
+	/// </summary>
+	/// <remarks>Every buffer of the current pool must have been released</remarks>
+	/// <param name="bufferSize">Size of each buffer in bytes, rounded up to the page size</param>
+	/// <param name="count">Number of buffers</param>
+	/// <returns>False if the memory couldn't be mapped or buffers are still in use</returns>
+	bool Reserve(size_t bufferSize, size_t count);
+
+	/// <summary>
+	/// Takes a buffer from the pool
+	/// </summary>
+	/// <returns>The buffer or nullptr if they are all in use</returns>
+	unsigned char* Acquire();
+
+	/// <summary>
+	/// Gives a buffer back to the pool
+	/// </summary>
+	void Release(unsigned char* buffer);
+
+	/// <summary>
+	/// Size of each buffer, 0 if nothing is reserved
+	/// </summary>
+	size_t GetBufferSize() const { return bufferSize; }
+
+	/// <summary>
+	/// The whole mapping, for registering it with an IoQueue
+	/// </summary>
+	unsigned char* GetBase() const { return base; }
+	size_t GetMappedSize() const { return mappedSize; }
+
+	/// <summary>
+	/// Gets the memory usage so far
+	/// </summary>
+	BufferArenaStats GetStats();
+
+private:
+	unsigned char* base;
+	size_t mappedSize;
+	size_t bufferSize;
+
+	std::mutex mutex;
+	std::vector<unsigned char*> freeBuffers;
+	size_t bufferCount;
+
+	BufferArenaStats stats;
+
+	/// <summary>
+	/// Unmaps the pool
+	/// </summary>
+	void Unmap();
+};
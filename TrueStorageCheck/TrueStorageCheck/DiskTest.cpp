@@ -5,7 +5,15 @@
  */
 #include "DiskTest.hpp"
 
+#include "AlignedBuffer.hpp"
+#include "BufferArena.hpp"
+#include "PatternGenerator.hpp"
+#include "WorkerPool.hpp"
+
 #include <ctime>
+#include <cmath>
+#include <cstring>
+#include <deque>
 #include <random>
 #include <fstream>
 #include <sstream>
@@ -23,80 +31,657 @@
 
 #define BYTES_TO_MB(x) (x / (1024 * 1024))
 
-// For now we will always test in this block size, we write 512MB at a time
+// Default test file size, see SetTestFileSize
 const unsigned long long DATA_WRITE_SIZE = 512 * (1024 * 1024);
 
 // This is the maximum amount of random data we generate at a time
 const unsigned long long MAX_RAND_DATA_SIZE = 64 * (1024 * 1024);
 
-// Used for fast data generation
-const int MAX_NUM_THREADS = std::thread::hardware_concurrency(); // Get number of supported concurrent threads
+// Least time between two progress events in the queue / two progress callbacks
+const std::chrono::milliseconds EVENT_INTERVAL(250);
+const std::chrono::milliseconds CALLBACK_INTERVAL(250);
+
+// Size of each block written by the capacity probe, a page covers any sector size
+const unsigned long long PROBE_BLOCK_SIZE = 4096;
+
+// Random offsets probed on top of the log spaced ones
+const int PROBE_RANDOM_BLOCKS = 32;
+
+// Tries at re-opening the device after the probe blocks are written, without it they can't be put back
+const int PROBE_REOPEN_ATTEMPTS = 5;
+
+// Kept in TSC_Files next to the test files, see WriteManifest
+const char* MANIFEST_NAME = "TSC_Manifest.txt";
+const int MANIFEST_VERSION = 1;
+
+// Upper bounds of the manifest header and of its line per test file, room for it is left when testing all free space
+const unsigned long long MANIFEST_HEADER_SIZE = 256;
+const unsigned long long MANIFEST_LINE_SIZE = 128;
+
+// Destructive test and probe seed, there's no file name to go by
+const char* DEVICE_SEED_NAME = "TSC_Device";
+
+// Data generation is split in tasks of this size for the worker pool, small enough to balance well across threads
+const size_t GENERATE_TASK_SIZE = 1024 * 1024;
+
+// Files read at the same time by the final verification, each reader holds a chunk buffer
+const unsigned int VERIFY_READERS = 4;
+
+// Failed Reap calls in a row (10ms apart) TransferRequests waits through for the requests still in flight
+const int REAP_RETRIES = 100;
+
+// I/O calibration, see SetIoAutoTune. Request sizes are tried at CALIBRATION_FIRST_DEPTH first, then the depths
+// at the best size. Every combination gets at least one chunk and up to CALIBRATION_SIZE or CALIBRATION_TIME of writes
+const unsigned long long CALIBRATION_REQUEST_SIZES[] = { 256 * 1024, 1024 * 1024, 4 * (1024 * 1024), 16 * (1024 * 1024) };
+const unsigned int CALIBRATION_DEPTHS[] = { 1, 2, 4, 8, 16, 32 };
+const unsigned int CALIBRATION_FIRST_DEPTH = 4;
+const unsigned long long CALIBRATION_CHUNK_SIZE = 16 * (1024 * 1024);
+const unsigned long long CALIBRATION_SIZE = 64 * (1024 * 1024);
+const std::chrono::milliseconds CALIBRATION_TIME(250);
+const char* CALIBRATION_FILE_NAME = "TSC_Calibration.tmp";
 
 #define up "This should never be the C drive."
 
 DiskTest::DiskTest(char driveLetter, unsigned long long capacityToTest, bool stopOnFirstError, bool deleteTempFiles, bool writeLogFile, ProgressDelegate callback)
+	// I keep forgetting I can't just go + on C++
+	: DiskTest(std::string(1, driveLetter) + ":\\", capacityToTest, stopOnFirstError, deleteTempFiles, writeLogFile, callback)
 {
-	if (driveLetter == 'C' || driveLetter == 'c') throw up;
+}
 
-	// I keep forgetting I can't just go + on C++
-	Path = std::string(1, driveLetter) + ":\\";
+DiskTest::DiskTest(const std::string& path, unsigned long long capacityToTest, bool stopOnFirstError, bool deleteTempFiles, bool writeLogFile, ProgressDelegate callback)
+{
+#ifdef _WIN32
+	if (path.empty() || path[0] == 'C' || path[0] == 'c') throw up;
+#else
+	if (path.empty() || path == "/") throw up;
+#endif
+
+	Path = path;
+
+	// Everything else expects a trailing separator
+	if (Path.back() != PATH_SEPARATOR[0])
+		Path += PATH_SEPARATOR;
+
+	ioBackend = IoBackend::CreateNative();
+	ioQueueDepth = 1;
+	ioRequestSize = MAX_RAND_DATA_SIZE;
+	ioBuffers[0] = ioBuffers[1] = nullptr;
+	verifyReaders = VERIFY_READERS;
+	testFileSize = DATA_WRITE_SIZE;
+	ioAutoTune = true;
+	ioTuned = false;
+	ioTunedSpeed = 0;
+
+	// Tells our tags apart from the ones an earlier run left on the disk
+	sectorTagging = false;
+	runId = std::random_device()();
+
+	probeLowerBound = probeUpperBound = 0;
+
+	testRunning = cancelRequested = false;
+	asyncRunning = false;
+
+	this->capacityToTest = capacityToTest * (1024 * 1024);
+	this->stopOnFirstError = stopOnFirstError;
+	this->deleteTempFiles = deleteTempFiles;
+	this->writeLogFile = writeLogFile;
+	progressCallback = callback;
+	CurrentState = lastReportedState = State_Waiting;
+	CurrentProgress = 0;
 
-	testRunning = false;
+	maxCapacity = dataBlockSize = currentFileSize = 0;
+	bytesWritten = bytesToVerify = 0;
 
-	if (capacityToTest != 0)
-		capacityToTest = capacityToTest * (1024 * 1024);
+	bytesVerified = bealBytesVerified = 0;
+}
 
-	stopOnFirstError = stopOnFirstError;
-	deleteTempFiles = deleteTempFiles;
-	writeLogFile = writeLogFile;
-	progressCallback = callback;
-	CurrentState = State_Waiting;
-	CurrentProgress = 0;
+DiskTest::~DiskTest()
+{
+	ForceStopTest();
+	JoinWorker();
+}
+
+void DiskTest::SetIoBackend(std::shared_ptr<IoBackend> backend)
+{
+	if (!testRunning && backend != nullptr)
+	{
+		ioBackend = backend;
+		ioQueue.reset();
+	}
+}
+
+void DiskTest::SetIoQueueDepth(unsigned int depth)
+{
+	if (!testRunning && depth > 0)
+	{
+		ioQueueDepth = depth;
+		ioQueue.reset();
+	}
+}
+
+void DiskTest::SetIoRequestSize(unsigned long long size)
+{
+	if (!testRunning && size > 0)
+		ioRequestSize = size;
+}
+
+void DiskTest::SetIoAutoTune(bool enabled)
+{
+	if (!testRunning)
+		ioAutoTune = enabled;
+}
+
+byte DiskTest::GetIoTuning(unsigned long long* requestSize, unsigned int* queueDepth, double* speed)
+{
+	*requestSize = ioRequestSize;
+	*queueDepth = ioQueueDepth;
+	*speed = ioTuned ? ioTunedSpeed : 0;
+
+	return ioTuned;
+}
+
+void DiskTest::SetVerifyReaders(unsigned int readers)
+{
+	if (!testRunning && readers > 0)
+		verifyReaders = readers;
+}
+
+void DiskTest::SetTestFileSize(unsigned long long size)
+{
+	if (!testRunning)
+		testFileSize = size;
+}
+
+void DiskTest::SetIoGate(std::shared_ptr<IoGate> gate)
+{
+	if (!testRunning)
+		ioGate = gate;
+}
+
+std::string DiskTest::GetBusGroup()
+{
+	return ioBackend->GetBusGroup(Path);
+}
+
+bool DiskTest::PrepareIo(unsigned long long chunkSize)
+{
+	bool reallocated = false;
+
+	// The pool only grows, in practice it's sized once by the first chunk of the test
+	if (ioArena.GetBufferSize() < chunkSize)
+	{
+		for (auto& buffer : ioBuffers)
+		{
+			ioArena.Release(buffer);
+			buffer = nullptr;
+		}
+
+		if (!ioArena.Reserve((size_t)chunkSize, 2))
+			return false;
+
+		ioBuffers[0] = ioArena.Acquire();
+		ioBuffers[1] = ioArena.Acquire();
+		reallocated = true;
+	}
+
+	if (ioQueue == nullptr)
+	{
+		ioQueue = ioBackend->CreateQueue(ioQueueDepth);
+		reallocated = true;
+	}
+
+	// Lets io_uring skip mapping the buffers on every request, the arena is a single mapping
+	if (reallocated)
+		ioQueue->RegisterBuffers({ { ioArena.GetBase(), ioArena.GetMappedSize() } });
+
+	return true;
+}
+
+void DiskTest::SetSectorTagging(bool enabled)
+{
+	if (!testRunning)
+		sectorTagging = enabled;
+}
+
+const AliasMap& DiskTest::GetAliasMap()
+{
+	return aliasMap;
+}
+
+BufferArenaStats DiskTest::GetBufferStats()
+{
+	BufferArenaStats stats = ioArena.GetStats();
+	BufferArenaStats verifyStats = verifyArena.GetStats();
+
+	// The readers' pool only exists while the test's own is at its largest, the peaks add up
+	stats.reservedBytes += verifyStats.reservedBytes;
+	stats.peakReservedBytes += verifyStats.peakReservedBytes;
+	stats.inUseBytes += verifyStats.inUseBytes;
+	stats.peakInUseBytes += verifyStats.peakInUseBytes;
+	stats.acquireCount += verifyStats.acquireCount;
+	stats.failedAcquireCount += verifyStats.failedAcquireCount;
+
+	return stats;
+}
+
+bool DiskTest::TransferChunk(IoFile* file, bool write, unsigned long long offset, unsigned char* data, unsigned long long size, IoQueue* queue, unsigned long long requestSize)
+{
+	// Devices sharing a bus take turns, see TestScheduler
+	IoGate::Slot slot(ioGate.get(), ioUsage, size);
+
+	{
+		std::lock_guard<std::mutex> lock(activeFileMutex);
+		activeFiles.push_back(file);
+	}
+
+	bool ret = TransferRequests(queue != nullptr ? queue : ioQueue.get(), file, write, offset, data, size, requestSize != 0 ? requestSize : ioRequestSize);
+
+	{
+		std::lock_guard<std::mutex> lock(activeFileMutex);
+		activeFiles.erase(std::find(activeFiles.begin(), activeFiles.end(), file));
+	}
+
+	return ret;
+}
+
+bool DiskTest::CalibrateIo(const std::string& filePath)
+{
+	unsigned long long chunkSize = std::min<unsigned long long>(CALIBRATION_CHUNK_SIZE, ioArena.GetBufferSize());
+	chunkSize -= chunkSize % dataBlockSize;
+
+	// Not worth it on a tiny test, and the scratch file has to fit
+	if (chunkSize == 0 || capacityToTest < CALIBRATION_SIZE)
+		return false;
+
+	std::unique_ptr<IoFile> file = ioBackend->Open(filePath, IoOpenMode::CreateAlways);
+
+	if (file == nullptr)
+		return false;
+
+	// Same kind of data as the test, a controller that compresses would look faster with anything simpler
+	unsigned char* data = ioBuffers[0];
+	TaskGroup generating;
+
+	GenerateDataAsync(generating, data, (size_t)chunkSize, GetPattern(GetFileSeed(filePath), 0), 0);
+	WorkerPool::Instance().Wait(generating);
+
+	// Requests of a synchronous queue run one at a time whatever the depth, only the request size is worth trying there
+	bool asynchronous = ioQueue->IsAsynchronous();
+
+	unsigned long long bestRequestSize = 0;
+	unsigned int bestDepth = 0;
+	double bestSpeed = 0;
+	bool ret = true;
+
+	auto measure = [&](unsigned long long requestSize, unsigned int depth) {
+
+		double speed = MeasureIo(file.get(), data, chunkSize, requestSize, depth);
+
+		if (speed < 0)
+			ret = false;
+		else if (speed > bestSpeed)
+		{
+			bestRequestSize = requestSize;
+			bestDepth = depth;
+			bestSpeed = speed;
+		}
+	};
+
+	unsigned long long lastRequestSize = 0;
+
+	for (unsigned long long requestSize : CALIBRATION_REQUEST_SIZES)
+	{
+		requestSize = std::max<unsigned long long>(requestSize - (requestSize % dataBlockSize), dataBlockSize);
+
+		// Large blocks round several sizes to the same one
+		if (!ret || requestSize > chunkSize || requestSize == lastRequestSize)
+			continue;
+
+		lastRequestSize = requestSize;
+
+		// A chunk can't keep more requests in flight than it's split in
+		measure(requestSize, asynchronous ? (unsigned int)std::min<unsigned long long>(CALIBRATION_FIRST_DEPTH, chunkSize / requestSize) : 1);
+	}
+
+	unsigned long long requestSize = bestRequestSize;
+	unsigned int measuredDepth = bestDepth;
+
+	for (unsigned int depth : CALIBRATION_DEPTHS)
+	{
+		if (!ret || !asynchronous || requestSize == 0 || depth == measuredDepth || depth > chunkSize / requestSize)
+			continue;
+
+		measure(requestSize, depth);
+	}
+
+	file.reset();
+	ioBackend->RemoveFile(filePath);
+
+	// Calibration requests aren't part of the test
+	writeLatency.Clear();
+	readLatency.Clear();
+
+	if (!ret || bestSpeed == 0)
+		return false;
+
+	ioRequestSize = bestRequestSize;
+	ioTunedSpeed = bestSpeed;
 
-	averageReadSpeed = averageWriteSpeed = 0;
-	bytesVerified = 0;
+	if (asynchronous)
+	{
+		ioQueueDepth = bestDepth;
+
+		// Created again with the new depth by the next PrepareIo
+		ioQueue.reset();
+	}
+
+	return true;
+}
+
+double DiskTest::MeasureIo(IoFile* file, unsigned char* data, unsigned long long chunkSize, unsigned long long requestSize, unsigned int depth)
+{
+	std::unique_ptr<IoQueue> queue = ioBackend->CreateQueue(depth);
+	queue->RegisterBuffers({ { ioArena.GetBase(), ioArena.GetMappedSize() } });
+
+	// Flushed after every chunk just like the test does
+	unsigned long long written = 0;
+	auto writeStart = std::chrono::steady_clock::now();
+
+	while (testRunning && (written == 0 || (written < CALIBRATION_SIZE && std::chrono::steady_clock::now() - writeStart < CALIBRATION_TIME)))
+	{
+		if (!TransferChunk(file, true, written, data, chunkSize, queue.get(), requestSize) || !file->Flush())
+			return -1;
+
+		written += chunkSize;
+	}
+
+	auto writeEnd = std::chrono::steady_clock::now();
+
+	if (!testRunning)
+		return -1;
+
+	double seconds = std::chrono::duration<double>(writeEnd - writeStart).count();
 
-	totalWriteDuration = 0;
-	totalReadDuration = 0;
+	return seconds > 0 ? BYTES_TO_MB((double)written) / seconds : 0;
 }
 
-void GenerateDataThread(std::vector<unsigned char>& data, size_t start, size_t end, unsigned long long seed)
+bool DiskTest::TransferRequests(IoQueue* queue, IoFile* file, bool write, unsigned long long offset, unsigned char* data, unsigned long long size, unsigned long long requestSize)
 {
-	// LCG - 32b
-	std::minstd_rand generator(seed);
-	for (size_t i = start; i < end;)
+	LatencyHistogram& latency = write ? writeLatency : readLatency;
+
+	if (queue == nullptr)
+	{
+		auto start = std::chrono::steady_clock::now();
+		bool ret = write ? file->Write(offset, data, size) : file->Read(offset, data, size);
+
+		latency.Record((unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+		return ret;
+	}
+
+	// Requests are kept block aligned, the last one takes whatever is left
+	requestSize = std::max<unsigned long long>(requestSize - (requestSize % dataBlockSize), dataBlockSize);
+	unsigned int depth = queue->GetDepth();
+
+	unsigned long long submitted = 0;
+	unsigned int inFlight = 0;
+	int reapFailures = 0;
+	bool success = true;
+
+	IoCompletion completions[64];
+
+	while (inFlight > 0 || (success && submitted < size && testRunning))
 	{
-		unsigned int rand_val = generator();
-		for (size_t j = 0; j < 4 && i < end; ++j, ++i)
+		// Keep the queue full, once the test is stopped only what is already in flight is waited for
+		while (success && submitted < size && inFlight < depth && testRunning)
+		{
+			IoRequest request;
+			request.file = file;
+			request.write = write;
+			request.offset = offset + submitted;
+			request.pData = data + submitted;
+			request.size = (size_t)std::min<unsigned long long>(requestSize, size - submitted);
+			// Submission time, so the latency of each request can be told when it completes
+			request.userData = (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+
+			if (!queue->Submit(request))
+			{
+				success = false;
+				break;
+			}
+
+			submitted += request.size;
+			inFlight++;
+		}
+
+		if (inFlight == 0)
+			break;
+
+		int count = queue->Reap(completions, 64, 1);
+
+		// The requests still in flight use our buffers, nothing new is submitted but they are waited for as long as
+		// the queue gives them back. Only a queue that stays broken is given up on
+		if (count < 0)
+		{
+			success = false;
+
+			if (++reapFailures >= REAP_RETRIES)
+				return false;
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			continue;
+		}
+
+		reapFailures = 0;
+
+		unsigned long long now = (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+
+		for (int i = 0; i < count; i++)
 		{
-			data[i] = (rand_val >> (j * 8)) & 0xFF;
+			success &= completions[i].success;
+			latency.Record(now - completions[i].userData);
 		}
+
+		inFlight -= count;
+	}
+
+	return success && submitted == size;
+}
+
+void DiskTest::GenerateData(unsigned char* data, size_t size, const PatternGenerator& pattern, unsigned long long offset)
+{
+	// Small requests (quick checks) aren't worth a round trip through the pool
+	if (size <= GENERATE_TASK_SIZE)
+	{
+		pattern.Fill(data, size, offset);
+		return;
+	}
+
+	TaskGroup group;
+	GenerateDataAsync(group, data, size, pattern, offset);
+	WorkerPool::Instance().Wait(group);
+}
+
+void DiskTest::GenerateDataAsync(TaskGroup& group, unsigned char* data, size_t size, const PatternGenerator& pattern, unsigned long long offset)
+{
+	// Counter based, so every task generates its own part and the result doesn't depend on how it's split
+	for (size_t start = 0; start < size; start += GENERATE_TASK_SIZE)
+	{
+		size_t end = std::min<size_t>(start + GENERATE_TASK_SIZE, size);
+
+		WorkerPool::Instance().Submit(group, [=] {
+			pattern.Fill(data + start, end - start, offset + start);
+		});
 	}
 }
 
-#pragma optimize( "s", on )
-void DiskTest::GenerateData(std::vector<unsigned char>& data, const std::string& seed)
+size_t DiskTest::CompareData(const unsigned char* data, size_t size, const PatternGenerator& pattern, unsigned long long offset)
+{
+	if (size <= GENERATE_TASK_SIZE)
+		return pattern.Compare(data, size, offset);
+
+	// Lowest mismatch found so far, tasks past it have nothing left to tell us
+	std::atomic<size_t> firstMismatch(size);
+	size_t taskCount = (size + GENERATE_TASK_SIZE - 1) / GENERATE_TASK_SIZE;
+
+	WorkerPool::Instance().ParallelFor(taskCount, [&](size_t task) {
+		size_t start = task * GENERATE_TASK_SIZE;
+
+		if (start >= firstMismatch.load(std::memory_order_relaxed))
+			return;
+
+		size_t end = std::min<size_t>(start + GENERATE_TASK_SIZE, size);
+		size_t mismatch = pattern.Compare(data + start, end - start, offset + start);
+
+		if (mismatch == end - start)
+			return;
+
+		size_t position = start + mismatch;
+		size_t current = firstMismatch.load(std::memory_order_relaxed);
+		while (position < current && !firstMismatch.compare_exchange_weak(current, position, std::memory_order_relaxed));
+	});
+
+	return firstMismatch.load();
+}
+
+unsigned long long DiskTest::GetFileSeed(const std::string& filePath)
+{
+	char runIdText[9];
+	snprintf(runIdText, sizeof(runIdText), "%08x", runId);
+
+	return PatternGenerator::SeedFromString(std::string(runIdText) + "/" + std::filesystem::path(filePath).filename().string());
+}
+
+bool DiskTest::WriteManifest()
+{
+	std::ostringstream manifest;
+	manifest << "TSC_MANIFEST " << MANIFEST_VERSION << "\n";
+	manifest << "run " << std::hex << runId << std::dec << "\n";
+	manifest << "tags " << (sectorTagging ? 1 : 0) << "\n";
+	manifest << "date " << GetReadableDateTime() << "\n";
+
+	for (const auto& testFile : testFiles)
+		manifest << "file " << testFile->TotalSize << " " << testFile->StreamOffset << " " << std::filesystem::path(testFile->Path).filename().string() << "\n";
+
+	// Written like everything else, unbuffered, so it's padded to whole blocks
+	std::string content = manifest.str();
+	size_t size = (size_t)((content.size() + dataBlockSize - 1) / dataBlockSize * dataBlockSize);
+
+	AlignedBuffer buffer(size);
+	memset(buffer.data(), '\n', size);
+	memcpy(buffer.data(), content.data(), content.size());
+
+	std::unique_ptr<IoFile> file = ioBackend->Open(Path + "TSC_Files" + PATH_SEPARATOR + MANIFEST_NAME, IoOpenMode::CreateAlways);
+
+	return file != nullptr && file->Write(0, buffer.data(), size) && file->Flush();
+}
+
+bool DiskTest::LoadManifest()
 {
-	// LCG - 32 - Multithreaded
-	std::hash<std::string> hasher;
-	unsigned long long hashed_seed = hasher(seed);
-	std::minstd_rand seed_generator(hashed_seed);
-	std::vector<std::thread> threads;
+	std::string directoryPath = Path + "TSC_Files" + PATH_SEPARATOR;
+	std::unique_ptr<IoFile> file = ioBackend->Open(directoryPath + MANIFEST_NAME, IoOpenMode::ReadOnly);
+
+	if (file == nullptr)
+		return false;
+
+	unsigned long long size = file->GetSize();
+
+	if (size == 0 || size % dataBlockSize != 0 || size > MAX_RAND_DATA_SIZE)
+		return false;
+
+	AlignedBuffer buffer((size_t)size);
+
+	if (!file->Read(0, buffer.data(), (size_t)size))
+		return false;
+
+	std::istringstream manifest(std::string(reinterpret_cast<const char*>(buffer.data()), (size_t)size));
+	std::string line;
+	std::string type;
+	int version = 0;
+
+	manifest >> type >> version;
+
+	if (type != "TSC_MANIFEST" || version != MANIFEST_VERSION)
+		return false;
+
+	std::vector<TestFile*> files;
+	bool hasRunId = false;
+
+	while (std::getline(manifest, line))
+	{
+		std::istringstream fields(line);
+
+		if (!(fields >> type))
+			continue;
+
+		if (type == "run")
+			hasRunId = (bool)(fields >> std::hex >> runId);
+		else if (type == "tags")
+		{
+			int tags = 0;
+			fields >> tags;
+			sectorTagging = tags != 0;
+		}
+		else if (type == "file")
+		{
+			unsigned long long fileSize = 0, streamOffset = 0;
+			std::string name;
+
+			fields >> fileSize >> streamOffset;
+			fields.get();
+			std::getline(fields, name);
+
+			if (fields.fail() || name.empty())
+				continue;
 
-	// Adjust chunk size
-	size_t chunk_size = (data.size() / MAX_NUM_THREADS);
-	size_t remaining = data.size() % MAX_NUM_THREADS;
+			files.push_back(new TestFile(directoryPath + name, fileSize, 0, streamOffset));
+		}
+	}
 
-	for (int i = 0; i < MAX_NUM_THREADS; ++i)
+	// Seeds need the run ID, which may only come after the files
+	for (auto& testFile : files)
 	{
-		size_t start = i * chunk_size;
-		size_t end = (i != MAX_NUM_THREADS - 1) ? start + chunk_size : data.size();
-		unsigned long long thread_seed = (static_cast<unsigned long long>(seed_generator()) << 32) | seed_generator();
-		threads.push_back(std::thread(GenerateDataThread, std::ref(data), start, end, thread_seed));
+		testFile->Seed = GetFileSeed(testFile->Path);
+
+		if (hasRunId)
+			testFiles.push_back(testFile);
+		else
+			delete testFile;
 	}
 
-	for (auto& thread : threads)
-		thread.join();
+	return hasRunId && !testFiles.empty();
+}
+
+PatternGenerator DiskTest::GetPattern(unsigned long long seed, unsigned long long baseAddress)
+{
+	PatternGenerator pattern(seed);
+
+	if (sectorTagging)
+		pattern.SetSectorTags(runId, baseAddress);
+
+	return pattern;
+}
+
+void DiskTest::RecordAliasing(const unsigned char* data, size_t size, const PatternGenerator& pattern, unsigned long long offset)
+{
+	const size_t sectorSize = PatternGenerator::SECTOR_SIZE;
+
+	// Only whole sectors carry a tag
+	for (size_t position = 0; position + sectorSize <= size; position += sectorSize)
+	{
+		if (pattern.Compare(data + position, sectorSize, offset + position) == sectorSize)
+			continue;
+
+		unsigned long long address = pattern.GetSectorAddress(offset + position);
+		unsigned long long foundAddress;
+
+		// The verification readers add to the map at the same time
+		std::lock_guard<std::mutex> lock(aliasMapMutex);
+
+		if (PatternGenerator::ReadSectorTag(data + position, runId, &foundAddress) && foundAddress != address)
+			aliasMap.AddAliased(address, foundAddress);
+		else
+			aliasMap.AddLost(address);
+	}
 }
 
 
@@ -114,37 +699,23 @@ void DiskTest::DeleteAllFilesAndDirectories()
 
 void DiskTest::RemoveDirectory(const std::string& path)
 {
-	if (std::filesystem::exists(path) && std::filesystem::is_directory(path)) {
-		try {
-			std::filesystem::remove_all(path);
-
-			// Removal succeeded, now flush any cached data
-			HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
-			if (handle != INVALID_HANDLE_VALUE) {
-				FlushFileBuffers(handle);
-				CloseHandle(handle);
-			}
-		}
-		catch (const std::exception& ex) {}
-	}
+	ioBackend->RemoveTree(path);
 }
 
-unsigned long DiskTest::GetFileSize(const std::string& filePath)
+unsigned long long DiskTest::GetFileSize(const std::string& filePath)
 {
-	WIN32_FILE_ATTRIBUTE_DATA fileInfo;
-	if (!GetFileAttributesExA(filePath.c_str(), GetFileExInfoStandard, &fileInfo))
-		return 0;
+	std::unique_ptr<IoFile> file = ioBackend->Open(filePath, IoOpenMode::ReadOnly);
 
-	ULARGE_INTEGER fileSize;
-	fileSize.LowPart = fileInfo.nFileSizeLow;
-	fileSize.HighPart = fileInfo.nFileSizeHigh;
+	if (file == nullptr)
+		return 0;
 
-	return static_cast<unsigned long>(fileSize.QuadPart);
+	return file->GetSize();
 }
 
 void DiskTest::CalculateProgress() {
 
-	if (bytesWritten == 0 || bytesVerified == 0)
+	// Verify only tests have nothing to write
+	if (bytesVerified == 0 || (bytesWritten == 0 && capacityToTest != 0))
 		CurrentProgress = 0;
 	else
 	{
@@ -171,25 +742,103 @@ void DiskTest::WriteLogToFile(bool success) {
 }
 
 
-byte DiskTest::PerformTest()
+void DiskTest::SetJournalPath(const std::string& path)
 {
-	// Tests are non re-usable for now
-	if (testRunning || CurrentState != State_Waiting) return false;
+	if (!testRunning)
+		journalPath = path;
+}
 
-	testRunning = true;
+byte DiskTest::SetTraceFile(const std::string& path)
+{
+	if (testRunning)
+		return false;
+
+	if (path.empty())
+	{
+		trace.Close();
+		return true;
+	}
+
+	return trace.Open(path);
+}
+
+void DiskTest::TraceChunk(TracePhase phase, unsigned long long offset, unsigned long long bytes, std::chrono::high_resolution_clock::duration duration)
+{
+	if (!trace.IsOpen())
+		return;
+
+	TraceRecord record;
+	record.phase = phase;
+	record.offset = offset;
+	record.bytes = bytes;
+	record.durationNs = (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+
+	trace.Add(record);
+}
+
+byte DiskTest::CanResume()
+{
+	JournalState state;
+	return !testRunning && CurrentState == State_Waiting && LoadJournal(&state);
+}
+
+bool DiskTest::LoadJournal(JournalState* state)
+{
+	if (journalPath.empty() || !TestJournal::Load(journalPath, state))
+		return false;
+
+	if (state->finished || state->testPath != Path || state->requestedCapacity != capacityToTest)
+		return false;
+
+	// Gone or cut short since, we'd be trusting data that isn't there
+	for (const auto& journalFile : state->files)
+	{
+		std::unique_ptr<IoFile> file = ioBackend->Open(Path + "TSC_Files" + PATH_SEPARATOR + journalFile.name, IoOpenMode::ReadOnly);
+
+		if (file == nullptr || file->GetSize() != journalFile.size)
+			return false;
+	}
+
+	return true;
+}
+
+byte DiskTest::PerformTest()
+{
+	// Tests are non re-usable for now
+	if (!BeginTest()) return false;
 
 	std::string tempDirectoryPath = "TSC_Files";
 
-	// Delete any temporary data that can eventually already exist, then flush the changes
-	this->DeleteTestFiles();
+	// Left over by an interrupted run of this same test, what it wrote and checked is kept
+	JournalState resumeState;
+	bool resuming = LoadJournal(&resumeState);
+	unsigned long long requestedCapacity = capacityToTest;
+
+	if (resuming)
+	{
+		// Whatever isn't in the journal was cut short, the space it takes is needed
+		std::error_code error;
+		for (const auto& entry : std::filesystem::directory_iterator(Path + tempDirectoryPath, error))
+		{
+			std::string name = entry.path().filename().string();
+
+			if (name != MANIFEST_NAME && std::none_of(resumeState.files.begin(), resumeState.files.end(), [&](const JournalFile& journalFile) { return journalFile.name == name; }))
+				std::filesystem::remove_all(entry.path(), error);
+		}
+	}
+	else
+	{
+		// Delete any temporary data that can eventually already exist, then flush the changes
+		this->DeleteTestFiles();
+	}
 
 	// Create the directory, this sometimes fails so we retry it
 	for (size_t i = 0; i < 3; i++)
 	{
-		if (CreateDirectoryA((Path + tempDirectoryPath).c_str(), nullptr))
+		if (ioBackend->MakeDirectory(Path + tempDirectoryPath))
 			break;
 		else
-			Sleep(100);
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
 	}
 
 	// Vector to store temp files that will be later deleted
@@ -201,280 +850,1247 @@ byte DiskTest::PerformTest()
 	dataBlockSize = GetDataBlockSize(Path);
 
 	if (dataBlockSize == 0)
+	{
+		CurrentState = State_Error;
+		ReportProgress(CurrentState);
+
+		testRunning = false;
 		return false;
+	}
 
-	if (capacityToTest == 0)
+	if (resuming)
+	{
+		// Same capacity, run ID and tags as before, otherwise the files already written wouldn't verify
+		capacityToTest = resumeState.capacity;
+		runId = resumeState.runId;
+		sectorTagging = resumeState.sectorTagging;
+	}
+	else if (capacityToTest == 0)
 		capacityToTest = freeSpace;
 
 
-	// Ammount of data to write at a time
-	unsigned long long sizeToWrite = std::min<unsigned long long>(this->capacityToTest, DATA_WRITE_SIZE);
+	// Ammount of data to write at a time, a whole number of blocks and no more than the filesystem takes in one file
+	unsigned long long fileSize = testFileSize != 0 ? testFileSize : capacityToTest;
+	unsigned long long maxFileSize = ioBackend->GetMaxFileSize(Path);
+
+	if (maxFileSize != 0)
+		fileSize = std::min(fileSize, maxFileSize);
+
+	fileSize = std::max<unsigned long long>(fileSize - (fileSize % dataBlockSize), dataBlockSize);
+
+	// All the free space is everything but the manifest, it's rewritten after every file and would leave the last one short
+	if (!resuming && requestedCapacity == 0)
+	{
+		unsigned long long manifestSize = MANIFEST_HEADER_SIZE + (capacityToTest + fileSize - 1) / fileSize * MANIFEST_LINE_SIZE;
+		manifestSize = (manifestSize + dataBlockSize - 1) / dataBlockSize * dataBlockSize;
+
+		capacityToTest -= std::min(capacityToTest, manifestSize);
+	}
+
+	unsigned long long sizeToWrite = std::min<unsigned long long>(this->capacityToTest, fileSize);
 
-	// Calculate data to verify
-	// These are proximate values only, this needs a better description (and possibly a better implementation)
-	unsigned long long extraVerificationSize = floor(capacityToTest / DATA_WRITE_SIZE) * dataBlockSize;
-	bytesToVerify = stopOnFirstError ? ((capacityToTest * 2) + extraVerificationSize) : capacityToTest + (sizeToWrite * 3);
+	// Calculate data to verify, the time remaining is based on it: the final verification, the first chunk
+	// read back once for an early read speed (not when resuming, that file is already there) and with StopOnFirstError
+	// the first block of the file re-read after every chunk
+	unsigned long long chunkChecks = stopOnFirstError ? (capacityToTest + MAX_RAND_DATA_SIZE - 1) / MAX_RAND_DATA_SIZE : 0;
+	unsigned long long sampleSize = resuming && !resumeState.files.empty() ? 0 : GetChunkSize(sizeToWrite);
+	bytesToVerify = capacityToTest + sampleSize + chunkChecks * dataBlockSize;
 
 	unsigned long long totalDataWritten = 0;
 	unsigned long long totalDataToWrite = capacityToTest;
 
 	unsigned long long dataLeftToWrite = capacityToTest;
 
-	if (freeSpace < totalDataToWrite)
+	if (resuming)
+	{
+		for (const auto& journalFile : resumeState.files)
+		{
+			std::string filePath = Path + tempDirectoryPath + PATH_SEPARATOR + journalFile.name;
+
+			TestFile* testFile = new TestFile(filePath, journalFile.size, GetFileSeed(filePath), journalFile.streamOffset);
+			testFile->Verified = journalFile.verified;
+			testFiles.push_back(testFile);
+
+			totalDataWritten += journalFile.size;
+			bytesWritten += journalFile.size;
+		}
+
+		dataLeftToWrite -= std::min(dataLeftToWrite, totalDataWritten);
+	}
+
+	if (freeSpace < dataLeftToWrite)
+	{
+		CurrentState = State_Error;
+		ReportProgress(CurrentState);
+
+		testRunning = false;
+		return false;
+	}
+
+	if (!journalPath.empty())
+	{
+		if (resuming)
+			journal.Continue(journalPath, resumeState);
+		else
+		{
+			JournalState state;
+			state.testPath = Path;
+			state.requestedCapacity = requestedCapacity;
+			state.capacity = capacityToTest;
+			state.runId = runId;
+			state.sectorTagging = sectorTagging;
+
+			// Not being able to keep a journal only means the test can't be resumed
+			journal.Create(journalPath, state);
+		}
+	}
+
+	// Sizes the buffer pool for the whole test
+	if (!PrepareIo(std::min<unsigned long long>(sizeToWrite, MAX_RAND_DATA_SIZE)))
+	{
+		// Nothing new was written, the journal stays as it was
+		journal.Close();
+
+		CurrentState = State_Error;
+		ReportProgress(CurrentState);
+
+		testRunning = false;
+		return false;
+	}
+
+	CurrentState = State_InProgress;
+	speedEstimator.SetPhase(SpeedPhase::Write);
+
+	ReportProgress(State_InProgress);
+
+	// Resumed files already sit where the calibration would write
+	ioTuned = false;
+
+	if (ioAutoTune && testFiles.empty())
+		ioTuned = CalibrateIo(Path + tempDirectoryPath + PATH_SEPARATOR + CALIBRATION_FILE_NAME);
+
+	bool ret = true;
+
+	while (!IsDriveFull() && testRunning && (totalDataWritten < totalDataToWrite))
+	{
+		if (dataLeftToWrite < sizeToWrite)
+			sizeToWrite = dataLeftToWrite;
+
+		std::string fileName = GenerateTestFileName();
+		std::string filePath = Path + tempDirectoryPath + PATH_SEPARATOR + fileName;
+
+		// Write the test file
+		auto dataWritten = WriteAndVerifyTestFile(filePath, sizeToWrite, stopOnFirstError);
+
+		if (dataWritten < sizeToWrite)
+		{
+			bytesVerified = dataWritten;
+			ret = false;
+		}
+
+		// If StopOnFirstError is true, every time we finish writing a file,
+		// we check the first DataBlock from each file to ensure everything is still fine
+		if (ret && stopOnFirstError)
+		{
+			for (const auto& testFile : testFiles)
+			{
+				if (!InternalVerifyTestFile(testFile->Path, dataBlockSize, false, true))
+				{
+					ret = false;
+					break;
+				}
+			}
+		}
+
+		if (!ret)
+			break;
+
+		if (journal.IsOpen())
+		{
+			JournalFile journalFile;
+			journalFile.name = fileName;
+			journalFile.size = sizeToWrite;
+			journalFile.streamOffset = testFiles.back()->StreamOffset;
+
+			journal.AddFile(journalFile);
+		}
+
+		// Kept up to date so the files can be verified later even if the test doesn't get to the end
+		WriteManifest();
+
+		totalDataWritten += sizeToWrite;
+		dataLeftToWrite -= sizeToWrite;
+
+		ReportProgress(State_InProgress);
+	}
+
+	// Perform final verification
+	if (ret && CurrentState != State_Aborted)
+	{
+		CurrentState = State_Verification;
+		speedEstimator.SetPhase(SpeedPhase::Read);
+
+		ReportProgress(State_Verification);
+
+		ret = VerifyTestFiles(false);
+	}
+
+	// An interrupted test keeps its journal and files so it can be resumed, anything else is done with them
+	bool keepForResume = journal.IsOpen() && CurrentState == State_Aborted;
+
+	if (keepForResume)
+		journal.Close();
+	else if (journal.IsOpen())
+		journal.Finish(ret);
+
+	// Delete all the temporary files
+	if (deleteTempFiles && !keepForResume)
+	{
+		// Delete any temporary data that can eventually already exist, then flush the changes
+		this->RemoveDirectory(Path + tempDirectoryPath);
+
+		// Write log file if needed
+		if (writeLogFile)
+			WriteLogToFile(ret);
+	}
+
+	speedEstimator.SetPhase(SpeedPhase::Idle);
+	CalculateProgress();
+
+	if (CurrentState != State_Aborted)
+		CurrentState = ret ? State_Success : State_Error;
+
+	ReportProgress(CurrentState);
+
+	// Everything traced so far is on the host disk by the time the caller looks at it
+	trace.Flush();
+
+	testRunning = false;
+
+	return ret;
+}
+
+bool DiskTest::InternalVerifyTestFile(const std::string& filePath, unsigned long long fileSize, bool updateRealBytes, bool quickCheck)
+{
+	std::unique_ptr<IoFile> file = ioBackend->Open(filePath, IoOpenMode::ReadOnly);
+
+	if (file == nullptr)
+		return false;
+
+	if (fileSize == 0)
+	{
+		fileSize = file->GetSize();
+
+		if (fileSize == 0)
+			return false;
+	}
+
+	// Tags are based on where the file sits in everything we wrote
+	unsigned long long streamOffset = 0;
+
+	for (const auto& testFile : testFiles)
+	{
+		if (testFile->Path == filePath)
+		{
+			streamOffset = testFile->StreamOffset;
+			break;
+		}
+	}
+
+	return VerifyPattern(file.get(), fileSize, GetPattern(GetFileSeed(filePath), streamOffset), streamOffset, updateRealBytes, quickCheck);
+}
+
+bool DiskTest::VerifyPattern(IoFile* file, unsigned long long size, const PatternGenerator& pattern, unsigned long long streamOffset, bool updateRealBytes, bool quickCheck)
+{
+	unsigned long long totalBytesToRead = size;
+	unsigned long long offset = 0;
+
+	// With tags the final pass keeps reading after a failure, the rest of the data is what the alias map is built from
+	bool finalPass = CurrentState == State_Verification;
+	bool mapAliasing = pattern.HasSectorTags() && finalPass && !stopOnFirstError;
+	bool failed = false;
+
+	while (totalBytesToRead > 0 && testRunning)
+	{
+		size_t chunkSize = (size_t)std::min<unsigned long long>(totalBytesToRead, MAX_RAND_DATA_SIZE);
+
+		// Ensure chunkSize is a multiple of the block size
+		chunkSize = chunkSize - (chunkSize % dataBlockSize);
+
+		if (!PrepareIo(chunkSize))
+			return false;
+
+		unsigned char* fileData = ioBuffers[0];
+
+		auto readStart = std::chrono::high_resolution_clock::now();
+		if (!TransferChunk(file, false, offset, fileData, chunkSize))
+			return false;
+		auto readEnd = std::chrono::high_resolution_clock::now();
+
+		TraceChunk(finalPass ? TracePhase::Verify : TracePhase::Check, streamOffset + offset, chunkSize, readEnd - readStart);
+
+		// Compare the read data with the pattern, only this chunk is regenerated regardless of where it is
+		size_t mismatch = CompareData(fileData, chunkSize, pattern, offset);
+
+		if (mismatch != chunkSize)
+		{
+			// The data is already here, find out where every bad sector of the chunk came from
+			if (pattern.HasSectorTags())
+			{
+				// A sector with someone else's tag is bad as a whole, even if the first bytes of the address happen to match
+				mismatch -= mismatch % PatternGenerator::SECTOR_SIZE;
+
+				// Only the final pass goes into the map, the same sectors may have been read before
+				if (finalPass)
+					RecordAliasing(fileData + mismatch, chunkSize - mismatch, pattern, offset + mismatch);
+			}
+
+			if (!failed)
+			{
+				bytesVerified += mismatch;
+
+				if (updateRealBytes)
+					bealBytesVerified += mismatch;
+			}
+			else
+			{
+				// Only read for the alias map now, still counts towards the read speed
+				speedEstimator.AddSample(false, chunkSize, std::chrono::duration<double>(readEnd - readStart).count());
+				bytesVerified += chunkSize;
+			}
+
+			if (!mapAliasing)
+				return false;
+
+			failed = true;
+		}
+		else
+		{
+			// If we are performing non-standard verifications we do not count that time towards our total count
+			if (!quickCheck)
+			{
+				speedEstimator.AddSample(false, chunkSize, std::chrono::duration<double>(readEnd - readStart).count());
+				bytesVerified += chunkSize;
+
+				if (updateRealBytes && !failed)
+					bealBytesVerified += chunkSize;
+			}
+		}
+
+		totalBytesToRead -= chunkSize;
+		offset += chunkSize;
+
+		// Update progress
+		CalculateProgress();
+
+		ReportProgress(CurrentState);
+	}
+
+	return !failed;
+}
+
+bool DiskTest::VerifyTestFile(const std::string& filePath, bool updateRealBytes)
+{
+	return(InternalVerifyTestFile(filePath, 0, updateRealBytes));
+}
+
+/// <summary>
+/// A chunk read back by a verification reader
+/// </summary>
+struct VerifyChunk
+{
+	size_t file;
+	unsigned long long offset;
+	unsigned long long size;
+
+	// Index of the first byte that doesn't match, size if everything does
+	unsigned long long mismatch;
+
+	// The chunk couldn't be read, nothing of it counts
+	bool readError;
+
+	// Nothing more comes for this file
+	bool last;
+
+	std::chrono::high_resolution_clock::duration duration;
+};
+
+struct DiskTest::VerifyPass
+{
+	bool useRecordedSize;
+
+	// Keep reading a file after it failed, the rest of it is what the alias map is built from
+	bool mapAliasing;
+
+	// Files are handed out in order, readers stop taking files or reading past the first failing file
+	std::atomic<size_t> nextFile{ 0 };
+	std::atomic<size_t> lastNeededFile;
+
+	// Verified before the test was interrupted, skipped
+	std::vector<bool> skip;
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<VerifyChunk> chunks;
+	size_t runningReaders = 0;
+};
+
+bool DiskTest::VerifyTestFiles(bool useRecordedSize)
+{
+	const size_t fileCount = testFiles.size();
+
+	VerifyPass pass;
+	pass.useRecordedSize = useRecordedSize;
+	pass.mapAliasing = sectorTagging && !stopOnFirstError;
+	pass.lastNeededFile = fileCount;
+	pass.skip.resize(fileCount);
+
+	// Per file, bytes that passed from its start and whether it failed
+	std::vector<unsigned long long> goodBytes(fileCount, 0);
+	std::vector<bool> failed(fileCount, false);
+
+	for (size_t i = 0; i < fileCount; i++)
+	{
+		// Verified before the test was interrupted, nothing has been written since
+		if (testFiles[i]->Verified)
+		{
+			pass.skip[i] = true;
+			goodBytes[i] = testFiles[i]->TotalSize;
+			bytesVerified += testFiles[i]->TotalSize;
+		}
+	}
+
+	unsigned long long baseRealBytes = bealBytesVerified;
+	size_t readerCount = std::max<size_t>(1, std::min<size_t>(verifyReaders, fileCount));
+
+	// The readers' buffers are only needed for this pass, fewer readers if there isn't memory for all of them
+	while (!verifyArena.Reserve(ioArena.GetBufferSize(), readerCount) && readerCount > 1)
+		readerCount--;
+
+	std::vector<std::thread> readers;
+	pass.runningReaders = readerCount;
+
+	for (size_t i = 0; i < readerCount; i++)
+		readers.emplace_back(&DiskTest::VerifyReader, this, std::ref(pass));
+
+	// Several files are read at once, the read speed is what comes back over time rather than what each read took alone
+	auto lastSample = std::chrono::high_resolution_clock::now();
+
+	std::unique_lock<std::mutex> lock(pass.mutex);
+
+	while (true)
+	{
+		pass.changed.wait(lock, [&] { return !pass.chunks.empty() || pass.runningReaders == 0; });
+
+		if (pass.chunks.empty())
+			break;
+
+		VerifyChunk chunk = pass.chunks.front();
+		pass.chunks.pop_front();
+		lock.unlock();
+
+		TestFile* testFile = testFiles[chunk.file];
+		auto now = std::chrono::high_resolution_clock::now();
+
+		if (!chunk.readError)
+			TraceChunk(TracePhase::Verify, testFile->StreamOffset + chunk.offset, chunk.size, chunk.duration);
+
+		// Same accounting as VerifyPattern: up to the mismatch for the chunk that failed, everything read for the others
+		if (chunk.readError)
+		{
+			failed[chunk.file] = true;
+		}
+		else if (chunk.mismatch != chunk.size && !failed[chunk.file])
+		{
+			bytesVerified += chunk.mismatch;
+			goodBytes[chunk.file] += chunk.mismatch;
+			failed[chunk.file] = true;
+		}
+		else
+		{
+			// The read itself if the compare held things up, otherwise the readers overlap and it's the time since the last chunk
+			speedEstimator.AddSample(false, chunk.size, std::chrono::duration<double>(std::min(chunk.duration, now - lastSample)).count());
+			bytesVerified += chunk.size;
+
+			if (!failed[chunk.file])
+				goodBytes[chunk.file] += chunk.size;
+		}
+
+		lastSample = now;
+
+		if (chunk.last)
+		{
+			testFile->Verified = !failed[chunk.file];
+
+			if (journal.IsOpen() && testRunning)
+				journal.SetVerified(std::filesystem::path(testFile->Path).filename().string(), testFile->Verified);
+		}
+
+		// Only what is good from the very first byte counts, a later file finishing early doesn't
+		unsigned long long realBytes = 0;
+
+		for (size_t i = 0; i < fileCount; i++)
+		{
+			realBytes += goodBytes[i];
+
+			if (failed[i] || goodBytes[i] < testFiles[i]->TotalSize)
+				break;
+		}
+
+		bealBytesVerified = baseRealBytes + realBytes;
+
+		CalculateProgress();
+		ReportProgress(CurrentState);
+
+		lock.lock();
+	}
+
+	lock.unlock();
+
+	for (auto& reader : readers)
+		reader.join();
+
+	verifyArena.Reserve(0, 0);
+
+	// A file that wasn't finished (stopped, or past the first failure) isn't verified either
+	bool ret = true;
+
+	for (size_t i = 0; i < fileCount; i++)
+		ret &= testFiles[i]->Verified && !failed[i];
+
+	return ret;
+}
+
+void DiskTest::VerifyReader(VerifyPass& pass)
+{
+	// Each reader has a queue and a buffer of its own, the test's queue and buffers belong to the test thread
+	std::unique_ptr<IoQueue> queue = ioBackend->CreateQueue(ioQueueDepth);
+	unsigned char* buffer = verifyArena.Acquire();
+
+	if (buffer != nullptr)
+		queue->RegisterBuffers({ { verifyArena.GetBase(), verifyArena.GetMappedSize() } });
+
+	while (testRunning)
+	{
+		size_t index = pass.nextFile++;
+
+		if (index >= pass.skip.size() || index > pass.lastNeededFile)
+			break;
+
+		if (pass.skip[index])
+			continue;
+
+		if (buffer == nullptr)
+		{
+			std::lock_guard<std::mutex> lock(pass.mutex);
+			pass.chunks.push_back({ index, 0, 0, 0, true, true, {} });
+			break;
+		}
+
+		VerifyReaderFile(pass, index, queue.get(), buffer);
+	}
+
+	verifyArena.Release(buffer);
+
+	{
+		std::lock_guard<std::mutex> lock(pass.mutex);
+		pass.runningReaders--;
+	}
+
+	pass.changed.notify_all();
+}
+
+void DiskTest::VerifyReaderFile(VerifyPass& pass, size_t index, IoQueue* queue, unsigned char* buffer)
+{
+	const TestFile* testFile = testFiles[index];
+
+	auto handOver = [&](const VerifyChunk& chunk) {
+		{
+			std::lock_guard<std::mutex> lock(pass.mutex);
+			pass.chunks.push_back(chunk);
+		}
+
+		pass.changed.notify_all();
+
+		// Files past a failure aren't needed, the ones before it may still fail earlier
+		if (chunk.last && (chunk.readError || chunk.mismatch != chunk.size) && !pass.mapAliasing)
+		{
+			size_t current = pass.lastNeededFile;
+			while (index < current && !pass.lastNeededFile.compare_exchange_weak(current, index));
+		}
+	};
+
+	std::unique_ptr<IoFile> file = ioBackend->Open(testFile->Path, IoOpenMode::ReadOnly);
+	unsigned long long size = file != nullptr ? (pass.useRecordedSize ? testFile->TotalSize : file->GetSize()) : 0;
+
+	if (size == 0)
+	{
+		handOver({ index, 0, 0, 0, true, true, {} });
+		return;
+	}
+
+	PatternGenerator pattern = GetPattern(GetFileSeed(testFile->Path), testFile->StreamOffset);
+	unsigned long long offset = 0;
+
+	while (offset < size && testRunning && index <= pass.lastNeededFile)
+	{
+		// The readers' pool was sized for the largest chunk of the test, the buffer can't be grown from here
+		unsigned long long chunkSize = std::min<unsigned long long>(size - offset, std::min<unsigned long long>(verifyArena.GetBufferSize(), MAX_RAND_DATA_SIZE));
+
+		// Ensure chunkSize is a multiple of the block size
+		chunkSize = chunkSize - (chunkSize % dataBlockSize);
+
+		auto readStart = std::chrono::high_resolution_clock::now();
+		bool read = chunkSize > 0 && TransferChunk(file.get(), false, offset, buffer, chunkSize, queue);
+		auto readEnd = std::chrono::high_resolution_clock::now();
+
+		if (!read)
+		{
+			handOver({ index, offset, chunkSize, 0, true, true, readEnd - readStart });
+			return;
+		}
+
+		size_t mismatch = CompareData(buffer, (size_t)chunkSize, pattern, offset);
+		bool last = offset + chunkSize == size;
+
+		if (mismatch != chunkSize)
+		{
+			// The data is already here, find out where every bad sector of the chunk came from
+			if (pattern.HasSectorTags())
+			{
+				// A sector with someone else's tag is bad as a whole, even if the first bytes of the address happen to match
+				mismatch -= mismatch % PatternGenerator::SECTOR_SIZE;
+				RecordAliasing(buffer + mismatch, (size_t)chunkSize - mismatch, pattern, offset + mismatch);
+			}
+
+			if (!pass.mapAliasing)
+				last = true;
+		}
+
+		handOver({ index, offset, chunkSize, mismatch, false, last, readEnd - readStart });
+
+		if (last)
+			return;
+
+		offset += chunkSize;
+	}
+}
+
+byte DiskTest::PerformVerifyOnly()
+{
+	// Tests are non re-usable for now
+	if (!BeginTest()) return false;
+
+	unsigned long long freeSpace = 0;
+	GetDiskSpace(Path, &this->maxCapacity, &freeSpace);
+
+	dataBlockSize = GetDataBlockSize(Path);
+
+	// Nothing to verify without the manifest, the test still has to end as failed
+	if (dataBlockSize == 0 || !LoadManifest() || !PrepareIo(MAX_RAND_DATA_SIZE))
+	{
+		CurrentState = State_Error;
+		ReportProgress(CurrentState);
+
+		testRunning = false;
+		return false;
+	}
+
+	// Nothing is written, progress only counts what is read
+	capacityToTest = 0;
+
+	for (const auto& testFile : testFiles)
+		bytesToVerify += testFile->TotalSize;
+
+	CurrentState = State_Verification;
+	speedEstimator.SetPhase(SpeedPhase::Read);
+
+	ReportProgress(State_Verification);
+
+	// The size comes from the manifest, a file cut short fails instead of verifying what's left of it
+	bool ret = VerifyTestFiles(true);
+
+	if (writeLogFile)
+		WriteLogToFile(ret);
+
+	speedEstimator.SetPhase(SpeedPhase::Idle);
+	CalculateProgress();
+
+	if (CurrentState != State_Aborted)
+		CurrentState = ret ? State_Success : State_Error;
+
+	ReportProgress(CurrentState);
+
+	trace.Flush();
+
+	testRunning = false;
+
+	return ret;
+}
+
+byte DiskTest::IsDiskEmpty()
+{
+	bool isEmpty = std::filesystem::is_empty(Path);
+
+	if (!isEmpty)
+	{
+		int entryCount = 0;
+
+		try
+		{
+			// This could be improved but it's good enough for now
+			for (const auto& entry : std::filesystem::recursive_directory_iterator(Path, std::filesystem::directory_options::skip_permission_denied))
+			{
+				// Skip folders or anything starting with "System Volume Information"
+				if (entry.is_directory() || entry.path().wstring().find(L"System Volume Information") != std::wstring::npos)				continue;
+
+				entryCount++;
+				break; // Exit the loop after finding at least one entry
+			}
+
+			isEmpty = (entryCount == 0);
+		}
+		catch (const std::exception&)
+		{
+			isEmpty = false;
+		}
+
+	}
+
+	return static_cast<byte>(isEmpty);
+}
+
+
+byte DiskTest::PerformDestructiveTest()
+{
+	// Tests are non re-usable for now
+	if (!BeginTest()) return false;
+
+	std::string devicePath = ioBackend->GetDevicePath(Path);
+
+	unsigned long long deviceSize = 0;
+	unsigned long sectorSize = 0;
+
+	// No filesystem in the way, we go through every sector the device claims to have
+	std::unique_ptr<IoFile> device = devicePath.empty() ? nullptr : ioBackend->OpenDevice(devicePath, &deviceSize, &sectorSize, DeviceAccess::Dismount);
+
+	if (device == nullptr || sectorSize == 0)
+	{
+		CurrentState = State_Error;
+		ReportProgress(CurrentState);
+
+		testRunning = false;
+		return false;
+	}
+
+	maxCapacity = deviceSize;
+	dataBlockSize = sectorSize;
+
+	if (capacityToTest == 0 || capacityToTest > deviceSize)
+		capacityToTest = deviceSize;
+
+	capacityToTest -= capacityToTest % dataBlockSize;
+
+	// One sequential pass each way, the first chunk read back once for an early read speed, plus the first sector after every chunk when stopping on the first error
+	unsigned long long chunkCount = (capacityToTest + MAX_RAND_DATA_SIZE - 1) / MAX_RAND_DATA_SIZE;
+	unsigned long long sampleSize = std::min<unsigned long long>(capacityToTest, MAX_RAND_DATA_SIZE);
+	bytesToVerify = capacityToTest + sampleSize + (stopOnFirstError ? chunkCount * dataBlockSize : 0);
+
+	PatternGenerator pattern = GetPattern(GetFileSeed(DEVICE_SEED_NAME), 0);
+
+	// Sizes the buffer pool for the whole test
+	if (capacityToTest == 0 || !PrepareIo(std::min<unsigned long long>(capacityToTest, MAX_RAND_DATA_SIZE)))
+	{
+		CurrentState = State_Error;
+		ReportProgress(CurrentState);
+
+		testRunning = false;
+		return false;
+	}
+
+	CurrentState = State_InProgress;
+	speedEstimator.SetPhase(SpeedPhase::Write);
+
+	ReportProgress(State_InProgress);
+
+	bool verifyFailed = false;
+	bool readSampled = false;
+
+	// A fake device wraps around (or gives up) once its real capacity is used, the first sector is the first to show it
+	std::function<bool(unsigned char*)> afterChunk = [&](unsigned char* deviceData) {
+
+		// Same as the first test file, the time remaining needs a read speed long before the verification starts
+		if (!readSampled)
+		{
+			readSampled = true;
+
+			auto readStart = std::chrono::high_resolution_clock::now();
+			if (!TransferChunk(device.get(), false, 0, deviceData, sampleSize))
+				return false;
+			auto readEnd = std::chrono::high_resolution_clock::now();
+
+			TraceChunk(TracePhase::Check, 0, sampleSize, readEnd - readStart);
+
+			size_t mismatch = CompareData(deviceData, (size_t)sampleSize, pattern, 0);
+
+			if (mismatch != sampleSize)
+			{
+				bealBytesVerified = mismatch;
+
+				verifyFailed = true;
+				return false;
+			}
+
+			speedEstimator.AddSample(false, sampleSize, std::chrono::duration<double>(readEnd - readStart).count());
+			bytesVerified += sampleSize;
+		}
+
+		if (stopOnFirstError)
+		{
+			if (!device->Read(0, deviceData, dataBlockSize))
+				return false;
+
+			size_t mismatch = CompareData(deviceData, dataBlockSize, pattern, 0);
+
+			if (mismatch != dataBlockSize)
+			{
+				if (pattern.HasSectorTags())
+					RecordAliasing(deviceData, dataBlockSize, pattern, 0);
+
+				// The first sector is what failed, same as the first block of a test file
+				bealBytesVerified = mismatch;
+
+				verifyFailed = true;
+				return false;
+			}
+
+			bytesVerified += dataBlockSize;
+		}
+
+		return true;
+	};
+
+	bool ret = WritePattern(device, capacityToTest, pattern, 0, afterChunk) == capacityToTest && !verifyFailed;
+
+	// Perform final verification
+	if (ret && CurrentState != State_Aborted)
+	{
+		CurrentState = State_Verification;
+		speedEstimator.SetPhase(SpeedPhase::Read);
+
+		ReportProgress(State_Verification);
+
+		ret = VerifyPattern(device.get(), capacityToTest, pattern, 0, true, false);
+	}
+
+	// Closing the device unlocks it, there's no filesystem left to write the log file to
+	device.reset();
+
+	speedEstimator.SetPhase(SpeedPhase::Idle);
+	CalculateProgress();
+
+	if (CurrentState != State_Aborted)
+		CurrentState = ret ? State_Success : State_Error;
+
+	ReportProgress(CurrentState);
+
+	trace.Flush();
+
+	testRunning = false;
+
+	return ret;
+}
+
+std::vector<unsigned long long> DiskTest::GetProbeOffsets(unsigned long long deviceSize, unsigned long long blockSize)
+{
+	unsigned long long blockCount = deviceSize / blockSize;
+	std::vector<unsigned long long> offsets = { 0, (blockCount - 1) * blockSize };
+
+	// Two per doubling from 1MB up, fakes tend to have a power of two (or close to it) of real capacity
+	for (unsigned long long position = 1024 * 1024; position < deviceSize; position *= 2)
+	{
+		offsets.push_back(position);
+		offsets.push_back(position + position / 2);
+	}
+
+	// And a few anywhere, so nothing can be tuned to dodge the fixed ones
+	std::mt19937_64 random(std::random_device{}());
+	for (int i = 0; i < PROBE_RANDOM_BLOCKS; i++)
+		offsets.push_back(random() % blockCount * blockSize);
+
+	for (auto& offset : offsets)
+		offset -= offset % blockSize;
+
+	std::sort(offsets.begin(), offsets.end());
+	offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+	offsets.erase(std::remove_if(offsets.begin(), offsets.end(), [&](unsigned long long offset) { return offset + blockSize > deviceSize; }), offsets.end());
+
+	return offsets;
+}
+
+byte DiskTest::PerformCapacityProbe()
+{
+	// Tests are non re-usable for now
+	if (!BeginTest()) return false;
+
+	std::string devicePath = ioBackend->GetDevicePath(Path);
+
+	unsigned long long deviceSize = 0;
+	unsigned long sectorSize = 0;
+
+	// Unlike the destructive test the filesystems have to survive, a mounted device (or one in use on Windows) is refused
+	std::unique_ptr<IoFile> device = devicePath.empty() ? nullptr : ioBackend->OpenDevice(devicePath, &deviceSize, &sectorSize, DeviceAccess::KeepMounted);
+
+	unsigned long long blockSize = std::max<unsigned long long>(PROBE_BLOCK_SIZE, sectorSize);
+
+	if (device == nullptr || sectorSize == 0 || blockSize % sectorSize != 0 || deviceSize < blockSize)
+	{
+		CurrentState = State_Error;
+		ReportProgress(CurrentState);
+
+		testRunning = false;
+		return false;
+	}
+
+	maxCapacity = deviceSize;
+	dataBlockSize = sectorSize;
+
+	std::vector<unsigned long long> offsets = GetProbeOffsets(deviceSize, blockSize);
+	size_t count = offsets.size();
+
+	capacityToTest = bytesToVerify = count * blockSize;
+
+	// Tags tell us where a block that comes back wrong was really written to
+	PatternGenerator pattern(GetFileSeed(DEVICE_SEED_NAME));
+	pattern.SetSectorTags(runId, 0);
+
+	AlignedBuffer original(count * blockSize);
+	AlignedBuffer block(blockSize);
+	std::vector<bool> readable(count, false);
+	std::vector<bool> written(count, false);
+
+	CurrentState = State_InProgress;
+
+	ReportProgress(State_InProgress);
+
+	// Keep what was there, reads past the real capacity of some fakes just fail
+	size_t readCount = 0;
+
+	for (; readCount < count && testRunning; readCount++)
+		readable[readCount] = device->Read(offsets[readCount], original.data() + readCount * blockSize, (size_t)blockSize);
+
+	bool ioFailed = false;
+
+	// Highest first, on a wrapping fake the low (real) address of two sharing storage is written last and keeps its data.
+	// Only over blocks we got a look at, an unreadable one is written too since there's nothing there to lose
+	for (size_t i = readCount; i > 0 && testRunning && !ioFailed; i--)
+	{
+		pattern.Fill(block.data(), (size_t)blockSize, offsets[i - 1]);
+
+		// A block is put back even if writing it failed, part of it may have made it to the device
+		written[i - 1] = true;
+
+		if (!device->Write(offsets[i - 1], block.data(), (size_t)blockSize))
+			ioFailed = true;
+		else
+			bytesWritten += blockSize;
+	}
+
+	if (!device->Flush())
+		ioFailed = true;
+
+	// Same as with the test files, some fakes only show their true colors after the device is closed.
+	// Without the device back nothing can be restored, so it gets a few tries
+	device.reset();
+
+	for (int i = 0; i < PROBE_REOPEN_ATTEMPTS && device == nullptr; i++)
+	{
+		if (i > 0)
+			std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+		device = ioBackend->OpenDevice(devicePath, &deviceSize, &sectorSize, DeviceAccess::KeepMounted);
+	}
+
+	if (device == nullptr)
+	{
+		CurrentState = State_Error;
+		ReportProgress(CurrentState);
+
+		testRunning = false;
 		return false;
+	}
 
-	if (progressCallback != NULL)
-		progressCallback(this, (int)State_InProgress, CurrentProgress, BYTES_TO_MB(bytesWritten));
-
-	bool ret = true;
+	// Nothing past this point can hold data, either it came back wrong or a block written there showed up somewhere else
+	unsigned long long upperBound = deviceSize;
+	unsigned long long firstBadBlock = deviceSize;
+	unsigned long long lowerBound = 0;
+	bool genuine = false;
+	bool probed = !ioFailed && testRunning;
 
-	while (!IsDriveFull() && testRunning && (totalDataWritten < totalDataToWrite))
+	if (probed)
 	{
-		if (dataLeftToWrite < sizeToWrite)
-			sizeToWrite = dataLeftToWrite;
+		CurrentState = State_Verification;
 
-		std::string fileName = GenerateTestFileName();
-		std::string filePath = Path + tempDirectoryPath + "\\" + fileName;
+		ReportProgress(State_Verification);
 
-		// Write the test file
-		auto dataWritten = WriteAndVerifyTestFile(filePath, sizeToWrite, stopOnFirstError);
+		std::vector<bool> good(count, false);
 
-		if (dataWritten < sizeToWrite)
-		{
-			bytesVerified = dataWritten;
-			ret = false;
-		}
-		else
+		for (size_t i = 0; i < count && testRunning; i++)
 		{
-			// Perform at least one complete read to get the Average Read speed for a better time calculation
-			if (testFiles.size() == 1)
-				VerifyTestFile(testFiles.front()->Path);
-		}
+			bytesVerified += blockSize;
 
-		// If StopOnFirstError is true, every time we finish writing a file,
-		// we check the first DataBlock from each file to ensure everything is still fine
-		if (ret && stopOnFirstError)
-		{
-			for (const auto& testFile : testFiles)
+			if (device->Read(offsets[i], block.data(), (size_t)blockSize) && CompareData(block.data(), (size_t)blockSize, pattern, offsets[i]) == blockSize)
 			{
-				if (!InternalVerifyTestFile(testFile->Path, dataBlockSize, false, &testFile->Data[0]))
-				{
-					ret = false;
-					break;
-				}
+				good[i] = true;
+				continue;
 			}
-		}
-
-		if (!ret)
-			break;
-
-		totalDataWritten += sizeToWrite;
-		dataLeftToWrite -= sizeToWrite;
 
-		if (progressCallback != NULL)
-			progressCallback(this, (int)State_InProgress, CurrentProgress, BYTES_TO_MB(bytesWritten));
-	}
+			unsigned long long foundAddress;
 
-	// Perform final verification
-	if (ret && CurrentState != State_Aborted)
-	{
-		CurrentState = State_Verification;
-		progressCallback(this, (int)State_Verification, CurrentProgress, BYTES_TO_MB(bytesVerified));
+			firstBadBlock = std::min(firstBadBlock, offsets[i]);
 
-		for (const auto& testFile : testFiles)
-		{
-			if (!VerifyTestFile(testFile->Path, true))
+			// Of the two addresses sharing the storage, the higher one is the one that doesn't really exist
+			if (PatternGenerator::ReadSectorTag(block.data(), runId, &foundAddress) && foundAddress != offsets[i])
 			{
-				ret = false;
-				break;
+				aliasMap.AddAliased(offsets[i], foundAddress);
+				upperBound = std::min(upperBound, std::max(offsets[i], foundAddress));
 			}
+			else
+			{
+				aliasMap.AddLost(offsets[i]);
+				upperBound = std::min(upperBound, offsets[i]);
+			}
+		}
+
+		// The highest good block below the first bad one, blocks past it can read back fine when nothing else was written to the same storage
+		for (size_t i = 0; i < count; i++)
+		{
+			if (good[i] && offsets[i] + blockSize <= std::min(upperBound, firstBadBlock))
+				lowerBound = std::max(lowerBound, offsets[i] + blockSize);
 		}
+
+		// Cancelled half way through the reads tells nothing
+		probed = testRunning;
+		genuine = upperBound == deviceSize && probed;
+
+		if (genuine)
+			lowerBound = deviceSize;
 	}
 
-	// Delete all the temporary files
-	if (deleteTempFiles)
-	{
-		// Delete any temporary data that can eventually already exist, then flush the changes
-		this->RemoveDirectory(Path + tempDirectoryPath);
+	// Put everything back, newest first so aliased blocks end up the way they were. Done even when stopped, and
+	// a block that doesn't go back is a failure whatever the probe found
+	bool restored = true;
 
-		// Write log file if needed
-		if (writeLogFile)
-			WriteLogToFile(ret);
+	for (size_t i = count; i > 0; i--)
+	{
+		if (written[i - 1] && readable[i - 1] && !device->Write(offsets[i - 1], original.data() + (i - 1) * blockSize, (size_t)blockSize))
+			restored = false;
 	}
 
-	RecalculateAverageSpeeds();
+	if (!device->Flush())
+		restored = false;
+
+	device.reset();
+
+	probeLowerBound = probed ? lowerBound : 0;
+	probeUpperBound = probed ? upperBound : 0;
+	bealBytesVerified = probeLowerBound;
+
+	bool ret = genuine && restored;
+
 	CalculateProgress();
 
 	if (CurrentState != State_Aborted)
 		CurrentState = ret ? State_Success : State_Error;
 
-	if (progressCallback != NULL)
-		progressCallback(this, CurrentState, CurrentProgress, BYTES_TO_MB(bytesWritten));
+	ReportProgress(CurrentState);
 
 	testRunning = false;
 
 	return ret;
 }
 
-bool DiskTest::InternalVerifyTestFile(const std::string& filePath, unsigned long long fileSize, bool updateRealBytes, const unsigned char* pData)
+void DiskTest::GetProbeCapacityBounds(unsigned long long* lowerBound, unsigned long long* upperBound)
+{
+	*lowerBound = probeLowerBound;
+	*upperBound = probeUpperBound;
+}
+
+bool DiskTest::BeginTest()
 {
-	// FILE_FLAG_NO_BUFFERING is important
-	HANDLE hFile = ::CreateFileA(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, NULL);
+	bool expected = false;
 
-	if (hFile == INVALID_HANDLE_VALUE)
+	if (CurrentState != State_Waiting || !testRunning.compare_exchange_strong(expected, true))
 		return false;
 
-	LARGE_INTEGER fSize;
-
-	if (fileSize == 0)
+	// ForceStopTest sets the flag before it looks at testRunning, one of us always sees the other
+	if (cancelRequested)
 	{
-		if (!::GetFileSizeEx(hFile, &fSize))
-		{
-			::CloseHandle(hFile);
-			return false;
-		}
-
-		fileSize = fSize.QuadPart;
+		testRunning = false;
+		CurrentState = State_Aborted;
+		ReportProgress(State_Aborted);
+		return false;
 	}
 
-	unsigned long long totalBytesToRead = fileSize;
-	unsigned long offset = 0;
-	int segment = 0;
+	return true;
+}
 
-	while (totalBytesToRead > 0 && testRunning)
+byte DiskTest::Run(TestKind kind)
+{
+	switch (kind)
 	{
-		unsigned long chunkSize = (unsigned long)std::min<unsigned long long>(totalBytesToRead, MAX_RAND_DATA_SIZE);
+	case TestKind::Destructive:
+		return PerformDestructiveTest();
+	case TestKind::CapacityProbe:
+		return PerformCapacityProbe();
+	case TestKind::VerifyOnly:
+		return PerformVerifyOnly();
+	default:
+		return PerformTest();
+	}
+}
 
-		// Ensure chunkSize is a multiple of the block size
-		chunkSize = chunkSize - (chunkSize % dataBlockSize);
+byte DiskTest::StartAsync(TestKind kind)
+{
+	std::lock_guard<std::mutex> lock(asyncMutex);
 
-		// Re-generate the data for this chunk
-		std::vector<unsigned char> generatedData(chunkSize);
+	// Tests are non re-usable, same as the Perform functions
+	if (asyncRunning || worker.joinable() || testRunning || CurrentState != State_Waiting)
+		return false;
 
-		if (pData != nullptr)
-			memcpy(&generatedData[0], pData, chunkSize);
-		else
-			GenerateData(generatedData, filePath + std::to_string(segment));
+	asyncRunning = true;
+	cancelRequested = false;
 
-		std::vector<unsigned char> fileData(chunkSize);
-		unsigned long bytesRead;
+	worker = std::thread([this, kind] {
+		Run(kind);
 
-		auto readStart = std::chrono::high_resolution_clock::now();
-		if (!::ReadFile(hFile, fileData.data(), chunkSize, &bytesRead, NULL) || bytesRead != chunkSize)
 		{
-			::CloseHandle(hFile);
-			return false;
+			std::lock_guard<std::mutex> lock(asyncMutex);
+			asyncRunning = false;
 		}
-		auto readEnd = std::chrono::high_resolution_clock::now();
-
-		bool success = true;
 
-		// Compare the read data with the generated data
-		if (memcmp(fileData.data(), generatedData.data(), chunkSize) != 0)
-		{
-			// Get the exact position where it failed
-			for (size_t i = 0; i < chunkSize; i++)
-			{
-				if (fileData.data()[i] != generatedData.data()[i])
-				{
-					bytesVerified += i;
+		asyncDone.notify_all();
+	});
 
-					if (updateRealBytes)
-						bealBytesVerified += i;
+	return true;
+}
 
-					break;
-				}
-			}
+byte DiskTest::Wait(unsigned int timeoutMs)
+{
+	{
+		std::unique_lock<std::mutex> lock(asyncMutex);
 
-			::CloseHandle(hFile);
+		if (timeoutMs == INFINITE_WAIT)
+			asyncDone.wait(lock, [&] { return !asyncRunning; });
+		else if (!asyncDone.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&] { return !asyncRunning; }))
 			return false;
-		}
-		else
-		{
-			// If we are performing non-standard verifications we do not count that time towards our total count
-			if (pData == nullptr)
-			{
-				std::chrono::duration<double, std::milli> durationMilliseconds = readEnd - readStart;
-				totalReadDuration += durationMilliseconds.count();
-				bytesVerified += chunkSize;
-
-				if (updateRealBytes)
-					bealBytesVerified += chunkSize;
-			}
-		}
-
-		totalBytesToRead -= chunkSize;
-		offset += chunkSize;
-		segment++;
-
-		// Recalculate and update progress 
-		RecalculateAverageSpeeds();
-		CalculateProgress();
-
-		if (progressCallback != NULL)
-			progressCallback(this, (int)State_Verification, CurrentProgress, BYTES_TO_MB(chunkSize));
 	}
 
-	::CloseHandle(hFile);
-
+	JoinWorker();
 	return true;
 }
 
-bool DiskTest::VerifyTestFile(const std::string& filePath, bool updateRealBytes)
+void DiskTest::JoinWorker()
 {
-	return(InternalVerifyTestFile(filePath, 0, updateRealBytes));
+	std::thread finished;
+
+	{
+		std::lock_guard<std::mutex> lock(asyncMutex);
+
+		// The worker can't wait for itself
+		if (worker.get_id() == std::this_thread::get_id())
+			return;
+
+		finished = std::move(worker);
+	}
+
+	// The worker takes the lock on its way out
+	if (finished.joinable())
+		finished.join();
 }
 
-byte DiskTest::IsDiskEmpty()
+byte DiskTest::ForceStopTest()
 {
-	bool isEmpty = std::filesystem::is_empty(Path);
+	bool pending = false;
 
-	if (!isEmpty)
 	{
-		int entryCount = 0;
+		std::lock_guard<std::mutex> lock(asyncMutex);
 
-		try
-		{
-			// This could be improved but it's good enough for now
-			for (const auto& entry : std::filesystem::recursive_directory_iterator(Path, std::filesystem::directory_options::skip_permission_denied))
-			{
-				// Skip folders or anything starting with "System Volume Information"
-				if (entry.is_directory() || entry.path().wstring().find(L"System Volume Information") != std::wstring::npos)				continue;
+		if (asyncRunning)
+			pending = cancelRequested = true;
+	}
 
-				entryCount++;
-				break; // Exit the loop after finding at least one entry
-			}
+	// Force stop if it's running
+	if (testRunning.exchange(false))
+	{
+		CurrentState = State_Aborted;
 
-			isEmpty = (entryCount == 0);
-		}
-		catch (const std::exception&)
-		{
-			isEmpty = false;
-		}
+		// Don't wait for the requests in progress if the backend can help it
+		std::lock_guard<std::mutex> lock(activeFileMutex);
+
+		for (IoFile* file : activeFiles)
+			file->CancelPending();
 
+		return true;
 	}
 
-	return static_cast<byte>(isEmpty);
+	return pending;
 }
 
+void DiskTest::ReportProgress(State state)
+{
+	TestEvent event;
+	event.type = state != lastReportedState ? TestEvent_StateChanged : TestEvent_Progress;
+	event.state = state;
+	event.progress = CurrentProgress;
+	event.timeRemaining = (uint32_t)GetTimeRemaining();
+	event.bytesWritten = bytesWritten;
+	event.bytesVerified = bytesVerified;
+	event.lastVerifiedPosition = bealBytesVerified;
+	event.writeSpeed = speedEstimator.GetAverageSpeed(true);
+	event.readSpeed = speedEstimator.GetAverageSpeed(false);
+
+	snapshot.Store(event);
+
+	// Progress is coalesced, a poller only needs to know where we are every now and then
+	auto now = std::chrono::steady_clock::now();
+
+	if (event.type == TestEvent_StateChanged || now - lastEventTime >= EVENT_INTERVAL)
+	{
+		events.Push(event);
+		lastEventTime = now;
+	}
+
+	lastReportedState = state;
 
-byte DiskTest::PerformDestructiveTest()
+	if (progressCallback == NULL)
+		return;
+
+	notifier.Start([this] {
+		TestEvent latest = snapshot.Load();
+		progressCallback(this, latest.state, latest.progress, (int)BYTES_TO_MB(latest.bytesWritten));
+	}, CALLBACK_INTERVAL);
+
+	notifier.Notify();
+
+	// The last callback is made before the test returns, the caller may destroy us right after
+	if (state == State_Success || state == State_Error || state == State_Aborted)
+		notifier.Stop();
+}
+
+size_t DiskTest::PollEvents(TestEvent* buffer, size_t maxEvents)
 {
-	// TODO: Format the target disk, use all available space and perform test
-	return false;
+	return events.Poll(buffer, maxEvents);
 }
 
-byte DiskTest::ForceStopTest()
+TestEvent DiskTest::GetSnapshot()
 {
-	// Force stop if it's running
-	if (testRunning)
-	{
-		CurrentState = State_Aborted;
-		testRunning = false;
-		return true;
-	}
+	return snapshot.Load();
+}
 
-	return false;
+unsigned long long DiskTest::GetDroppedEvents()
+{
+	return events.GetDropped();
 }
 
 int DiskTest::GetTestState()
@@ -489,12 +2105,17 @@ int DiskTest::GetTestProgress()
 
 double DiskTest::GetAverageReadSpeed()
 {
-	return averageReadSpeed;
+	return speedEstimator.GetAverageSpeed(false);
 }
 
 double DiskTest::GetAverageWriteSpeed()
 {
-	return averageWriteSpeed;
+	return speedEstimator.GetAverageSpeed(true);
+}
+
+SpeedEstimator& DiskTest::GetSpeedEstimator()
+{
+	return speedEstimator;
 }
 
 unsigned long long DiskTest::GetLastSuccessfulVerifyPosition()
@@ -507,7 +2128,11 @@ std::string DiskTest::GetReadableDateTime()
 	time_t now;
 	time(&now);
 	struct tm ltm;
+#ifdef _WIN32
 	localtime_s(&ltm, &now);
+#else
+	localtime_r(&now, &ltm);
+#endif
 
 	std::stringstream ss;
 
@@ -519,188 +2144,212 @@ std::string DiskTest::GetReadableDateTime()
 
 std::string DiskTest::GenerateTestFileName()
 {
-	std::stringstream ss;
+	std::string name;
 
-	// Generate a random test file name using YYMMDDhhmmss + something random, should be unique enough for our tests
-	ss << GetReadableDateTime() << rand() % 1000 << ".tsc";
+	// Resumed tests (see SetJournalPath) have files from another run, rand() in a new process goes through the same numbers again
+	do
+	{
+		std::stringstream ss;
 
-	return ss.str();
-}
+		// Generate a random test file name using YYMMDDhhmmss + something random, should be unique enough for our tests
+		ss << GetReadableDateTime() << rand() % 1000 << ".tsc";
 
-void DiskTest::RecalculateAverageSpeeds()
-{
-	// Calculate speed in MB/s
-	auto avgWriteSpeed = (bytesWritten / (totalWriteDuration / 1000.0)) / (1024 * 1024); // Convert ms to seconds
-	auto avgReadSpeed = (bytesVerified > 0 && totalReadDuration > 0) ? (bytesVerified / (totalReadDuration / 1000.0)) / (1024 * 1024) : 0; // Convert ms to seconds
+		name = ss.str();
+	} while (std::any_of(testFiles.begin(), testFiles.end(), [&](const TestFile* testFile) { return std::filesystem::path(testFile->Path).filename() == name; }));
 
-	averageWriteSpeed = averageWriteSpeed == 0 ? avgWriteSpeed : ((averageWriteSpeed + avgWriteSpeed) / 2);
-	averageReadSpeed = averageReadSpeed == 0 ? avgReadSpeed : ((averageReadSpeed + avgReadSpeed) / 2);
+	return name;
 }
 
 // At some point I should just re-write all this to use SCSI Read/Write when applicable
-unsigned long DiskTest::WriteAndVerifyTestFile(const std::string& filePath, unsigned long long fileSize, bool failOnFirst)
+unsigned long long DiskTest::WriteAndVerifyTestFile(const std::string& filePath, unsigned long long fileSize, bool failOnFirst)
 {
-	// FILE_FLAG_NO_BUFFERING is important
-	HANDLE hFile = ::CreateFileA(filePath.c_str(), FILE_READ_DATA | FILE_WRITE_DATA, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH, NULL);
+	std::unique_ptr<IoFile> file = ioBackend->Open(filePath, IoOpenMode::CreateAlways);
 
-	if (hFile == INVALID_HANDLE_VALUE)
+	if (file == nullptr)
 		return 0;
 
-	unsigned long long chunkSize = std::min<unsigned long long>(fileSize, MAX_RAND_DATA_SIZE);
+	unsigned long long seed = GetFileSeed(filePath);
+	bool verifyFailed = false;
 
-	// Create avector big enough data to cover the entire random data size initially
-	std::vector<unsigned char> generatedData(chunkSize);
+	// Files are written one after the other, so this is roughly where the file sits on the disk
+	unsigned long long streamOffset = 0;
+	for (const auto& previousFile : testFiles)
+		streamOffset += previousFile->TotalSize;
 
-	unsigned int segment = 0;
+	PatternGenerator pattern = GetPattern(seed, streamOffset);
 
-	// Generate initial data
-	GenerateData(generatedData, filePath + std::to_string(segment));
+	// The time remaining needs a read speed long before the verification starts, the first chunk
+	// of the first file is read back once (same as the raw device)
+	bool readSampled = !testFiles.empty();
+	unsigned long long sampleSize = GetChunkSize(fileSize);
 
-	// Ensure chunkSize is a multiple of the block size
-	chunkSize = chunkSize - (chunkSize % dataBlockSize);
+	TestFile* testFile = new TestFile(filePath, fileSize, seed, streamOffset);
 
-	unsigned long long fileBytesGenerated = chunkSize;
-	unsigned long fileBytesWritten = 0;
-	unsigned long offset = 0;
+	testFiles.push_back(testFile);
 
-	TestFile* testFile = new TestFile(filePath, fileSize);
+	// Best effort, without it the filesystem allocates the file as it grows
+	file->Reserve(fileSize);
 
-	testFiles.push_back(testFile);
+	std::function<bool(unsigned char*)> afterChunk;
 
-	while (fileSize > 0 && testRunning)
+	if (failOnFirst || !readSampled)
 	{
-		// Remaining
-		if (chunkSize > fileSize)
-		{
-			chunkSize = fileSize;
-			generatedData.resize(chunkSize);
-		}
+		afterChunk = [&](unsigned char* fileData) {
 
-		// If we've used up all our pre-generated data, generate more
-		if (fileBytesGenerated < fileBytesWritten + chunkSize)
-		{
-			segment++;
-			GenerateData(generatedData, filePath + std::to_string(segment));
-			fileBytesGenerated += generatedData.size();
-		}
+			if (!readSampled)
+			{
+				readSampled = true;
 
-		unsigned long bytesWritten = 0;
+				auto readStart = std::chrono::high_resolution_clock::now();
+				if (!TransferChunk(file.get(), false, 0, fileData, sampleSize))
+					return false;
+				auto readEnd = std::chrono::high_resolution_clock::now();
 
-		auto writeStart = std::chrono::high_resolution_clock::now();
-		if (!::WriteFile(hFile, generatedData.data() + offset, chunkSize, &bytesWritten, NULL)) {
-			break;
-		}
-		auto writeEnd = std::chrono::high_resolution_clock::now();
+				TraceChunk(TracePhase::Check, streamOffset, sampleSize, readEnd - readStart);
 
-		std::chrono::duration<double, std::milli> durationMilliseconds = writeEnd - writeStart;
-		totalWriteDuration += durationMilliseconds.count();
-		bytesWritten += bytesWritten;
+				size_t mismatch = CompareData(fileData, (size_t)sampleSize, pattern, 0);
 
-		// Flush the data to the disk - shouldn't be necessary but
-		// a lot of drivers just lie to us and this seems to help
-		::FlushFileBuffers(hFile);
+				if (mismatch != sampleSize)
+				{
+					if (pattern.HasSectorTags())
+						RecordAliasing(fileData, (size_t)sampleSize, pattern, 0);
 
-		if (failOnFirst)
-		{
-			// If it's the first, save part of the generated data for our quick tests
-			if (fileBytesWritten == 0)
-				testFile->SetData((const unsigned char*)&generatedData[0], dataBlockSize);
+					bealBytesVerified = streamOffset + mismatch;
+
+					verifyFailed = true;
+					return false;
+				}
+
+				speedEstimator.AddSample(false, sampleSize, std::chrono::duration<double>(readEnd - readStart).count());
+				bytesVerified += sampleSize;
+			}
+
+			if (!failOnFirst)
+				return true;
 
 			// We always read and verify the first written data every single time,
 			// as it the most prone to corruption if this device is fake
 
-			// Save current position
-			LONG currentHighPart = 0;
-			DWORD currentLowPart = ::SetFilePointer(hFile, 0, &currentHighPart, FILE_CURRENT);
-			if (currentLowPart == INVALID_SET_FILE_POINTER && GetLastError() != NO_ERROR)
-				break;
-
 			// Okay listen, I don't like closing and re-opening the file either, but fact is,
 			// some fake sticks are way easier to detect if we close and re-open the file
 			// regardless of our flags or forced flushes.
 			{
-				::CloseHandle(hFile);
+				file.reset();
 
-				hFile = ::CreateFileA(filePath.c_str(), FILE_READ_DATA | FILE_WRITE_DATA, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH, NULL);
+				file = ioBackend->Open(filePath, IoOpenMode::OpenExisting);
 
-				if (hFile == INVALID_HANDLE_VALUE)
-					break;
+				if (file == nullptr)
+					return false;
 			}
 
-			// Re-read and verify the first written data
-			std::vector<unsigned char> fileData(testFile->DataSize);
-			unsigned long bytesRead = 0;
-
-			// Read the block from the file
-			if (!::ReadFile(hFile, fileData.data(), testFile->DataSize, &bytesRead, NULL) || bytesRead != testFile->DataSize)
-				break;
+			// Re-read and verify the first written data, regenerating one block is cheap
+			if (!file->Read(0, fileData, dataBlockSize))
+				return false;
 
 			// Check if the data matches
-			if (memcmp(fileData.data(), &testFile->Data[0], testFile->DataSize) != 0)
+			size_t mismatch = CompareData(fileData, dataBlockSize, pattern, 0);
+
+			if (mismatch != dataBlockSize)
 			{
-				bealBytesVerified = bytesWritten;
+				if (pattern.HasSectorTags())
+					RecordAliasing(fileData, dataBlockSize, pattern, 0);
 
-				// Get near position where it failed - Not very precise, this could be improved
-				for (size_t i = 0; i < chunkSize; i++)
-				{
-					if (fileData.data()[i] != testFile->Data[i])
-					{
-						bealBytesVerified += i;
-						break;
-					}
-				}
+				// It's the first block of this file that failed, not the chunk just written
+				bealBytesVerified = streamOffset + mismatch;
 
-				::CloseHandle(hFile);
+				verifyFailed = true;
 				return false;
 			}
 
-			// Restore file pointer to the previous position
-			::SetFilePointer(hFile, currentLowPart, &currentHighPart, FILE_BEGIN);
+			bytesVerified += dataBlockSize;
+			return true;
+		};
+	}
+
+	unsigned long long fileBytesWritten = WritePattern(file, fileSize, pattern, streamOffset, afterChunk);
+
+	return verifyFailed ? 0 : fileBytesWritten;
+}
+
+unsigned long long DiskTest::GetChunkSize(unsigned long long size)
+{
+	// Ensure chunkSize is a multiple of the block size
+	unsigned long long chunkSize = std::min<unsigned long long>(size, MAX_RAND_DATA_SIZE);
+	return std::max<unsigned long long>(chunkSize - (chunkSize % dataBlockSize), std::min<unsigned long long>(size, dataBlockSize));
+}
+
+unsigned long long DiskTest::WritePattern(std::unique_ptr<IoFile>& file, unsigned long long size, const PatternGenerator& pattern, unsigned long long streamOffset, const std::function<bool(unsigned char*)>& afterChunk)
+{
+	unsigned long long chunkSize = GetChunkSize(size);
+
+	// Double buffered, the next chunk is generated while the current one is being written
+	if (!PrepareIo(chunkSize))
+		return 0;
+
+	unsigned char** generatedData = ioBuffers;
+	TaskGroup generating[2];
+	int current = 0;
+
+	// Generate initial data
+	GenerateDataAsync(generating[current], generatedData[current], (size_t)chunkSize, pattern, 0);
+
+	unsigned long long totalWritten = 0;
+
+	while (totalWritten < size && testRunning)
+	{
+		// Remaining
+		unsigned long long writeSize = std::min<unsigned long long>(chunkSize, size - totalWritten);
+		unsigned long long nextOffset = totalWritten + writeSize;
+
+		WorkerPool::Instance().Wait(generating[current]);
 
-			bytesVerified += testFile->DataSize;
+		// Start on the next chunk while the device is busy with this one
+		if (nextOffset < size)
+			GenerateDataAsync(generating[current ^ 1], generatedData[current ^ 1], (size_t)std::min<unsigned long long>(chunkSize, size - nextOffset), pattern, nextOffset);
+
+		auto writeStart = std::chrono::high_resolution_clock::now();
+		if (!TransferChunk(file.get(), true, totalWritten, generatedData[current], writeSize)) {
+			break;
 		}
+		auto writeEnd = std::chrono::high_resolution_clock::now();
+
+		TraceChunk(TracePhase::Write, streamOffset + totalWritten, writeSize, writeEnd - writeStart);
+
+		speedEstimator.AddSample(true, writeSize, std::chrono::duration<double>(writeEnd - writeStart).count());
+		bytesWritten += writeSize;
+
+		// Flush the data to the disk - shouldn't be necessary but
+		// a lot of drivers just lie to us and this seems to help
+		file->Flush();
+
+		// The chunk we just wrote is done with its buffer, the check can use it
+		if (afterChunk && !afterChunk(generatedData[current]))
+			break;
 
-		fileSize -= bytesWritten;
-		fileBytesWritten += bytesWritten;
-		offset = (offset + bytesWritten) % MAX_RAND_DATA_SIZE;
+		totalWritten += writeSize;
+		current ^= 1;
 
-		// Recalculate average speeds and progress
-		RecalculateAverageSpeeds();
+		// Update progress
 		CalculateProgress();
-		if (progressCallback != NULL)
-			progressCallback(this, (int)State_InProgress, CurrentProgress, BYTES_TO_MB(bytesWritten));
+		ReportProgress(State_InProgress);
 	}
 
-	if (hFile != INVALID_HANDLE_VALUE)
-		::CloseHandle(hFile);
+	// The buffers can't go away while a chunk is still being generated into them
+	WorkerPool::Instance().Wait(generating[0]);
+	WorkerPool::Instance().Wait(generating[1]);
 
-	return fileBytesWritten;
+	return totalWritten;
 }
 
 
 unsigned long DiskTest::GetDataBlockSize(const std::string& path) {
-	unsigned long sectorsPerCluster;
-	unsigned long bytesPerSector;
-	unsigned long numberOfFreeClusters;
-	unsigned long totalNumberOfClusters;
-
-	if (GetDiskFreeSpaceA(path.c_str(), &sectorsPerCluster, &bytesPerSector, &numberOfFreeClusters, &totalNumberOfClusters)) {
-		return sectorsPerCluster * bytesPerSector;
-	}
-	else {
-		return 0;
-	}
+	return ioBackend->GetDataBlockSize(path);
 }
 
 
 bool DiskTest::GetDiskSpace(const std::string& path, unsigned long long* totalSpace, unsigned long long* freeSpace)
 {
-	unsigned long long availableSpace;
-
-	if (GetDiskFreeSpaceExA(path.c_str(), (PULARGE_INTEGER)&availableSpace, (PULARGE_INTEGER)totalSpace, (PULARGE_INTEGER)freeSpace) == 0)
-		return false;
-	else
-		return true;
+	return ioBackend->GetDiskSpace(path, totalSpace, freeSpace);
 }
 
 byte DiskTest::IsDriveFull()
@@ -723,25 +2372,21 @@ byte DiskTest::IsDriveFull()
 unsigned long DiskTest::GetTimeRemaining()
 {
 	// Note: We can't just assume the read/write times are roughly equal, they almost never are,
-	// especially in fake devices, so we need to calculate seperately and then add them together
-
-	// Calculate remaining time for writing and reading separately, then sum
-	int timeRemainingForWritingSec = averageWriteSpeed == 0 ? 0 : ((capacityToTest - bytesWritten) / (1024 * 1024)) / averageWriteSpeed;
-	int timeRemainingForReadingSec = averageReadSpeed == 0 ? 0 : ((bytesToVerify - bytesVerified) / (1024 * 1024)) / averageReadSpeed;
+	// especially in fake devices, so the estimator keeps them apart
+	unsigned long long writeBytes = capacityToTest - std::min(capacityToTest, bytesWritten);
+	unsigned long long readBytes = bytesToVerify - std::min(bytesToVerify, bytesVerified);
 
+	double seconds = speedEstimator.EstimateRemaining(writeBytes, readBytes);
 
-	// Assume double the write speed as default
-	if (timeRemainingForReadingSec == 0)
-		timeRemainingForReadingSec = averageWriteSpeed == 0 ? 0 : ((capacityToTest) / (1024 * 1024)) / (averageWriteSpeed * 2);
-
-	if (timeRemainingForWritingSec <= 0 || timeRemainingForReadingSec <= 0)
-		return 0;
-
-	return timeRemainingForWritingSec + timeRemainingForReadingSec;
+	return seconds < 0 ? 0 : (unsigned long)std::ceil(seconds);
 }
 
 void DiskTest::Dispose()
 {
+	// The worker still uses the files
+	ForceStopTest();
+	JoinWorker();
+
 	// Clean up TestFiles
 	for (TestFile* file : testFiles) {
 		delete file;
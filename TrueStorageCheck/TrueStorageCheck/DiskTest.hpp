@@ -5,11 +5,41 @@
  */
 #pragma once
 
-#include <windows.h>
+#include "Platform.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "TestFile.hpp"
+#include "AliasMap.hpp"
+#include "BufferArena.hpp"
+#include "IoBackend.hpp"
+#include "IoGate.hpp"
+#include "LatencyHistogram.hpp"
+#include "PatternGenerator.hpp"
+#include "SpeedEstimator.hpp"
+#include "TestEvents.hpp"
+#include "TestJournal.hpp"
+#include "TraceWriter.hpp"
+#include "WorkerPool.hpp"
+
+/// <summary>
+/// Which test to run, see DiskTest::Run
+/// </summary>
+enum class TestKind
+{
+	Normal = 0,
+	Destructive,
+	CapacityProbe,
+	VerifyOnly
+};
 
 class DiskTest
 {
@@ -28,6 +58,124 @@ public:
 	/// <param name="writeLogFile">Should write test log to a file</param>
 	DiskTest(char driveLetter, unsigned long long capacityToTest, bool stopOnFirstError, bool deleteTempFiles, bool writeLogFile, ProgressDelegate callback);
 
+	/// <summary>
+	/// DiskTest object constructor
+	/// </summary>
+	/// <param name="path">The disk to test, a drive root or mount point</param>
+	/// <param name="capacityToTest">Total capacity to test in MB, or 0 for testing all free space</param>
+	/// <param name="stopOnFirstError">Should test stop on first error</param>
+	/// <param name="deleteTempFiles">Should delete temporary files after test</param>
+	/// <param name="writeLogFile">Should write test log to a file</param>
+	DiskTest(const std::string& path, unsigned long long capacityToTest, bool stopOnFirstError, bool deleteTempFiles, bool writeLogFile, ProgressDelegate callback);
+
+	/// <summary>
+	/// Cancels the test started by StartAsync, if it's still running, and waits for it
+	/// </summary>
+	~DiskTest();
+
+	/// <summary>
+	/// Replaces the I/O backend used to access the disk, must be called before starting the test
+	/// </summary>
+	/// <param name="backend">Backend</param>
+	void SetIoBackend(std::shared_ptr<IoBackend> backend);
+
+	/// <summary>
+	/// Sets how many I/O requests are kept in flight, must be called before starting the test
+	/// </summary>
+	/// <param name="depth">Queue depth, 1 is the same as plain synchronous I/O</param>
+	void SetIoQueueDepth(unsigned int depth);
+
+	/// <summary>
+	/// Sets the size of each I/O request, must be called before starting the test
+	/// </summary>
+	/// <param name="size">Request size in bytes, rounded down to the data block size</param>
+	void SetIoRequestSize(unsigned long long size);
+
+	/// <summary>
+	/// Lets PerformTest pick the request size and queue depth itself, on by default. Must be called before starting the test
+	/// </summary>
+	/// <remarks>
+	/// A short calibration at the start of the test writes a scratch file with a few request sizes and
+	/// depths and keeps the fastest combination for the rest of the test, overriding SetIoRequestSize/SetIoQueueDepth.
+	/// The depth is only tried with an asynchronous queue (io_uring), otherwise SetIoQueueDepth is kept.
+	/// It costs every test up to 9 combinations of 16 to 64MB written, so up to about 600MB of extra wear (256MB without
+	/// the depths) and a few seconds, more on a slow device where a single 16MB chunk already takes seconds.
+	/// Skipped when resuming, the start of the disk is already taken by the files being resumed
+	/// </remarks>
+	/// <param name="enabled">Calibrate if true, use the configured values as they are otherwise</param>
+	void SetIoAutoTune(bool enabled);
+
+	/// <summary>
+	/// Gets the request size and queue depth the test runs with
+	/// </summary>
+	/// <param name="requestSize">Request size in bytes</param>
+	/// <param name="queueDepth">Queue depth</param>
+	/// <param name="speed">Combined write and read speed they reached during the calibration in MB/s, 0 if not calibrated</param>
+	/// <returns>True if they were picked by the calibration, false if they are the configured ones</returns>
+	byte GetIoTuning(unsigned long long* requestSize, unsigned int* queueDepth, double* speed);
+
+	/// <summary>
+	/// Makes every transfer wait for a slot of the gate, shared by the devices on the same bus (see TestScheduler). Must be called before starting the test
+	/// </summary>
+	/// <param name="gate">Gate or nullptr for none</param>
+	void SetIoGate(std::shared_ptr<IoGate> gate);
+
+	/// <summary>
+	/// Sets how many test files the final verification reads at the same time, must be called before starting the test
+	/// </summary>
+	/// <remarks>Every reader has a chunk buffer (up to 64MB) of its own, reserved for the final verification only</remarks>
+	/// <param name="readers">Reader threads, 1 verifies one file after the other</param>
+	void SetVerifyReaders(unsigned int readers);
+
+	/// <summary>
+	/// Sets the size of the test files written by the normal test, must be called before starting the test
+	/// </summary>
+	/// <remarks>
+	/// Fewer, larger files spend less time creating, opening and closing files. Each file has its space reserved
+	/// up front where the filesystem allows it, and is kept below 4GB on FAT
+	/// </remarks>
+	/// <param name="size">File size in bytes, rounded down to the data block size. 0 for a single file covering the whole capacity</param>
+	void SetTestFileSize(unsigned long long size);
+
+	/// <summary>
+	/// Gets the bus the disk shares with others, see IoBackend::GetBusGroup
+	/// </summary>
+	/// <returns>Bus identifier or an empty string if unknown</returns>
+	std::string GetBusGroup();
+
+	/// <summary>
+	/// Gets the totals of the I/O done so far
+	/// </summary>
+	const IoUsage& GetIoUsage() const { return ioUsage; }
+
+	/// <summary>
+	/// Gets the latency of every I/O request made so far, from submission to completion
+	/// </summary>
+	/// <param name="write">Write requests if true, read requests otherwise</param>
+	const LatencyHistogram& GetLatencyHistogram(bool write) const { return write ? writeLatency : readLatency; }
+
+
+	/// <summary>
+	/// Keeps a journal of the normal test on the host (see TestJournal). If the journal was left by an interrupted test
+	/// of the same disk and capacity, PerformTest carries on from it instead of writing everything again
+	/// </summary>
+	/// <remarks>Must be called before starting the test, an aborted test keeps its files on the disk so it can be resumed</remarks>
+	/// <param name="path">Journal path, on the host and not on the disk being tested. Empty for none</param>
+	void SetJournalPath(const std::string& path);
+
+	/// <summary>
+	/// Streams a throughput vs offset trace of the test to a CSV file, one line per chunk (see TraceWriter)
+	/// </summary>
+	/// <remarks>Must be called before starting the test, the file is complete once the test ends</remarks>
+	/// <param name="path">Trace path, on the host and not on the disk being tested. Empty for none</param>
+	/// <returns>False if the file couldn't be created</returns>
+	byte SetTraceFile(const std::string& path);
+
+	/// <summary>
+	/// Checks if PerformTest will resume an interrupted test, see SetJournalPath
+	/// </summary>
+	/// <returns>True if the journal matches this test and every file it lists is still on the disk</returns>
+	byte CanResume();
 
 	/// <summary>
 	/// Starts the normal disk test, this uses all of the parameters given on DiskTest
@@ -36,14 +184,72 @@ public:
 	byte PerformTest();
 
 	/// <summary>
-	/// Starts the destructive disk test, this will format the whole device before testing
+	/// Verifies the test files an earlier normal test left on the disk (deleteTempFiles off) without writing anything
 	/// </summary>
-	/// <returns>Test started successfully</returns>
+	/// <remarks>
+	/// The files are found through the manifest the normal test keeps in TSC_Files, they can be verified on another host
+	/// or by another build. Meant for retention testing: write a batch of cards, store them and re-verify them weeks later.
+	/// </remarks>
+	/// <returns>Every file verified successfully</returns>
+	byte PerformVerifyOnly();
+
+	/// <summary>
+	/// Starts the destructive disk test, this writes and verifies the whole raw device, destroying the filesystem on it
+	/// </summary>
+	/// <remarks>
+	/// The device is the one behind the test path (drive letter or mount point), or the path itself if it's a block device.
+	/// capacityToTest still applies, 0 covers every sector the device advertises.
+	/// </remarks>
+	/// <returns>Test completed successfully</returns>
 	byte PerformDestructiveTest();
 
 	/// <summary>
-	/// Stops the disk test
+	/// Quickly brackets the real capacity of the raw device, see PerformDestructiveTest for which device is used
+	/// </summary>
+	/// <remarks>
+	/// Writes a few tagged blocks at log spaced and random offsets across the advertised capacity, re-opens the device
+	/// and reads them back, then puts the original content of the blocks back. Takes seconds instead of hours,
+	/// GetLastSuccessfulVerifyPosition returns the lower bound afterwards.
+	/// A wrapping fake is only caught where two probes end up on the same storage, which the log spacing makes
+	/// sure of for the usual power of two real capacities. A full test is still what proves a device genuine.
+	/// The filesystems are left alone, so a device with one mounted (Linux) or in use (Windows) is refused.
+	/// </remarks>
+	/// <returns>True if every probed block was read back correctly and put back afterwards</returns>
+	byte PerformCapacityProbe();
+
+	/// <summary>
+	/// Gets the real capacity bounds found by PerformCapacityProbe, both are the device size if it's genuine
+	/// </summary>
+	/// <param name="lowerBound">Everything below this was read back correctly</param>
+	/// <param name="upperBound">The device can't store data at this position</param>
+	void GetProbeCapacityBounds(unsigned long long* lowerBound, unsigned long long* upperBound);
+
+	/// <summary>
+	/// Runs one of the tests on the calling thread, same as calling its Perform function
+	/// </summary>
+	/// <returns>What the Perform function returned</returns>
+	byte Run(TestKind kind);
+
+	/// <summary>
+	/// Runs one of the tests on a worker thread owned by the test and returns straight away, see Wait and ForceStopTest
 	/// </summary>
+	/// <returns>False if a test was already started</returns>
+	byte StartAsync(TestKind kind);
+
+	/// <summary>
+	/// Waits for the test started by StartAsync to end, GetTestState tells how it went
+	/// </summary>
+	/// <param name="timeoutMs">Longest wait in milliseconds, INFINITE_WAIT to wait for as long as it takes</param>
+	/// <returns>True if the test ended (or none was started), false on timeout</returns>
+	byte Wait(unsigned int timeoutMs);
+
+	static const unsigned int INFINITE_WAIT = 0xFFFFFFFF;
+
+	/// <summary>
+	/// Stops the disk test, from any thread. The transfer in progress is cancelled where the backend can
+	/// (see IoFile::CancelPending), otherwise the test stops once it completes
+	/// </summary>
+	/// <remarks>The test may still be winding down when this returns, Wait for it if it was started with StartAsync</remarks>
 	/// <returns>Test stopped successfully</returns>
 	byte ForceStopTest();
 
@@ -71,12 +277,55 @@ public:
 	/// <returns>Speed/p/second</returns>
 	double GetAverageWriteSpeed();
 
+	/// <summary>
+	/// Gets the speed estimator, for the recent speeds and the write speed drop of a full cache
+	/// </summary>
+	SpeedEstimator& GetSpeedEstimator();
+
+	/// <summary>
+	/// Takes the oldest events the test queued, a state change is always queued and progress at most every 250ms
+	/// </summary>
+	/// <remarks>Only one thread may poll a test</remarks>
+	/// <param name="buffer">Receives the events</param>
+	/// <param name="maxEvents">Size of the buffer</param>
+	/// <returns>Number of events stored</returns>
+	size_t PollEvents(TestEvent* buffer, size_t maxEvents);
+
+	/// <summary>
+	/// Gets the latest progress as one consistent snapshot, from any thread
+	/// </summary>
+	TestEvent GetSnapshot();
+
+	/// <summary>
+	/// Gets the number of events dropped because nobody polled and the queue filled up
+	/// </summary>
+	unsigned long long GetDroppedEvents();
+
 	/// <summary>
 	/// Gets the last position a write was successful
 	/// </summary>
 	/// <returns>Percentage</returns>
 	unsigned long long GetLastSuccessfulVerifyPosition();
 
+	/// <summary>
+	/// Starts every sector with a tag holding its address, so data read back from the wrong place says where it came from
+	/// </summary>
+	/// <remarks>Must be called before starting the test, the alias map is only filled in this mode</remarks>
+	/// <param name="enabled">Tag sectors</param>
+	void SetSectorTagging(bool enabled);
+
+	/// <summary>
+	/// Gets what the bad sectors found so far say about the device, see SetSectorTagging
+	/// </summary>
+	/// <returns>Alias map</returns>
+	const AliasMap& GetAliasMap();
+
+	/// <summary>
+	/// Gets the memory used by the I/O buffers
+	/// </summary>
+	/// <returns>Buffer arena stats</returns>
+	BufferArenaStats GetBufferStats();
+
 	/// <summary>
 	/// Returns a string formatted as YYMMDDhhmmss
 	/// </summary>
@@ -114,7 +363,7 @@ public:
 
 
 	/// <summary>
-	/// Call before deleting
+	/// Call before deleting, cancels the test started by StartAsync and waits for it
 	/// </summary>
 	void Dispose();
 
@@ -150,6 +399,83 @@ private:
 	/// </summary>
 	ProgressDelegate progressCallback;
 
+	/// <summary>
+	/// Everything that touches the disk goes through here
+	/// </summary>
+	std::shared_ptr<IoBackend> ioBackend;
+
+	/// <summary>
+	/// Asynchronous I/O (io_uring when available) and its settings
+	/// </summary>
+	std::unique_ptr<IoQueue> ioQueue;
+	unsigned int ioQueueDepth;
+	unsigned long long ioRequestSize;
+
+	/// <summary>
+	/// Files verified at the same time by the final verification, see VerifyTestFiles
+	/// </summary>
+	unsigned int verifyReaders;
+
+	/// <summary>
+	/// See SetIoAutoTune, the outcome of the last calibration and the speed it measured
+	/// </summary>
+	bool ioAutoTune;
+	bool ioTuned;
+	double ioTunedSpeed;
+
+	/// <summary>
+	/// Size of the files written by the normal test, 0 for a single one
+	/// </summary>
+	unsigned long long testFileSize;
+
+	/// <summary>
+	/// Gate shared with the other devices on the bus, and what went through it
+	/// </summary>
+	std::shared_ptr<IoGate> ioGate;
+	IoUsage ioUsage;
+
+	/// <summary>
+	/// Latency of each request, updated as requests complete
+	/// </summary>
+	LatencyHistogram writeLatency;
+	LatencyHistogram readLatency;
+
+	/// <summary>
+	/// Chunk buffers, taken from a fixed pool once per test and registered with the I/O queue
+	/// </summary>
+	BufferArena ioArena;
+	unsigned char* ioBuffers[2];
+
+	/// <summary>
+	/// A buffer per final verification reader, reserved for the duration of the pass
+	/// </summary>
+	BufferArena verifyArena;
+
+	/// <summary>
+	/// Sector tagging, the run ID is random per test. The alias map is filled by the verification readers too
+	/// </summary>
+	bool sectorTagging;
+	uint32_t runId;
+	AliasMap aliasMap;
+	std::mutex aliasMapMutex;
+
+	/// <summary>
+	/// Results of the capacity probe
+	/// </summary>
+	unsigned long long probeLowerBound;
+	unsigned long long probeUpperBound;
+
+	/// <summary>
+	/// Journal of the normal test, kept on the host
+	/// </summary>
+	std::string journalPath;
+	TestJournal journal;
+
+	/// <summary>
+	/// Throughput trace, see SetTraceFile
+	/// </summary>
+	TraceWriter trace;
+
 	/// <summary>
 	/// Vector of created files
 	/// </summary>
@@ -162,9 +488,18 @@ private:
 	unsigned long long dataBlockSize;
 	unsigned long long currentFileSize;
 
-	State CurrentState;
+	// Read by other threads while the test runs
+	std::atomic<State> CurrentState;
+	std::atomic<int> CurrentProgress;
 
-	int CurrentProgress;
+	/// <summary>
+	/// Progress reporting, see ReportProgress
+	/// </summary>
+	EventQueue events;
+	EventSnapshot snapshot;
+	ProgressNotifier notifier;
+	State lastReportedState;
+	std::chrono::steady_clock::time_point lastEventTime;
 
 	unsigned long long capacityToTest;
 	unsigned long long bytesWritten;
@@ -176,14 +511,53 @@ private:
 	// Unique bytes verified, used in the last verification
 	unsigned long long bealBytesVerified;
 
-	double totalWriteDuration;
-	double totalReadDuration;
+	/// <summary>
+	/// Read and write speeds, and the time remaining that follows from them
+	/// </summary>
+	SpeedEstimator speedEstimator;
 
-	double averageReadSpeed;
-	double averageWriteSpeed;
+	/// <summary>
+	/// Cancellation token, every test loop stops as soon as it's cleared
+	/// </summary>
+	std::atomic<bool> testRunning;
 
-	bool testRunning;
+	/// <summary>
+	/// Set by ForceStopTest while a StartAsync test hasn't got going yet, so it still stops
+	/// </summary>
+	std::atomic<bool> cancelRequested;
 
+	/// <summary>
+	/// Worker thread of StartAsync, asyncRunning is guarded by asyncMutex
+	/// </summary>
+	std::thread worker;
+	std::mutex asyncMutex;
+	std::condition_variable asyncDone;
+	bool asyncRunning;
+
+	/// <summary>
+	/// Files being transferred by TransferChunk, so ForceStopTest can cancel their requests
+	/// </summary>
+	std::mutex activeFileMutex;
+	std::vector<IoFile*> activeFiles;
+
+
+	/// <summary>
+	/// Marks the test as running, done first thing by every Perform function
+	/// </summary>
+	/// <returns>False if a test already ran or is running, or it was cancelled before it started</returns>
+	bool BeginTest();
+
+	/// <summary>
+	/// Waits for the StartAsync worker to end, if there is one
+	/// </summary>
+	void JoinWorker();
+
+	/// <summary>
+	/// Reads the journal and checks it belongs to an interrupted run of this test
+	/// </summary>
+	/// <param name="state">Receives the journal contents</param>
+	/// <returns>True if the test can be resumed from it</returns>
+	bool LoadJournal(JournalState* state);
 
 	/// <summary>
 	/// Writes a test file to the disk
@@ -192,12 +566,131 @@ private:
 	/// <param name="size">Size</param>
 	/// <param name="failOnFirst">Fail on first try</param>
 	/// <returns>Written verified position, or 0 if failed</returns>
-	unsigned long WriteAndVerifyTestFile(const std::string& filePath, unsigned long long fileSize, bool failOnFirst);
+	unsigned long long WriteAndVerifyTestFile(const std::string& filePath, unsigned long long fileSize, bool failOnFirst);
+
+	/// <summary>
+	/// Size of the chunks WritePattern writes size bytes in
+	/// </summary>
+	/// <returns>Up to MAX_RAND_DATA_SIZE, a multiple of the data block size unless size is smaller than a block</returns>
+	unsigned long long GetChunkSize(unsigned long long size);
+
+	/// <summary>
+	/// Writes the test pattern to a file or device from the start, double buffered so the next chunk is generated while the current one is written
+	/// </summary>
+	/// <param name="file">File or device, afterChunk is allowed to re-open it</param>
+	/// <param name="size">Bytes to write</param>
+	/// <param name="pattern">Test pattern</param>
+	/// <param name="streamOffset">Where the file sits in everything written by the test, only used for the trace</param>
+	/// <param name="afterChunk">Called after every chunk is written and flushed with a chunk buffer that is free to use, returns false to stop. Can be empty</param>
+	/// <returns>Bytes written</returns>
+	unsigned long long WritePattern(std::unique_ptr<IoFile>& file, unsigned long long size, const PatternGenerator& pattern, unsigned long long streamOffset, const std::function<bool(unsigned char*)>& afterChunk);
 
 	/// <summary>
-	/// Call to update average read/write speeds using the data available
+	/// Reads back a file or device and verifies it against the test pattern
 	/// </summary>
-	void RecalculateAverageSpeeds();
+	/// <param name="file">File or device</param>
+	/// <param name="size">Bytes to verify</param>
+	/// <param name="pattern">Test pattern</param>
+	/// <param name="streamOffset">Where the file sits in everything written by the test, only used for the trace</param>
+	/// <param name="updateRealBytes">Updates the total/real number of valid bytes</param>
+	/// <param name="quickCheck">Partial check in between writes, not counted towards the read speed</param>
+	/// <returns>Verified successfully</returns>
+	bool VerifyPattern(IoFile* file, unsigned long long size, const PatternGenerator& pattern, unsigned long long streamOffset, bool updateRealBytes, bool quickCheck);
+
+	/// <summary>
+	/// Picks the block offsets probed by PerformCapacityProbe
+	/// </summary>
+	/// <param name="deviceSize">Advertised size</param>
+	/// <param name="blockSize">Probe block size</param>
+	/// <returns>Sorted block aligned offsets</returns>
+	std::vector<unsigned long long> GetProbeOffsets(unsigned long long deviceSize, unsigned long long blockSize);
+
+	/// <summary>
+	/// Allocates the chunk buffers and sets up the I/O queue
+	/// </summary>
+	/// <param name="chunkSize">Largest chunk that will be transferred at once</param>
+	/// <returns>False if the buffers couldn't be allocated</returns>
+	bool PrepareIo(unsigned long long chunkSize);
+
+	/// <summary>
+	/// Reads or writes a whole chunk, split in ioRequestSize requests with up to ioQueueDepth of them in flight
+	/// </summary>
+	/// <param name="file">File</param>
+	/// <param name="write">Write if true, read otherwise</param>
+	/// <param name="offset">Position in the file</param>
+	/// <param name="data">Data</param>
+	/// <param name="size">Size</param>
+	/// <param name="queue">Queue to use, the test's own if null. Threads other than the test thread need one of their own</param>
+	/// <param name="requestSize">Size of the requests the chunk is split in, ioRequestSize if 0</param>
+	/// <returns>True if the whole chunk was transferred</returns>
+	bool TransferChunk(IoFile* file, bool write, unsigned long long offset, unsigned char* data, unsigned long long size, IoQueue* queue = nullptr, unsigned long long requestSize = 0);
+
+	/// <summary>
+	/// TransferChunk without the bookkeeping, stops submitting requests once the test is stopped
+	/// </summary>
+	bool TransferRequests(IoQueue* queue, IoFile* file, bool write, unsigned long long offset, unsigned char* data, unsigned long long size, unsigned long long requestSize);
+
+	/// <summary>
+	/// Picks ioRequestSize and ioQueueDepth, see SetIoAutoTune
+	/// </summary>
+	/// <remarks>
+	/// Request sizes are compared first at a moderate depth, then the depth at the best size. Each combination writes
+	/// the same region of a scratch file, where the first test file goes afterwards
+	/// </remarks>
+	/// <param name="filePath">Scratch file, removed afterwards</param>
+	/// <returns>True if the calibration ran to the end, the settings are left alone otherwise</returns>
+	bool CalibrateIo(const std::string& filePath);
+
+	/// <summary>
+	/// Measures one combination for CalibrateIo, writing and flushing chunks until enough data or time went by
+	/// </summary>
+	/// <remarks>
+	/// Only writes are timed: reading back what was just written is often served by the device's cache and would make
+	/// a combination look faster than it can sustain
+	/// </remarks>
+	/// <returns>Write speed in MB/s, or a negative value if a transfer failed</returns>
+	double MeasureIo(IoFile* file, unsigned char* data, unsigned long long chunkSize, unsigned long long requestSize, unsigned int depth);
+
+	/// <summary>
+	/// State shared by the final verification readers and the test thread, see VerifyTestFiles
+	/// </summary>
+	struct VerifyPass;
+
+	/// <summary>
+	/// Final verification of every test file, up to verifyReaders files are read at the same time
+	/// </summary>
+	/// <remarks>
+	/// The readers only read and compare, the test thread does all the accounting from what they hand back.
+	/// bealBytesVerified only ever covers the files from the first one up to the lowest failing offset, no matter
+	/// in which order the files finish. Once a file fails, files after it are left alone (they are still read for
+	/// the alias map with sector tagging and stopOnFirstError off), files before it are still verified as they
+	/// could fail even earlier.
+	/// </remarks>
+	/// <param name="useRecordedSize">Verify the size in testFiles, otherwise the size of the file on the disk</param>
+	/// <returns>Every file verified successfully</returns>
+	bool VerifyTestFiles(bool useRecordedSize);
+
+	/// <summary>
+	/// Reader thread of VerifyTestFiles, takes files in order until there are none left
+	/// </summary>
+	void VerifyReader(VerifyPass& pass);
+
+	/// <summary>
+	/// Reads back and compares a whole test file for VerifyReader, handing every chunk to the test thread
+	/// </summary>
+	void VerifyReaderFile(VerifyPass& pass, size_t index, IoQueue* queue, unsigned char* buffer);
+
+	/// <summary>
+	/// Adds a transferred chunk to the trace, if there is one
+	/// </summary>
+	void TraceChunk(TracePhase phase, unsigned long long offset, unsigned long long bytes, std::chrono::high_resolution_clock::duration duration);
+
+	/// <summary>
+	/// Publishes where the test is at: updates the snapshot, queues an event (coalesced) and wakes up the callback thread.
+	/// Called by the test thread only, never waits for whoever is listening
+	/// </summary>
+	/// <param name="state">State to report</param>
+	void ReportProgress(State state);
 
 	/// <summary>
 	/// Generates a unique test file name
@@ -228,16 +721,76 @@ private:
 	/// <param name="filePath">Path</param>
 	/// <param name="fileSize">File size, or zero if it needs to be fetched</param>
 	/// <param name="updateRealBytes">Updates the total/real number of valid bytes</param>			
-	/// <param name="pData">Optional: For verifying data without generating</param>			
+	/// <param name="quickCheck">Partial check in between writes, not counted towards the read speed</param>			
 	/// <returns>File verified successfully</returns>
-	bool InternalVerifyTestFile(const std::string& filePath, unsigned long long fileSize = 0, bool updateRealBytes = false, const unsigned char* pData = nullptr);
+	bool InternalVerifyTestFile(const std::string& filePath, unsigned long long fileSize = 0, bool updateRealBytes = false, bool quickCheck = false);
 
 	/// <summary>
-	/// Generate random data using a seed (mt19937 )
+	/// Generate the test pattern (see PatternGenerator) for part of a file
 	/// </summary>
 	/// <param name="data">Data</param>
-	/// <param name="fileSize">size</param>
-	void GenerateData(std::vector<unsigned char>& data, const std::string& seed);
+	/// <param name="size">size</param>
+	/// <param name="pattern">File pattern</param>
+	/// <param name="offset">Position of data in the file</param>
+	void GenerateData(unsigned char* data, size_t size, const PatternGenerator& pattern, unsigned long long offset);
+
+	/// <summary>
+	/// Same as GenerateData but returns straight away, wait on the group before using the data
+	/// </summary>
+	/// <param name="group">Group the generation tasks are added to</param>
+	/// <param name="data">Data</param>
+	/// <param name="size">size</param>
+	/// <param name="pattern">File pattern</param>
+	/// <param name="offset">Position of data in the file</param>
+	void GenerateDataAsync(TaskGroup& group, unsigned char* data, size_t size, const PatternGenerator& pattern, unsigned long long offset);
+
+	/// <summary>
+	/// Checks data read from a file against the test pattern, the expected data is regenerated and compared piece by piece
+	/// </summary>
+	/// <param name="data">Data read from the file</param>
+	/// <param name="size">size</param>
+	/// <param name="pattern">File pattern</param>
+	/// <param name="offset">Position of data in the file</param>
+	/// <returns>Index of the first byte that doesn't match, or size if everything matches</returns>
+	size_t CompareData(const unsigned char* data, size_t size, const PatternGenerator& pattern, unsigned long long offset);
+
+	/// <summary>
+	/// Gets the pattern seed for a test file
+	/// </summary>
+	/// <remarks>
+	/// SeedFromString of the run ID as 8 lowercase hex digits, a slash and the file name, e.g. "1a2b3c4d/20240131_12345.tsc".
+	/// Only the file name counts so the drive letter or mount point doesn't matter, the run ID keeps data of different runs apart.
+	/// </remarks>
+	/// <param name="filePath">Path, or just the name</param>
+	unsigned long long GetFileSeed(const std::string& filePath);
+
+	/// <summary>
+	/// Writes TSC_Files/TSC_Manifest.txt, listing the test files and everything needed to verify them later
+	/// </summary>
+	/// <returns>False if the manifest couldn't be written</returns>
+	bool WriteManifest();
+
+	/// <summary>
+	/// Reads the manifest left by an earlier test, filling the test files, run ID and sector tagging
+	/// </summary>
+	/// <returns>False if there's no valid manifest</returns>
+	bool LoadManifest();
+
+	/// <summary>
+	/// Gets the test pattern for a file or device, tagged if sector tagging is enabled
+	/// </summary>
+	/// <param name="seed">Seed</param>
+	/// <param name="baseAddress">Position of the data in everything written by the test</param>
+	PatternGenerator GetPattern(unsigned long long seed, unsigned long long baseAddress);
+
+	/// <summary>
+	/// Adds every bad sector of some tagged data to the alias map
+	/// </summary>
+	/// <param name="data">Data read back, starting at a sector boundary</param>
+	/// <param name="size">Size</param>
+	/// <param name="pattern">Pattern the data should match</param>
+	/// <param name="offset">Position of data in the file</param>
+	void RecordAliasing(const unsigned char* data, size_t size, const PatternGenerator& pattern, unsigned long long offset);
 
 	/// <summary>
 	/// Deletes all files and directories on this Disk
@@ -264,7 +817,7 @@ private:
 	/// Gets the given file size
 	/// </summary>
 	/// <param name="path">Path</param>
-	unsigned long GetFileSize(const std::string& path);
+	unsigned long long GetFileSize(const std::string& path);
 
 	/// <summary>
 	/// Used to updated CurrentProgress, MbWritten, MbToVerify values
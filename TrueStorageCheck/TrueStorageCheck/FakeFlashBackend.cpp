@@ -0,0 +1,457 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#include "FakeFlashBackend.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <thread>
+
+/// <summary>
+/// A file living inside the simulated device
+/// </summary>
+class FakeFlashFile : public IoFile
+{
+public:
+	FakeFlashFile(FakeFlashBackend* device, const std::string& path, bool writable) : device(device), path(path), writable(writable) {}
+
+	bool Read(unsigned long long offset, void* pData, size_t size) override
+	{
+		FakeFlashBackend::Extent extent;
+
+		// Reading past the end of the file is an error, same as the real thing
+		if (!device->GetExtent(path, &extent) || offset + size > extent.size)
+			return false;
+
+		return device->DeviceRead(extent.base + offset, pData, size);
+	}
+
+	bool Write(unsigned long long offset, const void* pData, size_t size) override
+	{
+		FakeFlashBackend::Extent extent;
+
+		if (!writable || !device->GrowExtent(path, offset + size) || !device->GetExtent(path, &extent))
+			return false;
+
+		return device->DeviceWrite(extent.base + offset, pData, size);
+	}
+
+	bool Flush() override
+	{
+		return device->DeviceFlush();
+	}
+
+	unsigned long long GetSize() override
+	{
+		FakeFlashBackend::Extent extent;
+
+		if (!device->GetExtent(path, &extent))
+			return 0;
+
+		return extent.size;
+	}
+
+	void CancelPending() override
+	{
+		device->CancelPending();
+	}
+
+private:
+	FakeFlashBackend* device;
+	std::string path;
+	bool writable;
+};
+
+/// <summary>
+/// The whole simulated device, for raw access
+/// </summary>
+class FakeFlashDevice : public IoFile
+{
+public:
+	FakeFlashDevice(FakeFlashBackend* device, unsigned long long size) : device(device), size(size) {}
+
+	bool Read(unsigned long long offset, void* pData, size_t size) override
+	{
+		return device->DeviceRead(offset, pData, size);
+	}
+
+	bool Write(unsigned long long offset, const void* pData, size_t size) override
+	{
+		return device->DeviceWrite(offset, pData, size);
+	}
+
+	bool Flush() override
+	{
+		return device->DeviceFlush();
+	}
+
+	unsigned long long GetSize() override
+	{
+		return size;
+	}
+
+	void CancelPending() override
+	{
+		device->CancelPending();
+	}
+
+private:
+	FakeFlashBackend* device;
+	unsigned long long size;
+};
+
+FakeFlashBackend::FakeFlashBackend(const std::string& backingPath, unsigned long long advertisedSize, unsigned long long realSize, FakeFlashMode mode)
+	: advertisedSize(advertisedSize), mode(mode), allocatedSize(0), totalBytesWritten(0), cancelGeneration(0)
+{
+	this->realSize = realSize - (realSize % blockSize);
+
+	// Regular files are (re)sized to the real capacity, loop devices are used as they are
+	std::error_code ec;
+	if (!std::filesystem::exists(backingPath, ec) || std::filesystem::is_regular_file(backingPath, ec))
+	{
+		std::unique_ptr<IoFile> file = IoBackend::CreateNative()->Open(backingPath, IoOpenMode::CreateAlways);
+		file.reset();
+		std::filesystem::resize_file(backingPath, this->realSize, ec);
+
+		if (ec)
+			return;
+	}
+
+	if (this->realSize == 0 || this->realSize > advertisedSize)
+		return;
+
+	backing = IoBackend::CreateNative()->Open(backingPath, IoOpenMode::OpenExisting);
+}
+
+void FakeFlashBackend::SetProfile(const FakeFlashProfile& profile)
+{
+	this->profile = profile;
+	std::sort(this->profile.writeSpeedCurve.begin(), this->profile.writeSpeedCurve.end());
+}
+
+double FakeFlashBackend::GetWriteSpeed(unsigned long long bytesWrittenSoFar) const
+{
+	double speed = 0;
+
+	for (const auto& point : profile.writeSpeedCurve)
+	{
+		if (point.first > bytesWrittenSoFar)
+			break;
+
+		speed = point.second;
+	}
+
+	return speed;
+}
+
+bool FakeFlashBackend::Throttle(std::chrono::steady_clock::time_point start, unsigned long long generation, size_t size, bool write)
+{
+	double speed = write ? GetWriteSpeed(totalBytesWritten) : profile.readSpeed;
+
+	double durationUs = profile.latencyUs;
+
+	if (speed > 0)
+		durationUs += (size / (speed * 1024 * 1024)) * 1000000.0;
+
+	std::unique_lock<std::mutex> lock(cancelMutex);
+
+	if (durationUs > 0)
+		cancelled.wait_until(lock, start + std::chrono::microseconds((long long)durationUs), [&] { return cancelGeneration != generation; });
+
+	return cancelGeneration == generation;
+}
+
+void FakeFlashBackend::CancelPending()
+{
+	{
+		std::lock_guard<std::mutex> lock(cancelMutex);
+		cancelGeneration++;
+	}
+
+	cancelled.notify_all();
+}
+
+bool FakeFlashBackend::DeviceRead(unsigned long long offset, void* pData, size_t size)
+{
+	if (backing == nullptr || offset + size > advertisedSize)
+		return false;
+
+	auto start = std::chrono::steady_clock::now();
+	unsigned long long generation = cancelGeneration;
+
+	unsigned char* p = static_cast<unsigned char*>(pData);
+
+	while (size > 0)
+	{
+		size_t piece;
+
+		if (offset < realSize)
+		{
+			piece = (size_t)std::min<unsigned long long>(size, realSize - offset);
+
+			if (!backing->Read(offset, p, piece))
+				return false;
+		}
+		else if (mode == FakeFlashMode::Drop)
+		{
+			// Nothing behind this address
+			piece = size;
+			memset(p, 0, piece);
+		}
+		else
+		{
+			// Wrap and Stale both hand back whatever the aliased address holds
+			unsigned long long aliased = offset % realSize;
+			piece = (size_t)std::min<unsigned long long>(size, realSize - aliased);
+
+			if (!backing->Read(aliased, p, piece))
+				return false;
+		}
+
+		p += piece;
+		offset += piece;
+		size -= piece;
+	}
+
+	return Throttle(start, generation, p - static_cast<unsigned char*>(pData), false);
+}
+
+bool FakeFlashBackend::DeviceWrite(unsigned long long offset, const void* pData, size_t size)
+{
+	if (backing == nullptr || offset + size > advertisedSize)
+		return false;
+
+	auto start = std::chrono::steady_clock::now();
+	unsigned long long generation = cancelGeneration;
+
+	const unsigned char* p = static_cast<const unsigned char*>(pData);
+	size_t totalSize = size;
+
+	while (size > 0)
+	{
+		size_t piece;
+
+		if (offset < realSize)
+		{
+			piece = (size_t)std::min<unsigned long long>(size, realSize - offset);
+
+			if (!backing->Write(offset, p, piece))
+				return false;
+		}
+		else if (mode == FakeFlashMode::Wrap)
+		{
+			unsigned long long aliased = offset % realSize;
+			piece = (size_t)std::min<unsigned long long>(size, realSize - aliased);
+
+			if (!backing->Write(aliased, p, piece))
+				return false;
+		}
+		else
+		{
+			// Silently dropped, the device still claims success
+			piece = size;
+		}
+
+		p += piece;
+		offset += piece;
+		size -= piece;
+	}
+
+	bool ret = Throttle(start, generation, totalSize, true);
+
+	// A cancelled write may or may not have reached the medium, same as the real thing
+	totalBytesWritten += totalSize;
+
+	return ret;
+}
+
+bool FakeFlashBackend::DeviceFlush()
+{
+	return backing != nullptr && backing->Flush();
+}
+
+bool FakeFlashBackend::GrowExtent(const std::string& path, unsigned long long newSize)
+{
+	std::lock_guard<std::mutex> lock(extentsMutex);
+
+	auto it = extents.find(path);
+
+	if (it == extents.end())
+		return false;
+
+	Extent& extent = it->second;
+
+	if (newSize <= extent.size)
+		return true;
+
+	// A file grows into the free space up to the next file, the last one up to the end of the device
+	unsigned long long limit = advertisedSize;
+
+	for (const auto& other : extents)
+	{
+		if (other.second.base > extent.base)
+			limit = std::min(limit, other.second.base);
+	}
+
+	if (extent.base + newSize > limit)
+	{
+		// An empty file has nothing to move, it simply goes to the end like a new one would
+		unsigned long long base = (allocatedSize + blockSize - 1) / blockSize * blockSize;
+
+		if (extent.size != 0 || base + newSize > advertisedSize)
+			return false;
+
+		extent.base = base;
+	}
+
+	extent.size = newSize;
+	allocatedSize = std::max(allocatedSize, extent.base + newSize);
+
+	return true;
+}
+
+bool FakeFlashBackend::GetExtent(const std::string& path, Extent* extent)
+{
+	std::lock_guard<std::mutex> lock(extentsMutex);
+
+	auto it = extents.find(path);
+
+	if (it == extents.end())
+		return false;
+
+	*extent = it->second;
+
+	return true;
+}
+
+std::unique_ptr<IoFile> FakeFlashBackend::Open(const std::string& path, IoOpenMode mode)
+{
+	if (backing == nullptr)
+		return nullptr;
+
+	std::lock_guard<std::mutex> lock(extentsMutex);
+
+	auto it = extents.find(path);
+
+	if (mode == IoOpenMode::CreateAlways)
+	{
+		if (it != extents.end())
+		{
+			// Truncated in place, giving the space back if it's the last file. The rewritten file takes the same space
+			// again as long as it fits before the next one, see GrowExtent
+			if (it->second.base + it->second.size == allocatedSize)
+				allocatedSize = it->second.base;
+
+			it->second.size = 0;
+		}
+		else
+		{
+			// Anything else is a new file at the end, block aligned like a cluster would be
+			unsigned long long base = (allocatedSize + blockSize - 1) / blockSize * blockSize;
+
+			if (base >= advertisedSize)
+				return nullptr;
+
+			extents[path] = { base, 0 };
+			allocatedSize = base;
+		}
+	}
+	else if (it == extents.end())
+	{
+		return nullptr;
+	}
+
+	return std::make_unique<FakeFlashFile>(this, path, mode != IoOpenMode::ReadOnly);
+}
+
+bool FakeFlashBackend::MakeDirectory(const std::string& /*path*/)
+{
+	// Directories are only names here
+	return true;
+}
+
+void FakeFlashBackend::RemoveTree(const std::string& path)
+{
+	std::lock_guard<std::mutex> lock(extentsMutex);
+
+	allocatedSize = 0;
+
+	for (auto it = extents.begin(); it != extents.end();)
+	{
+		if (it->first.compare(0, path.size(), path) == 0)
+		{
+			it = extents.erase(it);
+			continue;
+		}
+
+		allocatedSize = std::max(allocatedSize, it->second.base + it->second.size);
+		++it;
+	}
+}
+
+bool FakeFlashBackend::RemoveFile(const std::string& path)
+{
+	std::lock_guard<std::mutex> lock(extentsMutex);
+
+	extents.erase(path);
+
+	// The space after the last remaining file is free again
+	allocatedSize = 0;
+
+	for (const auto& extent : extents)
+		allocatedSize = std::max(allocatedSize, extent.second.base + extent.second.size);
+
+	return true;
+}
+
+bool FakeFlashBackend::GetDiskSpace(const std::string& /*path*/, unsigned long long* totalSpace, unsigned long long* freeSpace)
+{
+	if (backing == nullptr)
+		return false;
+
+	std::lock_guard<std::mutex> lock(extentsMutex);
+
+	*totalSpace = advertisedSize;
+	*freeSpace = advertisedSize - allocatedSize;
+
+	return true;
+}
+
+unsigned long FakeFlashBackend::GetDataBlockSize(const std::string& /*path*/)
+{
+	return blockSize;
+}
+
+std::string FakeFlashBackend::GetDevicePath(const std::string& /*path*/)
+{
+	// There's only one device, the name is just for logs
+	return "fakeflash";
+}
+
+std::string FakeFlashBackend::GetBusGroup(const std::string& /*path*/)
+{
+	// Simulated devices all hang from the same pretend hub, handy for trying the scheduler out
+	return "fakeflash";
+}
+
+std::unique_ptr<IoFile> FakeFlashBackend::OpenDevice(const std::string& /*devicePath*/, unsigned long long* size, unsigned long* sectorSize, DeviceAccess access)
+{
+	if (backing == nullptr)
+		return nullptr;
+
+	// Raw access wipes out the simulated filesystem, same as it would on the real thing
+	if (access == DeviceAccess::Dismount)
+	{
+		std::lock_guard<std::mutex> lock(extentsMutex);
+		extents.clear();
+		allocatedSize = 0;
+	}
+
+	*size = advertisedSize;
+	*sectorSize = this->sectorSize;
+
+	return std::make_unique<FakeFlashDevice>(this, advertisedSize);
+}
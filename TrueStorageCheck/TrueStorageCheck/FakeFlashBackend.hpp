@@ -0,0 +1,150 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "IoBackend.hpp"
+
+/// <summary>
+/// What a fake device does with anything past its real capacity
+/// </summary>
+enum class FakeFlashMode
+{
+	// Addresses wrap around, writes past the real capacity overwrite the beginning (most common fake)
+	Wrap = 0,
+	// Writes past the real capacity are dropped, reading there returns zeros
+	Drop,
+	// Writes past the real capacity are dropped, reading there returns whatever older data the aliased address holds
+	Stale
+};
+
+/// <summary>
+/// Timing behaviour of a simulated device
+/// </summary>
+struct FakeFlashProfile
+{
+	// Fixed cost added to every request
+	unsigned int latencyUs = 0;
+
+	// Read bandwidth in MB/s, 0 for unlimited
+	double readSpeed = 0;
+
+	// Write bandwidth curve as (total bytes written so far, MB/s) points sorted by bytes,
+	// e.g. {{0, 90}, {1GB, 12}} for a stick that drops to 12MB/s once its cache is full. Empty for unlimited
+	std::vector<std::pair<unsigned long long, double>> writeSpeedCurve;
+};
+
+/// <summary>
+/// Simulated counterfeit device, advertises advertisedSize bytes but only stores realSize bytes
+/// in a backing file (tmpfs file or loop device).
+/// </summary>
+/// <remarks>
+/// Files are laid out one after the other in the simulated address space in the order they are created,
+/// which is what a freshly formatted FAT/exFAT stick does with our sequentially written test files.
+/// </remarks>
+class FakeFlashBackend : public IoBackend
+{
+public:
+	/// <param name="backingPath">Backing store, created and sized to realSize if it's a regular file</param>
+	/// <param name="advertisedSize">Size the device claims to have in bytes</param>
+	/// <param name="realSize">Size the device can really store in bytes, rounded down to the block size</param>
+	/// <param name="mode">Behaviour past realSize</param>
+	FakeFlashBackend(const std::string& backingPath, unsigned long long advertisedSize, unsigned long long realSize, FakeFlashMode mode);
+
+	/// <summary>
+	/// Sets the latency/bandwidth profile, call before the test starts
+	/// </summary>
+	void SetProfile(const FakeFlashProfile& profile);
+
+	/// <summary>
+	/// True if the backing store could be opened
+	/// </summary>
+	bool IsValid() const { return backing != nullptr; }
+
+	const char* GetName() const override { return "fakeflash"; }
+
+	std::unique_ptr<IoFile> Open(const std::string& path, IoOpenMode mode) override;
+	bool MakeDirectory(const std::string& path) override;
+	void RemoveTree(const std::string& path) override;
+	bool RemoveFile(const std::string& path) override;
+	bool GetDiskSpace(const std::string& path, unsigned long long* totalSpace, unsigned long long* freeSpace) override;
+	unsigned long GetDataBlockSize(const std::string& path) override;
+	std::string GetDevicePath(const std::string& path) override;
+	std::unique_ptr<IoFile> OpenDevice(const std::string& devicePath, unsigned long long* size, unsigned long* sectorSize, DeviceAccess access) override;
+	std::string GetBusGroup(const std::string& path) override;
+
+	/// <summary>
+	/// Device level access used by the simulated files, offsets are in the advertised address space
+	/// </summary>
+	bool DeviceRead(unsigned long long offset, void* pData, size_t size);
+	bool DeviceWrite(unsigned long long offset, const void* pData, size_t size);
+	bool DeviceFlush();
+
+	/// <summary>
+	/// Fails the requests being throttled right now, see IoFile::CancelPending
+	/// </summary>
+	void CancelPending();
+
+	/// <summary>
+	/// Simulated file extent, files are contiguous and can only grow into the free space right after them
+	/// </summary>
+	struct Extent
+	{
+		unsigned long long base;
+		unsigned long long size;
+	};
+
+	/// <summary>
+	/// Called by the simulated files when they grow
+	/// </summary>
+	bool GrowExtent(const std::string& path, unsigned long long newSize);
+
+	/// <summary>
+	/// Gets the extent of a file, false if it doesn't exist
+	/// </summary>
+	bool GetExtent(const std::string& path, Extent* extent);
+
+private:
+
+	// Sector size reported to DiskTest, also the granularity we map at
+	const unsigned long blockSize = 4096;
+
+	// Logical sector size reported for raw access, what USB sticks report
+	const unsigned long sectorSize = 512;
+
+	std::unique_ptr<IoFile> backing;
+
+	unsigned long long advertisedSize;
+	unsigned long long realSize;
+	FakeFlashMode mode;
+	FakeFlashProfile profile;
+
+	std::mutex extentsMutex;
+	std::map<std::string, Extent> extents;
+
+	// End of the last allocated extent
+	unsigned long long allocatedSize;
+
+	// Drives the write speed curve
+	std::atomic<unsigned long long> totalBytesWritten;
+
+	// Bumped by CancelPending, wakes up the requests sleeping in Throttle
+	std::mutex cancelMutex;
+	std::condition_variable cancelled;
+	std::atomic<unsigned long long> cancelGeneration;
+
+	// Sleeps until the simulated request would have completed, false if it was cancelled since it started
+	bool Throttle(std::chrono::steady_clock::time_point start, unsigned long long generation, size_t size, bool write);
+	double GetWriteSpeed(unsigned long long bytesWrittenSoFar) const;
+};
@@ -0,0 +1,179 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "IoQueue.hpp"
+
+/// <summary>
+/// How a file is opened by the backend, all modes bypass the OS cache
+/// </summary>
+enum class IoOpenMode
+{
+	// Create (or truncate) the file for writing and reading back
+	CreateAlways = 0,
+	// Re-open an existing file for writing and reading back
+	OpenExisting,
+	// Open an existing file for verification only
+	ReadOnly
+};
+
+/// <summary>
+/// How IoBackend::OpenDevice gets a whole device to itself
+/// </summary>
+enum class DeviceAccess
+{
+	// Unmount (Linux) or dismount (Windows) every filesystem on the device, they are gone afterwards.
+	// All or nothing: a disk the running system uses (root, /boot, /usr, swap...) or with a busy filesystem is refused
+	Dismount = 0,
+	// Leave the filesystems alone, fail while one is mounted (Linux) or in use (Windows, the volumes stay mounted but locked)
+	KeepMounted
+};
+
+/// <summary>
+/// A file opened through an IoBackend
+/// </summary>
+/// <remarks>
+/// All I/O is positional and unbuffered, buffers must be IO_BUFFER_ALIGNMENT aligned and
+/// offsets/sizes a multiple of the data block size (except for the very end of a file)
+/// </remarks>
+class IoFile
+{
+public:
+	virtual ~IoFile() {}
+
+	/// <summary>
+	/// Reads exactly size bytes at the given offset
+	/// </summary>
+	/// <returns>True if everything was read</returns>
+	virtual bool Read(unsigned long long offset, void* pData, size_t size) = 0;
+
+	/// <summary>
+	/// Writes exactly size bytes at the given offset
+	/// </summary>
+	/// <returns>True if everything was written</returns>
+	virtual bool Write(unsigned long long offset, const void* pData, size_t size) = 0;
+
+	/// <summary>
+	/// Makes sure everything written so far reached the device
+	/// </summary>
+	virtual bool Flush() = 0;
+
+	/// <summary>
+	/// Gets the file size
+	/// </summary>
+	/// <returns>Size in bytes or 0 if it can't be retrieved</returns>
+	virtual unsigned long long GetSize() = 0;
+
+	/// <summary>
+	/// Reserves space for the file to grow to size bytes without changing its size, so writing it
+	/// doesn't make the filesystem allocate it a bit at a time
+	/// </summary>
+	/// <returns>True if the space was reserved, false if the backend or filesystem can't (not an error)</returns>
+	virtual bool Reserve(unsigned long long /*size*/) { return false; }
+
+	/// <summary>
+	/// Makes the reads and writes in progress on the file fail as soon as possible, from any thread.
+	/// Requests made afterwards are not affected
+	/// </summary>
+	/// <remarks>Best effort, a request the device already started may still run to the end</remarks>
+	virtual void CancelPending() {}
+};
+
+/// <summary>
+/// Block I/O backend used by DiskTest for everything that touches the device under test
+/// </summary>
+class IoBackend
+{
+public:
+	virtual ~IoBackend() {}
+
+	/// <summary>
+	/// Backend name, for logs
+	/// </summary>
+	virtual const char* GetName() const = 0;
+
+	/// <summary>
+	/// Opens a file
+	/// </summary>
+	/// <returns>The opened file or nullptr if it failed</returns>
+	virtual std::unique_ptr<IoFile> Open(const std::string& path, IoOpenMode mode) = 0;
+
+	/// <summary>
+	/// Creates a directory
+	/// </summary>
+	/// <returns>True if the directory exists afterwards</returns>
+	virtual bool MakeDirectory(const std::string& path) = 0;
+
+	/// <summary>
+	/// Removes a directory and everything in it, then flushes the changes
+	/// </summary>
+	virtual void RemoveTree(const std::string& path) = 0;
+
+	/// <summary>
+	/// Removes a file
+	/// </summary>
+	/// <returns>True if the file doesn't exist afterwards</returns>
+	virtual bool RemoveFile(const std::string& path) = 0;
+
+	/// <summary>
+	/// Gets disk space
+	/// </summary>
+	/// <param name="path">Disk path</param>
+	/// <param name="totalSpace">Total disk space</param>
+	/// <param name="freeSpace">Free disk space</param>
+	/// <returns>True if successfull retrieving the disk space</returns>
+	virtual bool GetDiskSpace(const std::string& path, unsigned long long* totalSpace, unsigned long long* freeSpace) = 0;
+
+	/// <summary>
+	/// Retrieves the data block size of a disk by the specified path
+	/// </summary>
+	/// <returns>The data block size in bytes or 0 if an error occurs</returns>
+	virtual unsigned long GetDataBlockSize(const std::string& path) = 0;
+
+	/// <summary>
+	/// Gets the largest file the filesystem of a disk can hold
+	/// </summary>
+	/// <returns>Size in bytes, 0 if there's no limit worth knowing about</returns>
+	virtual unsigned long long GetMaxFileSize(const std::string& /*path*/) { return 0; }
+
+	/// <summary>
+	/// Finds the whole disk behind a drive root, mount point or partition, not just the partition mounted there
+	/// </summary>
+	/// <returns>Device path or an empty string if there's none (or the backend can't do raw access)</returns>
+	virtual std::string GetDevicePath(const std::string& /*path*/) { return ""; }
+
+	/// <summary>
+	/// Opens a whole device for raw access, locking every volume on it (Windows) or opening it exclusively (Linux) so nothing else touches it
+	/// </summary>
+	/// <param name="devicePath">Device path, as given by GetDevicePath</param>
+	/// <param name="size">Device size in bytes</param>
+	/// <param name="sectorSize">Logical sector size in bytes, every request must be a multiple of it</param>
+	/// <param name="access">What happens to the filesystems on the device</param>
+	/// <returns>The opened device or nullptr if it failed</returns>
+	virtual std::unique_ptr<IoFile> OpenDevice(const std::string& /*devicePath*/, unsigned long long* /*size*/, unsigned long* /*sectorSize*/, DeviceAccess /*access*/) { return nullptr; }
+
+	/// <summary>
+	/// Identifies the link a disk shares with other disks, the USB root port it hangs from or its storage controller
+	/// </summary>
+	/// <param name="path">Drive root, mount point or device path</param>
+	/// <returns>Disks with the same group compete for bandwidth, an empty string if unknown</returns>
+	virtual std::string GetBusGroup(const std::string& /*path*/) { return ""; }
+
+	/// <summary>
+	/// Creates a queue for asynchronous I/O on files opened by this backend
+	/// </summary>
+	/// <param name="depth">Maximum number of requests in flight</param>
+	/// <remarks>Backends without real asynchronous I/O get the synchronous fallback</remarks>
+	virtual std::unique_ptr<IoQueue> CreateQueue(unsigned int depth) { return std::make_unique<SyncIoQueue>(depth); }
+
+	/// <summary>
+	/// Creates the native backend for the platform we were built for
+	/// </summary>
+	static std::shared_ptr<IoBackend> CreateNative();
+};
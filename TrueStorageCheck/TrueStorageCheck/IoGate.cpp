@@ -0,0 +1,83 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#include "IoGate.hpp"
+
+#include <algorithm>
+
+static unsigned long long ElapsedNs(std::chrono::steady_clock::time_point since)
+{
+	return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - since).count();
+}
+
+IoGate::IoGate(unsigned int slots) : slots(std::max(1u, slots)), slotsInUse(0), nextTicket(0), servingTicket(0) {}
+
+void IoGate::SetSlots(unsigned int count)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		slots.store(std::max(1u, count), std::memory_order_relaxed);
+	}
+
+	slotFreed.notify_all();
+}
+
+void IoGate::Acquire()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	unsigned long long ticket = nextTicket++;
+
+	slotFreed.wait(lock, [&] { return ticket == servingTicket && slotsInUse < slots.load(std::memory_order_relaxed); });
+
+	servingTicket++;
+	slotsInUse++;
+
+	// The next in line may be able to go too
+	lock.unlock();
+	slotFreed.notify_all();
+}
+
+void IoGate::Release()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		slotsInUse--;
+	}
+
+	slotFreed.notify_all();
+}
+
+IoGate::Slot::Slot(IoGate* gate, IoUsage& usage, unsigned long long bytes) : gate(gate), usage(usage), bytes(bytes)
+{
+	start = std::chrono::steady_clock::now();
+
+	if (gate == nullptr)
+		return;
+
+	gate->Acquire();
+
+	unsigned long long waited = ElapsedNs(start);
+	usage.waitNs += waited;
+	gate->usage.waitNs += waited;
+
+	start = std::chrono::steady_clock::now();
+}
+
+IoGate::Slot::~Slot()
+{
+	unsigned long long busy = ElapsedNs(start);
+
+	usage.bytes += bytes;
+	usage.busyNs += busy;
+
+	if (gate == nullptr)
+		return;
+
+	gate->usage.bytes += bytes;
+	gate->usage.busyNs += busy;
+
+	gate->Release();
+}
@@ -0,0 +1,88 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+/// <summary>
+/// Running totals of the I/O done through a gate, by one device or by a whole group
+/// </summary>
+struct IoUsage
+{
+	// Bytes transferred
+	std::atomic<unsigned long long> bytes{ 0 };
+
+	// Time spent transferring while holding a slot
+	std::atomic<unsigned long long> busyNs{ 0 };
+
+	// Time spent waiting for a slot
+	std::atomic<unsigned long long> waitNs{ 0 };
+};
+
+/// <summary>
+/// Limits how many devices sharing a bus transfer at the same time
+/// </summary>
+/// <remarks>
+/// Slots are handed out first come first served, so every device of the group gets its turn no matter how
+/// fast it is. The number of slots can change at any time, transfers already running are left alone.
+/// </remarks>
+class IoGate
+{
+public:
+	IoGate(unsigned int slots);
+
+	IoGate(const IoGate&) = delete;
+	IoGate& operator=(const IoGate&) = delete;
+
+	/// <summary>
+	/// Holds a slot for as long as it lives, a null gate only accounts the usage
+	/// </summary>
+	class Slot
+	{
+	public:
+		Slot(IoGate* gate, IoUsage& usage, unsigned long long bytes);
+		~Slot();
+
+		Slot(const Slot&) = delete;
+		Slot& operator=(const Slot&) = delete;
+
+	private:
+		IoGate* gate;
+		IoUsage& usage;
+		unsigned long long bytes;
+		std::chrono::steady_clock::time_point start;
+	};
+
+	/// <summary>
+	/// Sets the number of transfers allowed at the same time, at least 1
+	/// </summary>
+	void SetSlots(unsigned int slots);
+	unsigned int GetSlots() const { return slots.load(std::memory_order_relaxed); }
+
+	/// <summary>
+	/// Totals of every transfer done through the gate
+	/// </summary>
+	const IoUsage& GetUsage() const { return usage; }
+
+private:
+	std::mutex mutex;
+	std::condition_variable slotFreed;
+
+	std::atomic<unsigned int> slots;
+	unsigned int slotsInUse;
+
+	// Tickets keep the order in which devices asked for a slot
+	unsigned long long nextTicket;
+	unsigned long long servingTicket;
+
+	IoUsage usage;
+
+	void Acquire();
+	void Release();
+};
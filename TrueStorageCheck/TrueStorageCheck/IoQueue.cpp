@@ -0,0 +1,33 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#include "IoQueue.hpp"
+#include "IoBackend.hpp"
+
+bool SyncIoQueue::Submit(const IoRequest& request)
+{
+	if (completed.size() >= depth)
+		return false;
+
+	bool success = request.write ? request.file->Write(request.offset, request.pData, request.size) : request.file->Read(request.offset, request.pData, request.size);
+
+	completed.push_back({ request.userData, success });
+
+	return true;
+}
+
+int SyncIoQueue::Reap(IoCompletion* completions, int maxCompletions, int /*minCompletions*/)
+{
+	int count = 0;
+
+	// Everything finished when it was submitted
+	while (count < maxCompletions && !completed.empty())
+	{
+		completions[count++] = completed.front();
+		completed.pop_front();
+	}
+
+	return count;
+}
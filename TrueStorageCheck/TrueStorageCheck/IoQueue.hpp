@@ -0,0 +1,100 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <utility>
+#include <vector>
+
+class IoFile;
+
+/// <summary>
+/// A single read or write handed to an IoQueue
+/// </summary>
+struct IoRequest
+{
+	IoFile* file;
+	bool write;
+	unsigned long long offset;
+	unsigned char* pData;
+	size_t size;
+
+	// Handed back untouched in the completion
+	unsigned long long userData;
+};
+
+/// <summary>
+/// Result of a finished IoRequest
+/// </summary>
+struct IoCompletion
+{
+	unsigned long long userData;
+	bool success;
+};
+
+/// <summary>
+/// Keeps several requests in flight, some enclosures only reach their rated speed that way
+/// </summary>
+class IoQueue
+{
+public:
+	virtual ~IoQueue() {}
+
+	/// <summary>
+	/// Engine name, for logs
+	/// </summary>
+	virtual const char* GetName() const = 0;
+
+	/// <summary>
+	/// Maximum number of requests in flight
+	/// </summary>
+	virtual unsigned int GetDepth() const = 0;
+
+	/// <summary>
+	/// False if requests run one after the other as they are submitted, the depth makes no difference then
+	/// </summary>
+	virtual bool IsAsynchronous() const = 0;
+
+	/// <summary>
+	/// Registers long lived buffers so the kernel doesn't have to map them on every request.
+	/// Requests are not required to use them, it's just faster when they do.
+	/// </summary>
+	/// <returns>True if the buffers were registered</returns>
+	virtual bool RegisterBuffers(const std::vector<std::pair<unsigned char*, size_t>>& /*buffers*/) { return false; }
+
+	/// <summary>
+	/// Queues a request, never more than GetDepth() at a time
+	/// </summary>
+	/// <returns>False if it couldn't be queued, the request isn't in flight then and its buffer is free</returns>
+	virtual bool Submit(const IoRequest& request) = 0;
+
+	/// <summary>
+	/// Collects finished requests, waiting until at least minCompletions are available
+	/// </summary>
+	/// <returns>Number of completions stored, or -1 on error. Completions already collected are returned first</returns>
+	virtual int Reap(IoCompletion* completions, int maxCompletions, int minCompletions) = 0;
+};
+
+/// <summary>
+/// Fallback queue, runs each request synchronously as it is submitted
+/// </summary>
+class SyncIoQueue : public IoQueue
+{
+public:
+	SyncIoQueue(unsigned int depth) : depth(depth) {}
+
+	const char* GetName() const override { return "sync"; }
+	unsigned int GetDepth() const override { return depth; }
+	bool IsAsynchronous() const override { return false; }
+
+	bool Submit(const IoRequest& request) override;
+	int Reap(IoCompletion* completions, int maxCompletions, int minCompletions) override;
+
+private:
+	unsigned int depth;
+	std::deque<IoCompletion> completed;
+};
@@ -0,0 +1,100 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#include "LatencyHistogram.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+LatencyHistogram::LatencyHistogram()
+{
+	Clear();
+}
+
+void LatencyHistogram::Clear()
+{
+	for (auto& bucket : buckets)
+		bucket.store(0, std::memory_order_relaxed);
+
+	count.store(0, std::memory_order_relaxed);
+	sum.store(0, std::memory_order_relaxed);
+	max.store(0, std::memory_order_relaxed);
+}
+
+size_t LatencyHistogram::GetBucket(unsigned long long nanoseconds)
+{
+	nanoseconds = std::min(nanoseconds, (1ull << MAX_EXPONENT) - 1);
+
+	// The first SUB_BUCKETS values are exact
+	if (nanoseconds < (unsigned long long)SUB_BUCKETS)
+		return (size_t)nanoseconds;
+
+	int exponent = SUB_BUCKET_BITS;
+	while ((nanoseconds >> (exponent + 1)) != 0)
+		exponent++;
+
+	// The top SUB_BUCKET_BITS + 1 bits pick the bucket, the leading one is implied by the exponent
+	int shift = exponent - SUB_BUCKET_BITS;
+	size_t subBucket = (size_t)(nanoseconds >> shift) - SUB_BUCKETS;
+
+	return (size_t)(shift + 1) * SUB_BUCKETS + subBucket;
+}
+
+unsigned long long LatencyHistogram::GetBucketUpperBound(size_t bucket)
+{
+	size_t group = bucket / SUB_BUCKETS;
+	size_t subBucket = bucket % SUB_BUCKETS;
+
+	if (group == 0)
+		return subBucket;
+
+	int shift = (int)group - 1;
+	unsigned long long lower = (unsigned long long)(SUB_BUCKETS + subBucket) << shift;
+
+	return lower + (1ull << shift) - 1;
+}
+
+void LatencyHistogram::Record(unsigned long long nanoseconds)
+{
+	buckets[GetBucket(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+	count.fetch_add(1, std::memory_order_relaxed);
+	sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+
+	unsigned long long currentMax = max.load(std::memory_order_relaxed);
+	while (nanoseconds > currentMax && !max.compare_exchange_weak(currentMax, nanoseconds, std::memory_order_relaxed)) {}
+}
+
+unsigned long long LatencyHistogram::GetPercentile(double percentile) const
+{
+	// Counted from the buckets themselves, the total may be a sample ahead or behind
+	unsigned long long total = 0;
+	for (const auto& bucket : buckets)
+		total += bucket.load(std::memory_order_relaxed);
+
+	if (total == 0)
+		return 0;
+
+	percentile = std::min(100.0, std::max(0.0, percentile));
+	unsigned long long target = std::max<unsigned long long>(1, (unsigned long long)std::ceil(total * percentile / 100.0));
+	unsigned long long seen = 0;
+
+	for (size_t i = 0; i < BUCKET_COUNT; i++)
+	{
+		seen += buckets[i].load(std::memory_order_relaxed);
+
+		// The real maximum is more precise than the edge of its bucket
+		if (seen >= target)
+			return std::min(GetBucketUpperBound(i), GetMax());
+	}
+
+	return GetMax();
+}
+
+double LatencyHistogram::GetMean() const
+{
+	unsigned long long samples = GetCount();
+
+	return samples == 0 ? 0 : (double)sum.load(std::memory_order_relaxed) / samples;
+}
@@ -0,0 +1,75 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+/// <summary>
+/// Log bucketed histogram of latencies in nanoseconds, in the spirit of HdrHistogram
+/// </summary>
+/// <remarks>
+/// Every power of two is split in SUB_BUCKETS linear buckets, so any recorded value is known to within about 3%
+/// from 32ns up to about 18 minutes, anything longer lands in the last bucket. Recording is a couple of relaxed
+/// atomic increments, it can be done from any thread while others read. Readers may see a sample counted in a
+/// bucket but not yet in the total (or the other way around), which doesn't matter for percentiles.
+/// </remarks>
+class LatencyHistogram
+{
+public:
+	// Linear buckets per power of two
+	static const int SUB_BUCKET_BITS = 5;
+	static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+
+	// Values below 2^MAX_EXPONENT ns get their own bucket
+	static const int MAX_EXPONENT = 40;
+
+	static const size_t BUCKET_COUNT = (size_t)(MAX_EXPONENT - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+	LatencyHistogram();
+
+	LatencyHistogram(const LatencyHistogram&) = delete;
+	LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+	/// <summary>
+	/// Records one latency
+	/// </summary>
+	/// <param name="nanoseconds">Latency</param>
+	void Record(unsigned long long nanoseconds);
+
+	/// <summary>
+	/// Forgets every sample
+	/// </summary>
+	void Clear();
+
+	/// <summary>
+	/// Gets the latency below which the given fraction of the samples falls
+	/// </summary>
+	/// <param name="percentile">0 - 100, e.g. 99.9</param>
+	/// <returns>Latency in nanoseconds (the upper edge of its bucket), 0 if nothing was recorded</returns>
+	unsigned long long GetPercentile(double percentile) const;
+
+	/// <summary>
+	/// Number of samples, their average and the largest one
+	/// </summary>
+	unsigned long long GetCount() const { return count.load(std::memory_order_relaxed); }
+	double GetMean() const;
+	unsigned long long GetMax() const { return max.load(std::memory_order_relaxed); }
+
+	/// <summary>
+	/// Gets the samples in a bucket and the largest value that falls in it
+	/// </summary>
+	unsigned long long GetBucketCount(size_t bucket) const { return buckets[bucket].load(std::memory_order_relaxed); }
+	static unsigned long long GetBucketUpperBound(size_t bucket);
+
+private:
+	std::atomic<unsigned long long> buckets[BUCKET_COUNT];
+	std::atomic<unsigned long long> count;
+	std::atomic<unsigned long long> sum;
+	std::atomic<unsigned long long> max;
+
+	static size_t GetBucket(unsigned long long nanoseconds);
+};
@@ -0,0 +1,612 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#include "PatternGenerator.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <functional>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define PATTERN_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC lets us use any intrinsic anywhere, GCC/Clang need to be told per function
+#if defined(PATTERN_X86) && !defined(_MSC_VER)
+#define PATTERN_TARGET(x) __attribute__((target(x)))
+#else
+#define PATTERN_TARGET(x)
+#endif
+
+// Words per 64 byte cache line, the SIMD kernels always fill whole lines
+const size_t WORDS_PER_LINE = 16;
+
+// Bytes regenerated at a time by Compare, expected and read data for a tile both fit in L2 with room to spare
+const size_t COMPARE_TILE_SIZE = 64 * 1024;
+
+typedef void (*FillKernel)(uint32_t* words, size_t count, uint32_t counter, uint32_t high);
+
+// Returns the index of the first byte where a and b differ, or size if they are equal
+typedef size_t (*MismatchKernel)(const unsigned char* a, const unsigned char* b, size_t size);
+
+/// <summary>
+/// Reference kernel, words[i] = Mix((counter + i * COUNTER_MULTIPLIER) ^ high)
+/// </summary>
+static void FillScalar(uint32_t* words, size_t count, uint32_t counter, uint32_t high)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		words[i] = PatternGenerator::Mix(counter ^ high);
+		counter += PatternGenerator::COUNTER_MULTIPLIER;
+	}
+}
+
+static size_t FindMismatchScalar(const unsigned char* a, const unsigned char* b, size_t size)
+{
+	size_t i = 0;
+
+	// Eight bytes at a time, then pin down the byte
+	for (; i + 8 <= size; i += 8)
+	{
+		uint64_t x, y;
+		memcpy(&x, a + i, 8);
+		memcpy(&y, b + i, 8);
+
+		if (x != y)
+			break;
+	}
+
+	for (; i < size; i++)
+		if (a[i] != b[i])
+			return i;
+
+	return size;
+}
+
+#ifdef PATTERN_X86
+
+#ifdef _MSC_VER
+static inline unsigned int FirstSetBit(unsigned long long mask)
+{
+	unsigned long index;
+	_BitScanForward64(&index, mask);
+	return index;
+}
+#else
+static inline unsigned int FirstSetBit(unsigned long long mask)
+{
+	return (unsigned int)__builtin_ctzll(mask);
+}
+#endif
+
+// SSE2 has no 32 bit mullo, build it from two 32x32->64 multiplies
+PATTERN_TARGET("sse2")
+static inline __m128i MulLo32SSE2(__m128i a, __m128i b)
+{
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+PATTERN_TARGET("sse2")
+static inline __m128i MixSSE2(__m128i x)
+{
+	const __m128i m1 = _mm_set1_epi32((int)0x7feb352dU);
+	const __m128i m2 = _mm_set1_epi32((int)0x846ca68bU);
+
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+	x = MulLo32SSE2(x, m1);
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+	x = MulLo32SSE2(x, m2);
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+	return x;
+}
+
+PATTERN_TARGET("sse2")
+static void FillSSE2(uint32_t* words, size_t count, uint32_t counter, uint32_t high)
+{
+	const uint32_t c = PatternGenerator::COUNTER_MULTIPLIER;
+	const __m128i h = _mm_set1_epi32((int)high);
+	const __m128i step = _mm_set1_epi32((int)(c * 4));
+
+	__m128i x0 = _mm_setr_epi32((int)counter, (int)(counter + c), (int)(counter + c * 2), (int)(counter + c * 3));
+	__m128i x1 = _mm_add_epi32(x0, step);
+	__m128i x2 = _mm_add_epi32(x1, step);
+	__m128i x3 = _mm_add_epi32(x2, step);
+	const __m128i lineStep = _mm_set1_epi32((int)(c * WORDS_PER_LINE));
+
+	size_t lines = count / WORDS_PER_LINE;
+
+	for (size_t i = 0; i < lines; i++)
+	{
+		__m128i* p = reinterpret_cast<__m128i*>(words + i * WORDS_PER_LINE);
+
+		_mm_storeu_si128(p + 0, MixSSE2(_mm_xor_si128(x0, h)));
+		_mm_storeu_si128(p + 1, MixSSE2(_mm_xor_si128(x1, h)));
+		_mm_storeu_si128(p + 2, MixSSE2(_mm_xor_si128(x2, h)));
+		_mm_storeu_si128(p + 3, MixSSE2(_mm_xor_si128(x3, h)));
+
+		x0 = _mm_add_epi32(x0, lineStep);
+		x1 = _mm_add_epi32(x1, lineStep);
+		x2 = _mm_add_epi32(x2, lineStep);
+		x3 = _mm_add_epi32(x3, lineStep);
+	}
+
+	size_t done = lines * WORDS_PER_LINE;
+	FillScalar(words + done, count - done, counter + (uint32_t)done * c, high);
+}
+
+PATTERN_TARGET("sse2")
+static size_t FindMismatchSSE2(const unsigned char* a, const unsigned char* b, size_t size)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= size; i += 16)
+	{
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+		__m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+		unsigned int equal = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+
+		if (equal != 0xFFFF)
+			return i + FirstSetBit(~equal & 0xFFFF);
+	}
+
+	return i + FindMismatchScalar(a + i, b + i, size - i);
+}
+
+PATTERN_TARGET("avx2")
+static inline __m256i MixAVX2(__m256i x)
+{
+	const __m256i m1 = _mm256_set1_epi32((int)0x7feb352dU);
+	const __m256i m2 = _mm256_set1_epi32((int)0x846ca68bU);
+
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+	x = _mm256_mullo_epi32(x, m1);
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+	x = _mm256_mullo_epi32(x, m2);
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+	return x;
+}
+
+PATTERN_TARGET("avx2")
+static void FillAVX2(uint32_t* words, size_t count, uint32_t counter, uint32_t high)
+{
+	const uint32_t c = PatternGenerator::COUNTER_MULTIPLIER;
+	const __m256i h = _mm256_set1_epi32((int)high);
+
+	__m256i x0 = _mm256_setr_epi32((int)counter, (int)(counter + c), (int)(counter + c * 2), (int)(counter + c * 3),
+		(int)(counter + c * 4), (int)(counter + c * 5), (int)(counter + c * 6), (int)(counter + c * 7));
+	__m256i x1 = _mm256_add_epi32(x0, _mm256_set1_epi32((int)(c * 8)));
+	const __m256i lineStep = _mm256_set1_epi32((int)(c * WORDS_PER_LINE));
+
+	size_t lines = count / WORDS_PER_LINE;
+
+	for (size_t i = 0; i < lines; i++)
+	{
+		__m256i* p = reinterpret_cast<__m256i*>(words + i * WORDS_PER_LINE);
+
+		_mm256_storeu_si256(p + 0, MixAVX2(_mm256_xor_si256(x0, h)));
+		_mm256_storeu_si256(p + 1, MixAVX2(_mm256_xor_si256(x1, h)));
+
+		x0 = _mm256_add_epi32(x0, lineStep);
+		x1 = _mm256_add_epi32(x1, lineStep);
+	}
+
+	size_t done = lines * WORDS_PER_LINE;
+	FillScalar(words + done, count - done, counter + (uint32_t)done * c, high);
+}
+
+PATTERN_TARGET("avx2")
+static size_t FindMismatchAVX2(const unsigned char* a, const unsigned char* b, size_t size)
+{
+	size_t i = 0;
+
+	// Two vectors per iteration, the common case is that everything matches
+	for (; i + 64 <= size; i += 64)
+	{
+		__m256i x0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+		__m256i y0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+		__m256i x1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i + 32));
+		__m256i y1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i + 32));
+
+		__m256i equal0 = _mm256_cmpeq_epi8(x0, y0);
+		__m256i equal1 = _mm256_cmpeq_epi8(x1, y1);
+
+		if (_mm256_movemask_epi8(_mm256_and_si256(equal0, equal1)) != -1)
+		{
+			unsigned long long equal = (unsigned int)_mm256_movemask_epi8(equal0) | ((unsigned long long)(unsigned int)_mm256_movemask_epi8(equal1) << 32);
+			return i + FirstSetBit(~equal);
+		}
+	}
+
+	return i + FindMismatchSSE2(a + i, b + i, size - i);
+}
+
+PATTERN_TARGET("avx512f")
+static inline __m512i MixAVX512(__m512i x)
+{
+	const __m512i m1 = _mm512_set1_epi32((int)0x7feb352dU);
+	const __m512i m2 = _mm512_set1_epi32((int)0x846ca68bU);
+
+	x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 16));
+	x = _mm512_mullo_epi32(x, m1);
+	x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 15));
+	x = _mm512_mullo_epi32(x, m2);
+	x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 16));
+	return x;
+}
+
+PATTERN_TARGET("avx512f")
+static void FillAVX512(uint32_t* words, size_t count, uint32_t counter, uint32_t high)
+{
+	const uint32_t c = PatternGenerator::COUNTER_MULTIPLIER;
+	const __m512i h = _mm512_set1_epi32((int)high);
+
+	// One cache line per vector, two lines per iteration to hide the multiply latency
+	__m512i x0 = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32((int)c));
+	x0 = _mm512_add_epi32(x0, _mm512_set1_epi32((int)counter));
+	__m512i x1 = _mm512_add_epi32(x0, _mm512_set1_epi32((int)(c * WORDS_PER_LINE)));
+	const __m512i pairStep = _mm512_set1_epi32((int)(c * WORDS_PER_LINE * 2));
+
+	size_t pairs = count / (WORDS_PER_LINE * 2);
+
+	for (size_t i = 0; i < pairs; i++)
+	{
+		uint32_t* p = words + i * WORDS_PER_LINE * 2;
+
+		_mm512_storeu_si512(p, MixAVX512(_mm512_xor_si512(x0, h)));
+		_mm512_storeu_si512(p + WORDS_PER_LINE, MixAVX512(_mm512_xor_si512(x1, h)));
+
+		x0 = _mm512_add_epi32(x0, pairStep);
+		x1 = _mm512_add_epi32(x1, pairStep);
+	}
+
+	size_t done = pairs * WORDS_PER_LINE * 2;
+	FillScalar(words + done, count - done, counter + (uint32_t)done * c, high);
+}
+
+// AVX512F has no byte compares (that's AVX512BW), compare dwords and find the byte inside the word
+PATTERN_TARGET("avx512f")
+static size_t FindMismatchAVX512(const unsigned char* a, const unsigned char* b, size_t size)
+{
+	size_t i = 0;
+
+	for (; i + 64 <= size; i += 64)
+	{
+		__m512i x = _mm512_loadu_si512(a + i);
+		__m512i y = _mm512_loadu_si512(b + i);
+		__mmask16 different = _mm512_cmpneq_epi32_mask(x, y);
+
+		if (different != 0)
+		{
+			size_t word = i + FirstSetBit(different) * 4;
+			return word + FindMismatchScalar(a + word, b + word, 4);
+		}
+	}
+
+	return i + FindMismatchSSE2(a + i, b + i, size - i);
+}
+
+/// <summary>
+/// Checks what the CPU (and OS) supports
+/// </summary>
+static bool CpuSupports(PatternKernel kernel)
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+	bool sse2 = (info[3] & (1 << 26)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+
+	unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+	bool avxState = (xcr0 & 0x6) == 0x6;
+	bool avx512State = (xcr0 & 0xE6) == 0xE6;
+
+	bool avx2 = false, avx512f = false;
+	if (maxLeaf >= 7)
+	{
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) != 0;
+		avx512f = (info[1] & (1 << 16)) != 0;
+	}
+
+	switch (kernel)
+	{
+	case PatternKernel::SSE2: return sse2;
+	case PatternKernel::AVX2: return avx2 && avxState;
+	case PatternKernel::AVX512: return avx512f && avx512State;
+	default: return true;
+	}
+#else
+	__builtin_cpu_init();
+
+	switch (kernel)
+	{
+	case PatternKernel::SSE2: return __builtin_cpu_supports("sse2");
+	case PatternKernel::AVX2: return __builtin_cpu_supports("avx2");
+	case PatternKernel::AVX512: return __builtin_cpu_supports("avx512f");
+	default: return true;
+	}
+#endif
+}
+
+#else
+
+static bool CpuSupports(PatternKernel kernel)
+{
+	return kernel == PatternKernel::Scalar || kernel == PatternKernel::Auto;
+}
+
+#endif
+
+static FillKernel GetKernelFunction(PatternKernel kernel)
+{
+	switch (kernel)
+	{
+#ifdef PATTERN_X86
+	case PatternKernel::SSE2: return FillSSE2;
+	case PatternKernel::AVX2: return FillAVX2;
+	case PatternKernel::AVX512: return FillAVX512;
+#endif
+	default: return FillScalar;
+	}
+}
+
+static MismatchKernel GetMismatchFunction(PatternKernel kernel)
+{
+	switch (kernel)
+	{
+#ifdef PATTERN_X86
+	case PatternKernel::SSE2: return FindMismatchSSE2;
+	case PatternKernel::AVX2: return FindMismatchAVX2;
+	case PatternKernel::AVX512: return FindMismatchAVX512;
+#endif
+	default: return FindMismatchScalar;
+	}
+}
+
+static PatternKernel DetectBestKernel()
+{
+	const PatternKernel candidates[] = { PatternKernel::AVX512, PatternKernel::AVX2, PatternKernel::SSE2 };
+
+	for (PatternKernel kernel : candidates)
+		if (CpuSupports(kernel))
+			return kernel;
+
+	return PatternKernel::Scalar;
+}
+
+// Kernel in use, picked once on first use
+static std::atomic<PatternKernel> currentKernel{ PatternKernel::Auto };
+
+static PatternKernel GetCurrentKernel()
+{
+	PatternKernel kernel = currentKernel.load(std::memory_order_relaxed);
+
+	if (kernel == PatternKernel::Auto)
+	{
+		kernel = DetectBestKernel();
+		currentKernel.store(kernel, std::memory_order_relaxed);
+	}
+
+	return kernel;
+}
+
+bool PatternGenerator::SetKernel(PatternKernel kernel)
+{
+	if (kernel == PatternKernel::Auto)
+		kernel = DetectBestKernel();
+
+	if (!CpuSupports(kernel))
+		return false;
+
+	currentKernel.store(kernel);
+	return true;
+}
+
+const char* PatternGenerator::GetKernelName()
+{
+	switch (GetCurrentKernel())
+	{
+	case PatternKernel::SSE2: return "sse2";
+	case PatternKernel::AVX2: return "avx2";
+	case PatternKernel::AVX512: return "avx512";
+	default: return "scalar";
+	}
+}
+
+PatternGenerator::PatternGenerator(unsigned long long seed) : sectorTags(false), runId(0), tagBase(0)
+{
+	k0 = (uint32_t)(seed & 0xFFFFFFFF);
+	k1 = (uint32_t)(seed >> 32);
+}
+
+void PatternGenerator::SetSectorTags(uint32_t runId, unsigned long long baseAddress)
+{
+	sectorTags = true;
+	this->runId = runId;
+	tagBase = baseAddress;
+}
+
+void PatternGenerator::MakeSectorTag(unsigned char* tag, uint32_t runId, unsigned long long address)
+{
+	// Keeps zeroed or random sectors from passing as tags
+	uint32_t check = Mix((uint32_t)address ^ Mix((uint32_t)(address >> 32) ^ runId));
+
+	for (int i = 0; i < 8; i++)
+		tag[i] = (unsigned char)(address >> (i * 8));
+
+	for (int i = 0; i < 4; i++)
+	{
+		tag[8 + i] = (unsigned char)(runId >> (i * 8));
+		tag[12 + i] = (unsigned char)(check >> (i * 8));
+	}
+}
+
+bool PatternGenerator::ReadSectorTag(const unsigned char* sector, uint32_t runId, unsigned long long* address)
+{
+	unsigned long long value = 0;
+
+	for (int i = 0; i < 8; i++)
+		value |= (unsigned long long)sector[i] << (i * 8);
+
+	unsigned char expected[SECTOR_TAG_SIZE];
+	MakeSectorTag(expected, runId, value);
+
+	if (memcmp(sector, expected, SECTOR_TAG_SIZE) != 0)
+		return false;
+
+	*address = value;
+	return true;
+}
+
+void PatternGenerator::ApplySectorTags(unsigned char* data, size_t size, unsigned long long offset) const
+{
+	unsigned long long end = offset + size;
+
+	// Starting from the sector we are in, its tag can still reach into the data
+	for (unsigned long long sector = offset - (offset % SECTOR_SIZE); sector < end; sector += SECTOR_SIZE)
+	{
+		unsigned long long from = std::max(sector, offset);
+		unsigned long long to = std::min<unsigned long long>(sector + SECTOR_TAG_SIZE, end);
+
+		if (from >= to)
+			continue;
+
+		unsigned char tag[SECTOR_TAG_SIZE];
+		MakeSectorTag(tag, runId, tagBase + sector);
+
+		memcpy(data + (from - offset), tag + (from - sector), (size_t)(to - from));
+	}
+}
+
+unsigned long long PatternGenerator::SeedFromString(const std::string& str)
+{
+	// FNV-1a, unlike std::hash it's the same on every compiler and platform
+	unsigned long long hash = 14695981039346656037ull;
+
+	for (unsigned char c : str)
+	{
+		hash ^= c;
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
+}
+
+uint32_t PatternGenerator::GetWord(unsigned long long index) const
+{
+	uint32_t high = Mix((uint32_t)(index >> 32) + k1);
+	return Mix(((uint32_t)index * COUNTER_MULTIPLIER + k0) ^ high);
+}
+
+void PatternGenerator::FillWords(uint32_t* words, size_t count, unsigned long long index) const
+{
+	FillKernel fill = GetKernelFunction(GetCurrentKernel());
+
+	while (count > 0)
+	{
+		// The high half of the counter only changes every 2^32 words, hash it once per run
+		size_t run = (size_t)std::min<unsigned long long>(count, 0x100000000ULL - (index & 0xFFFFFFFF));
+		uint32_t high = Mix((uint32_t)(index >> 32) + k1);
+		uint32_t counter = (uint32_t)index * COUNTER_MULTIPLIER + k0;
+
+		fill(words, run, counter, high);
+
+		words += run;
+		count -= run;
+		index += run;
+	}
+}
+
+size_t PatternGenerator::Compare(const unsigned char* data, size_t size, unsigned long long offset) const
+{
+	// One tile per thread, verification runs on the worker pool
+	alignas(64) thread_local static unsigned char tile[COMPARE_TILE_SIZE];
+
+	MismatchKernel findMismatch = GetMismatchFunction(GetCurrentKernel());
+
+	for (size_t done = 0; done < size;)
+	{
+		size_t n = std::min<size_t>(size - done, COMPARE_TILE_SIZE);
+		Fill(tile, n, offset + done);
+
+		size_t mismatch = findMismatch(data + done, tile, n);
+		if (mismatch != n)
+			return done + mismatch;
+
+		done += n;
+	}
+
+	return size;
+}
+
+void PatternGenerator::Fill(unsigned char* data, size_t size, unsigned long long offset) const
+{
+	FillBytes(data, size, offset);
+
+	if (sectorTags)
+		ApplySectorTags(data, size, offset);
+}
+
+void PatternGenerator::FillBytes(unsigned char* data, size_t size, unsigned long long offset) const
+{
+	// Unaligned start, copy the tail of the first word
+	size_t head = (size_t)(offset & 3);
+	if (head != 0 && size > 0)
+	{
+		uint32_t word = GetWord(offset >> 2);
+		size_t bytes = std::min<size_t>(4 - head, size);
+
+		for (size_t i = 0; i < bytes; i++)
+			data[i] = (unsigned char)(word >> ((head + i) * 8));
+
+		data += bytes;
+		size -= bytes;
+		offset += bytes;
+	}
+
+	size_t count = size / 4;
+
+	if (count > 0)
+	{
+		// Buffers are normally aligned, go through a small bounce buffer when they aren't
+		if (((uintptr_t)data & 3) == 0)
+			FillWords(reinterpret_cast<uint32_t*>(data), count, offset >> 2);
+		else
+		{
+			uint32_t words[256];
+
+			for (size_t done = 0; done < count;)
+			{
+				size_t n = std::min<size_t>(count - done, 256);
+				FillWords(words, n, (offset >> 2) + done);
+				memcpy(data + done * 4, words, n * 4);
+				done += n;
+			}
+		}
+
+		data += count * 4;
+		size -= count * 4;
+		offset += count * 4;
+	}
+
+	// Leftover bytes at the end
+	if (size > 0)
+	{
+		uint32_t word = GetWord(offset >> 2);
+
+		for (size_t i = 0; i < size; i++)
+			data[i] = (unsigned char)(word >> (i * 8));
+	}
+}
@@ -0,0 +1,165 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/// <summary>
+/// Generation kernels, all of them produce exactly the same bytes
+/// </summary>
+enum class PatternKernel
+{
+	Auto = 0,
+	Scalar,
+	SSE2,
+	AVX2,
+	AVX512
+};
+
+/// <summary>
+/// Counter based test pattern, the bytes at any (seed, offset) can be computed directly
+/// </summary>
+/// <remarks>
+/// The pattern is a stream of little endian 32 bit words, word n being a keyed integer hash of n:
+///
+///     x = (lo32(n) * 0x9E3779B1 + k0) ^ Mix(hi32(n) + k1)
+///     word(n) = Mix(x)
+///
+/// where k0/k1 are the low/high halves of the seed and Mix is the lowbias32 finalizer. Every step is a
+/// bijection, so no word repeats within 16GB of a stream, which is what makes aliased data stand out.
+/// Verifying a single block only costs generating that block, no matter where it is.
+///
+/// With sector tags enabled the first SECTOR_TAG_SIZE bytes of every SECTOR_SIZE sector are replaced by a tag:
+///
+///     address (8 bytes) | run ID (4 bytes) | check (4 bytes), little endian
+///
+/// address being the sector position plus the tag base, so a sector read back from the wrong place says where it came from.
+/// </remarks>
+class PatternGenerator
+{
+public:
+	PatternGenerator(unsigned long long seed);
+
+	// Tagged sector layout, 512 bytes is the smallest sector any device uses
+	static const size_t SECTOR_SIZE = 512;
+	static const size_t SECTOR_TAG_SIZE = 16;
+
+	/// <summary>
+	/// Starts every sector with an address tag
+	/// </summary>
+	/// <param name="runId">Test run the data belongs to</param>
+	/// <param name="baseAddress">Address of offset 0, the position of a file within everything written by the test</param>
+	void SetSectorTags(uint32_t runId, unsigned long long baseAddress);
+
+	/// <summary>
+	/// True if sectors are tagged
+	/// </summary>
+	bool HasSectorTags() const { return sectorTags; }
+
+	/// <summary>
+	/// Address tagged on the sector at the given offset
+	/// </summary>
+	unsigned long long GetSectorAddress(unsigned long long offset) const { return tagBase + offset; }
+
+	/// <summary>
+	/// Decodes the tag at the start of a sector
+	/// </summary>
+	/// <param name="sector">Sector data, at least SECTOR_TAG_SIZE bytes</param>
+	/// <param name="runId">Run the tag has to belong to</param>
+	/// <param name="address">Address in the tag</param>
+	/// <returns>False if there's no valid tag of this run</returns>
+	static bool ReadSectorTag(const unsigned char* sector, uint32_t runId, unsigned long long* address);
+
+	/// <summary>
+	/// Fills data with the pattern bytes [offset, offset + size)
+	/// </summary>
+	/// <param name="data">Data</param>
+	/// <param name="size">Size in bytes</param>
+	/// <param name="offset">Position in the stream, in bytes</param>
+	void Fill(unsigned char* data, size_t size, unsigned long long offset) const;
+
+	/// <summary>
+	/// Compares data against the pattern bytes [offset, offset + size) without generating all of them at once
+	/// </summary>
+	/// <remarks>
+	/// The pattern is regenerated in tiles small enough to stay in L2 and each tile is compared as soon as it's
+	/// generated, so the expected data never goes out to memory
+	/// </remarks>
+	/// <param name="data">Data to check</param>
+	/// <param name="size">Size in bytes</param>
+	/// <param name="offset">Position of data in the stream, in bytes</param>
+	/// <returns>Index of the first byte that differs, or size if everything matches</returns>
+	size_t Compare(const unsigned char* data, size_t size, unsigned long long offset) const;
+
+	/// <summary>
+	/// Gets a single pattern word
+	/// </summary>
+	/// <param name="index">Word index (byte offset / 4)</param>
+	uint32_t GetWord(unsigned long long index) const;
+
+	/// <summary>
+	/// Derives a seed from a string, the 64 bit FNV-1a hash of its bytes
+	/// </summary>
+	/// <remarks>Stable across builds and hosts, data written by one can be verified by any other</remarks>
+	static unsigned long long SeedFromString(const std::string& str);
+
+	/// <summary>
+	/// Selects the generation kernel, Auto picks the fastest one the CPU supports (the default)
+	/// </summary>
+	/// <returns>False if the CPU doesn't support it</returns>
+	static bool SetKernel(PatternKernel kernel);
+
+	/// <summary>
+	/// Name of the kernel in use, for logs
+	/// </summary>
+	static const char* GetKernelName();
+
+	/// <summary>
+	/// lowbias32 integer hash
+	/// </summary>
+	static inline uint32_t Mix(uint32_t x)
+	{
+		x ^= x >> 16;
+		x *= 0x7feb352dU;
+		x ^= x >> 15;
+		x *= 0x846ca68bU;
+		x ^= x >> 16;
+		return x;
+	}
+
+	// Multiplier applied to the word counter, odd so it stays a bijection
+	static const uint32_t COUNTER_MULTIPLIER = 0x9E3779B1U;
+
+private:
+	uint32_t k0;
+	uint32_t k1;
+
+	bool sectorTags;
+	uint32_t runId;
+	unsigned long long tagBase;
+
+	/// <summary>
+	/// Fills the untagged pattern bytes [offset, offset + size)
+	/// </summary>
+	void FillBytes(unsigned char* data, size_t size, unsigned long long offset) const;
+
+	/// <summary>
+	/// Overwrites whatever part of the sector tags falls inside [offset, offset + size)
+	/// </summary>
+	void ApplySectorTags(unsigned char* data, size_t size, unsigned long long offset) const;
+
+	/// <summary>
+	/// Builds the tag for an address
+	/// </summary>
+	static void MakeSectorTag(unsigned char* tag, uint32_t runId, unsigned long long address);
+
+	/// <summary>
+	/// Fills whole words, index is the first word index
+	/// </summary>
+	void FillWords(uint32_t* words, size_t count, unsigned long long index) const;
+};
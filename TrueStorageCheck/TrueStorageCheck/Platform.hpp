@@ -0,0 +1,29 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#pragma once
+
+// Small portability layer so the engine builds both as the Windows DLL and on Linux
+
+#ifdef _WIN32
+
+#include <windows.h>
+
+#define PATH_SEPARATOR "\\"
+
+#else
+
+#include <unistd.h>
+
+// Windows gives us these for free
+typedef unsigned char byte;
+
+#ifndef __stdcall
+#define __stdcall
+#endif
+
+#define PATH_SEPARATOR "/"
+
+#endif
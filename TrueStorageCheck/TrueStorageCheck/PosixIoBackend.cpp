@@ -0,0 +1,504 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#include "PosixIoBackend.hpp"
+
+#ifndef _WIN32
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include <filesystem>
+#include <vector>
+
+#ifdef __linux__
+#include <mntent.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/sysmacros.h>
+#include <sys/vfs.h>
+#endif
+
+#include "UringIoQueue.hpp"
+
+PosixIoFile::PosixIoFile(int fd, bool direct) : fd(fd), direct(direct) {}
+
+PosixIoFile::~PosixIoFile()
+{
+	if (fd >= 0)
+		::close(fd);
+}
+
+bool PosixIoFile::Read(unsigned long long offset, void* pData, size_t size)
+{
+	unsigned char* p = static_cast<unsigned char*>(pData);
+
+	// pread is allowed to return less than we asked for, keep going until we have it all
+	while (size > 0)
+	{
+		ssize_t ret = ::pread(fd, p, size, (off_t)offset);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		// Error or unexpected end of file
+		if (ret <= 0)
+			return false;
+
+		p += ret;
+		offset += ret;
+		size -= ret;
+	}
+
+	return true;
+}
+
+bool PosixIoFile::Write(unsigned long long offset, const void* pData, size_t size)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(pData);
+
+	while (size > 0)
+	{
+		ssize_t ret = ::pwrite(fd, p, size, (off_t)offset);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		// ENOSPC shows up as a short write followed by an error
+		if (ret <= 0)
+			return false;
+
+		p += ret;
+		offset += ret;
+		size -= ret;
+	}
+
+	return true;
+}
+
+bool PosixIoFile::Flush()
+{
+	if (::fdatasync(fd) != 0)
+		return false;
+
+	// Without O_DIRECT the data is still sitting in the page cache, drop it so
+	// reading back actually hits the device
+	if (!direct)
+		::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+	return true;
+}
+
+unsigned long long PosixIoFile::GetSize()
+{
+	struct stat st;
+
+	if (::fstat(fd, &st) != 0)
+		return 0;
+
+#ifdef BLKGETSIZE64
+	// Block devices report a size of 0, ask the driver
+	if (S_ISBLK(st.st_mode))
+	{
+		unsigned long long size = 0;
+		return ::ioctl(fd, BLKGETSIZE64, &size) == 0 ? size : 0;
+	}
+#endif
+
+	return st.st_size;
+}
+
+bool PosixIoFile::Reserve(unsigned long long size)
+{
+#ifdef __linux__
+	// KEEP_SIZE is also the only mode vfat takes. Not posix_fallocate, where it isn't supported it writes zeros over the whole file
+	return ::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)size) == 0;
+#else
+	return false;
+#endif
+}
+
+std::unique_ptr<IoFile> PosixIoBackend::Open(const std::string& path, IoOpenMode mode)
+{
+	int flags = 0;
+
+	// O_DIRECT is the equivalent of FILE_FLAG_NO_BUFFERING and O_SYNC of FILE_FLAG_WRITE_THROUGH
+	switch (mode)
+	{
+	case IoOpenMode::CreateAlways:
+		flags = O_RDWR | O_CREAT | O_TRUNC | O_SYNC;
+		break;
+	case IoOpenMode::OpenExisting:
+		flags = O_RDWR | O_SYNC;
+		break;
+	case IoOpenMode::ReadOnly:
+		flags = O_RDONLY;
+		break;
+	}
+
+	bool direct = true;
+	int fd = ::open(path.c_str(), flags | O_DIRECT | O_CLOEXEC, 0644);
+
+	// Some filesystems (older tmpfs for example) refuse O_DIRECT, we can still work through the page cache
+	if (fd < 0 && errno == EINVAL)
+	{
+		direct = false;
+		fd = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+	}
+
+	if (fd < 0)
+		return nullptr;
+
+	return std::make_unique<PosixIoFile>(fd, direct);
+}
+
+bool PosixIoBackend::MakeDirectory(const std::string& path)
+{
+	return ::mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+void PosixIoBackend::RemoveTree(const std::string& path)
+{
+	std::error_code ec;
+
+	if (std::filesystem::exists(path, ec) && std::filesystem::is_directory(path, ec)) {
+
+		std::filesystem::remove_all(path, ec);
+
+		if (ec)
+			return;
+
+		// Removal succeeded, now flush the parent directory so the removal reaches the device
+		std::filesystem::path parent = std::filesystem::path(path).parent_path();
+
+		int fd = ::open(parent.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd >= 0) {
+			::fsync(fd);
+			::close(fd);
+		}
+	}
+}
+
+bool PosixIoBackend::RemoveFile(const std::string& path)
+{
+	return ::unlink(path.c_str()) == 0 || errno == ENOENT;
+}
+
+bool PosixIoBackend::GetDiskSpace(const std::string& path, unsigned long long* totalSpace, unsigned long long* freeSpace)
+{
+	struct statvfs st;
+
+	if (::statvfs(path.c_str(), &st) != 0)
+		return false;
+
+	*totalSpace = (unsigned long long)st.f_blocks * st.f_frsize;
+	*freeSpace = (unsigned long long)st.f_bavail * st.f_frsize;
+
+	return true;
+}
+
+unsigned long PosixIoBackend::GetDataBlockSize(const std::string& path)
+{
+	struct statvfs st;
+
+	if (::statvfs(path.c_str(), &st) != 0)
+		return 0;
+
+	// Cluster size on FAT/exFAT, filesystem block size everywhere else
+	return st.f_bsize;
+}
+
+unsigned long long PosixIoBackend::GetMaxFileSize(const std::string& path)
+{
+#ifdef __linux__
+	const long MSDOS_MAGIC = 0x4d44;
+
+	struct statfs st;
+
+	// FAT12/16/32 keep the file size in 32 bits, exFAT doesn't
+	if (::statfs(path.c_str(), &st) == 0 && st.f_type == MSDOS_MAGIC)
+		return 0xFFFFFFFFull;
+#endif
+
+	return 0;
+}
+
+#ifdef __linux__
+
+/// <summary>
+/// Finds the whole disk a block device belongs to, /dev/sdb for /dev/sdb1
+/// </summary>
+/// <returns>Disk path, the device itself if it's not a partition, an empty string if it's not a block device</returns>
+static std::string GetWholeDisk(const std::string& devicePath)
+{
+	struct stat st;
+
+	if (::stat(devicePath.c_str(), &st) != 0 || !S_ISBLK(st.st_mode))
+		return "";
+
+	// /sys/dev/block/8:17 links to .../block/sdb/sdb1, partitions have a "partition" file and sit in their disk's directory
+	std::error_code error;
+	std::filesystem::path sysPath = std::filesystem::canonical("/sys/dev/block/" + std::to_string(major(st.st_rdev)) + ":" + std::to_string(minor(st.st_rdev)), error);
+
+	if (error)
+		return "";
+
+	if (!std::filesystem::exists(sysPath / "partition", error))
+		return devicePath;
+
+	return "/dev/" + sysPath.parent_path().filename().string();
+}
+
+/// <summary>
+/// True for the mount points the running system can't do without
+/// </summary>
+static bool IsSystemMount(const std::string& mountPoint)
+{
+	static const char* const systemMounts[] = { "/", "/boot", "/efi", "/usr", "/var", "/etc", "/opt", "/home", "/srv", "/root" };
+
+	for (const char* systemMount : systemMounts)
+	{
+		std::string prefix = systemMount;
+
+		if (mountPoint == prefix || (prefix != "/" && mountPoint.compare(0, prefix.size() + 1, prefix + "/") == 0))
+			return true;
+	}
+
+	return false;
+}
+
+/// <summary>
+/// Checks if any partition of the disk is an active swap area
+/// </summary>
+static bool HasActiveSwap(const std::string& devicePath)
+{
+	FILE* swaps = ::fopen("/proc/swaps", "r");
+	if (swaps == nullptr)
+		return false;
+
+	bool found = false;
+	char line[512];
+
+	// The first line is the header, the first column is the swap device or file
+	while (!found && ::fgets(line, sizeof(line), swaps) != nullptr)
+	{
+		std::string name(line, strcspn(line, " \t\n"));
+		found = !name.empty() && name[0] == '/' && GetWholeDisk(name) == devicePath;
+	}
+
+	::fclose(swaps);
+
+	return found;
+}
+
+/// <summary>
+/// Unmounts everything mounted from the given disk or any of its partitions, all of it or nothing
+/// </summary>
+/// <remarks>
+/// A disk holding a system mount point or an active swap area is refused. Each mount is asked first if it could be
+/// released (MNT_EXPIRE fails with EBUSY while it's in use without unmounting anything), only if none of them is busy
+/// are they unmounted, the most recent first so nested mounts go before their parents
+/// </remarks>
+/// <returns>True if nothing from the disk is mounted anymore</returns>
+static bool UnmountDevice(const std::string& devicePath)
+{
+	std::vector<std::string> mountPoints;
+
+	FILE* mounts = ::setmntent("/proc/self/mounts", "r");
+	if (mounts == nullptr)
+		return false;
+
+	while (struct mntent* entry = ::getmntent(mounts))
+	{
+		if (GetWholeDisk(entry->mnt_fsname) == devicePath)
+			mountPoints.insert(mountPoints.begin(), entry->mnt_dir);
+	}
+
+	::endmntent(mounts);
+
+	if (HasActiveSwap(devicePath))
+		return false;
+
+	for (const auto& mountPoint : mountPoints)
+	{
+		if (IsSystemMount(mountPoint))
+			return false;
+	}
+
+	// Only marks the mount as expired, EAGAIN means it isn't in use and would have been released
+	// (success means someone else had marked it already and it's gone now)
+	for (const auto& mountPoint : mountPoints)
+	{
+		if (::umount2(mountPoint.c_str(), MNT_EXPIRE) != 0 && errno != EAGAIN)
+			return false;
+	}
+
+	for (const auto& mountPoint : mountPoints)
+	{
+		if (::umount2(mountPoint.c_str(), 0) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+std::string PosixIoBackend::GetDevicePath(const std::string& path)
+{
+	std::string trimmed = path;
+	while (trimmed.size() > 1 && trimmed.back() == '/')
+		trimmed.pop_back();
+
+	// Already a device, a partition is tested as the disk it's on
+	struct stat st;
+	if (::stat(trimmed.c_str(), &st) == 0 && S_ISBLK(st.st_mode))
+		return GetWholeDisk(trimmed);
+
+	// Otherwise it should be a mount point, look up what's mounted there
+	std::string devicePath;
+
+	FILE* mounts = ::setmntent("/proc/self/mounts", "r");
+	if (mounts == nullptr)
+		return "";
+
+	while (struct mntent* entry = ::getmntent(mounts))
+	{
+		// Last match wins, that's the one on top
+		if (trimmed == entry->mnt_dir && ::stat(entry->mnt_fsname, &st) == 0 && S_ISBLK(st.st_mode))
+			devicePath = entry->mnt_fsname;
+	}
+
+	::endmntent(mounts);
+
+	// What's mounted is usually a partition, raw access covers the whole disk including the partition table
+	return devicePath.empty() ? "" : GetWholeDisk(devicePath);
+}
+
+std::unique_ptr<IoFile> PosixIoBackend::OpenDevice(const std::string& devicePath, unsigned long long* size, unsigned long* sectorSize, DeviceAccess access)
+{
+	// O_EXCL on a block device fails with EBUSY while it (or one of its partitions) is mounted, which is exactly what we want to avoid
+	const int flags = O_RDWR | O_DIRECT | O_SYNC | O_EXCL | O_CLOEXEC;
+
+	int fd = ::open(devicePath.c_str(), flags);
+
+	// Writing under a mounted filesystem would race with it, without permission to unmount we give up
+	if (fd < 0 && errno == EBUSY && access == DeviceAccess::Dismount)
+	{
+		if (!UnmountDevice(devicePath))
+			return nullptr;
+
+		fd = ::open(devicePath.c_str(), flags);
+	}
+
+	if (fd < 0)
+		return nullptr;
+
+	int logicalSectorSize = 0;
+
+	if (::ioctl(fd, BLKGETSIZE64, size) != 0 || ::ioctl(fd, BLKSSZGET, &logicalSectorSize) != 0 || logicalSectorSize <= 0)
+	{
+		::close(fd);
+		return nullptr;
+	}
+
+	*sectorSize = (unsigned long)logicalSectorSize;
+
+	return std::make_unique<PosixIoFile>(fd, true);
+}
+
+/// <summary>
+/// PCI addresses look like 0000:00:14.0
+/// </summary>
+static bool IsPciAddress(const std::string& name)
+{
+	return name.size() == 12 && name[4] == ':' && name[7] == ':' && name[10] == '.';
+}
+
+std::string PosixIoBackend::GetBusGroup(const std::string& path)
+{
+	std::string devicePath = GetDevicePath(path);
+
+	if (devicePath.empty())
+		return "";
+
+	// /sys/class/block/sdb links to something like /sys/devices/pci0000:00/0000:00:14.0/usb2/2-1/2-1.3/.../block/sdb
+	std::error_code error;
+	std::filesystem::path device = std::filesystem::canonical(devicePath, error);
+
+	if (error)
+		return "";
+
+	std::filesystem::path sysPath = std::filesystem::canonical("/sys/class/block" / device.filename(), error);
+
+	if (error)
+		return "";
+
+	std::filesystem::path prefix;
+	std::string controller;
+	bool afterRootHub = false;
+
+	for (const auto& part : sysPath)
+	{
+		prefix /= part;
+		std::string name = part.string();
+
+		// Whatever is plugged into the root port (the stick itself or a hub) and everything under it share that one link
+		if (afterRootHub)
+			return "usb:" + prefix.string();
+
+		afterRootHub = name.size() > 3 && name.compare(0, 3, "usb") == 0 && isdigit((unsigned char)name[3]);
+
+		// Otherwise the closest PCI function is the controller, every SATA port of an AHCI controller shares it
+		if (IsPciAddress(name))
+			controller = prefix.string();
+	}
+
+	// Loop devices and the like are virtual, there's no bus to share
+	return controller.empty() ? "" : "pci:" + controller;
+}
+
+#else
+
+std::string PosixIoBackend::GetDevicePath(const std::string& path)
+{
+	return "";
+}
+
+std::string PosixIoBackend::GetBusGroup(const std::string& path)
+{
+	return "";
+}
+
+std::unique_ptr<IoFile> PosixIoBackend::OpenDevice(const std::string& devicePath, unsigned long long* size, unsigned long* sectorSize, DeviceAccess access)
+{
+	return nullptr;
+}
+
+#endif
+
+std::unique_ptr<IoQueue> PosixIoBackend::CreateQueue(unsigned int depth)
+{
+#ifdef __linux__
+	// io_uring when the kernel lets us, it can be missing or disabled
+	std::unique_ptr<UringIoQueue> queue = UringIoQueue::Create(depth);
+
+	if (queue != nullptr)
+		return queue;
+#endif
+
+	return IoBackend::CreateQueue(depth);
+}
+
+std::shared_ptr<IoBackend> IoBackend::CreateNative()
+{
+	return std::make_shared<PosixIoBackend>();
+}
+
+#endif
@@ -0,0 +1,58 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#pragma once
+
+#ifndef _WIN32
+
+#include "IoBackend.hpp"
+
+/// <summary>
+/// File opened with O_DIRECT | O_SYNC
+/// </summary>
+class PosixIoFile : public IoFile
+{
+public:
+	/// <param name="fd">Opened file descriptor, we take ownership</param>
+	/// <param name="direct">False if the filesystem refused O_DIRECT and we are going through the page cache</param>
+	PosixIoFile(int fd, bool direct);
+	~PosixIoFile();
+
+	bool Read(unsigned long long offset, void* pData, size_t size) override;
+	bool Write(unsigned long long offset, const void* pData, size_t size) override;
+	bool Flush() override;
+	unsigned long long GetSize() override;
+	bool Reserve(unsigned long long size) override;
+
+	int GetDescriptor() const { return fd; }
+	bool IsDirect() const { return direct; }
+
+private:
+	int fd;
+	bool direct;
+};
+
+/// <summary>
+/// Native Linux backend (open(O_DIRECT)/pread/pwrite/fdatasync)
+/// </summary>
+class PosixIoBackend : public IoBackend
+{
+public:
+	const char* GetName() const override { return "posix"; }
+
+	std::unique_ptr<IoFile> Open(const std::string& path, IoOpenMode mode) override;
+	bool MakeDirectory(const std::string& path) override;
+	void RemoveTree(const std::string& path) override;
+	bool RemoveFile(const std::string& path) override;
+	bool GetDiskSpace(const std::string& path, unsigned long long* totalSpace, unsigned long long* freeSpace) override;
+	unsigned long GetDataBlockSize(const std::string& path) override;
+	unsigned long long GetMaxFileSize(const std::string& path) override;
+	std::string GetDevicePath(const std::string& path) override;
+	std::unique_ptr<IoFile> OpenDevice(const std::string& devicePath, unsigned long long* size, unsigned long* sectorSize, DeviceAccess access) override;
+	std::string GetBusGroup(const std::string& path) override;
+	std::unique_ptr<IoQueue> CreateQueue(unsigned int depth) override;
+};
+
+#endif
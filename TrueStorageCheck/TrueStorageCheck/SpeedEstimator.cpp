@@ -0,0 +1,228 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#include "SpeedEstimator.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+// Seconds of transfers the window speed is taken over
+const double SPEED_WINDOW = 5.0;
+
+// EWMA time constant in seconds of transfers
+const double SPEED_EWMA_TIME = 5.0;
+
+// A full window below this fraction of the speed before it is a cache running out, not noise
+const double CACHE_DROP_RATIO = 0.6;
+
+// Seconds of writes before the window needed to tell a drop from a slow start
+const double CACHE_MIN_TIME = 1.0;
+
+// Nothing to estimate the overhead from before this much was moved in a phase
+const unsigned long long OVERHEAD_MIN_BYTES = 16 * 1024 * 1024;
+
+SpeedEstimator::SpeedEstimator()
+{
+	Reset();
+}
+
+void SpeedEstimator::Reset()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	directions[0] = Direction();
+	directions[1] = Direction();
+
+	phase = SpeedPhase::Idle;
+	phaseStart = lastSample = std::chrono::steady_clock::now();
+	lastSampleInterval = 0;
+
+	for (int i = 0; i < 2; i++)
+	{
+		phaseWallSeconds[i] = phaseTransferSeconds[i] = 0;
+		phaseBytes[i] = 0;
+	}
+}
+
+void SpeedEstimator::SetPhase(SpeedPhase newPhase)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto now = std::chrono::steady_clock::now();
+
+	if (phase != SpeedPhase::Idle)
+		phaseWallSeconds[(int)phase] += std::chrono::duration<double>(now - phaseStart).count();
+
+	phase = newPhase;
+	phaseStart = lastSample = now;
+	lastSampleInterval = 0;
+}
+
+void SpeedEstimator::AddSample(bool write, unsigned long long bytes, double seconds)
+{
+	if (seconds <= 0)
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (phase != SpeedPhase::Idle)
+	{
+		auto now = std::chrono::steady_clock::now();
+
+		lastSampleInterval = std::chrono::duration<double>(now - lastSample).count();
+		lastSample = now;
+
+		phaseTransferSeconds[(int)phase] += seconds;
+
+		// Reads done while writing are part of the verification schedule, only the writes carry the overhead
+		if (phase == SpeedPhase::Read || write)
+			phaseBytes[(int)phase] += bytes;
+	}
+
+	Direction& direction = directions[write ? 0 : 1];
+
+	direction.bytes += bytes;
+	direction.seconds += seconds;
+
+	direction.window.push_back({ bytes, seconds });
+	direction.windowBytes += bytes;
+	direction.windowSeconds += seconds;
+
+	while (direction.window.size() > 1 && direction.windowSeconds - direction.window.front().seconds >= SPEED_WINDOW)
+	{
+		direction.windowBytes -= direction.window.front().bytes;
+		direction.windowSeconds -= direction.window.front().seconds;
+		direction.window.pop_front();
+	}
+
+	double speed = GetSpeed(bytes, seconds);
+	double alpha = 1 - std::exp(-seconds / SPEED_EWMA_TIME);
+
+	direction.ewma = direction.ewma == 0 ? speed : direction.ewma + alpha * (speed - direction.ewma);
+
+	// Only full windows are compared, a single slow chunk says nothing
+	if (!write || direction.dropped || direction.windowSeconds < SPEED_WINDOW)
+		return;
+
+	// The fast part can be shorter than a window, so the window is held against everything before it
+	double previousSeconds = direction.seconds - direction.windowSeconds;
+
+	if (previousSeconds < CACHE_MIN_TIME)
+		return;
+
+	double previousSpeed = GetSpeed(direction.bytes - direction.windowBytes, previousSeconds);
+
+	if (GetSpeed(direction.windowBytes, direction.windowSeconds) >= previousSpeed * CACHE_DROP_RATIO)
+		return;
+
+	direction.dropped = true;
+	direction.speedBeforeDrop = previousSpeed;
+
+	// The drop is where the first slow chunk of the window starts
+	direction.dropOffset = direction.bytes - direction.windowBytes;
+
+	for (const Sample& sample : direction.window)
+	{
+		if (GetSpeed(sample.bytes, sample.seconds) < previousSpeed * CACHE_DROP_RATIO)
+			break;
+
+		direction.dropOffset += sample.bytes;
+	}
+
+	// The fast part is history, what's left goes at the speed of the chunk that showed it
+	direction.ewma = speed;
+}
+
+double SpeedEstimator::GetAverageSpeed(bool write)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	const Direction& direction = directions[write ? 0 : 1];
+	return GetSpeed(direction.bytes, direction.seconds);
+}
+
+double SpeedEstimator::GetWindowSpeed(bool write)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	const Direction& direction = directions[write ? 0 : 1];
+	return GetSpeed(direction.windowBytes, direction.windowSeconds);
+}
+
+double SpeedEstimator::GetEwmaSpeed(bool write)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	return directions[write ? 0 : 1].ewma;
+}
+
+bool SpeedEstimator::GetCacheDrop(unsigned long long* offset, double* speedBefore, double* speedAfter)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	const Direction& direction = directions[0];
+
+	*offset = direction.dropOffset;
+	*speedBefore = direction.speedBeforeDrop;
+	*speedAfter = direction.dropped ? direction.ewma : 0;
+
+	return direction.dropped;
+}
+
+double SpeedEstimator::EstimateRemaining(unsigned long long writeBytes, unsigned long long readBytes)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto now = std::chrono::steady_clock::now();
+
+	const double writeSpeed = directions[0].ewma;
+	double readSpeed = directions[1].ewma;
+
+	if (writeBytes > 0 && writeSpeed <= 0)
+		return -1;
+
+	// Nothing read yet, reads are usually faster than writes and don't suffer from a full write cache
+	if (readSpeed <= 0)
+		readSpeed = std::max(writeSpeed * 2, directions[0].speedBeforeDrop);
+
+	if (readBytes > 0 && readSpeed <= 0)
+		return -1;
+
+	const double MB = 1024.0 * 1024.0;
+	double seconds = 0;
+
+	if (writeBytes > 0)
+		seconds += writeBytes / MB / writeSpeed + writeBytes * GetOverheadPerByte(SpeedPhase::Write);
+
+	if (readBytes > 0)
+		seconds += readBytes / MB / readSpeed + readBytes * GetOverheadPerByte(SpeedPhase::Read);
+
+	// The bytes left still include the chunk in flight, part of its time is already behind us
+	if (phase != SpeedPhase::Idle)
+		seconds -= std::min(std::chrono::duration<double>(now - lastSample).count(), lastSampleInterval);
+
+	return std::max(0.0, seconds);
+}
+
+double SpeedEstimator::GetOverheadPerByte(SpeedPhase overheadPhase)
+{
+	int index = (int)overheadPhase;
+
+	if (phaseBytes[index] < OVERHEAD_MIN_BYTES)
+		return 0;
+
+	double wallSeconds = phaseWallSeconds[index];
+
+	// Only up to the last chunk, the one in flight isn't accounted yet
+	if (phase == overheadPhase)
+		wallSeconds += std::chrono::duration<double>(lastSample - phaseStart).count();
+
+	return std::max(0.0, wallSeconds - phaseTransferSeconds[index]) / phaseBytes[index];
+}
+
+double SpeedEstimator::GetSpeed(unsigned long long bytes, double seconds)
+{
+	return seconds > 0 ? bytes / seconds / (1024 * 1024) : 0;
+}
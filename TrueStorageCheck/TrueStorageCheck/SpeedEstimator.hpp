@@ -0,0 +1,129 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+
+/// <summary>
+/// What a test is doing, as far as the time it takes is concerned
+/// </summary>
+enum class SpeedPhase
+{
+	// Writing, including the reads and re-opens done in between
+	Write = 0,
+	// Final verification
+	Read,
+	// Not started yet or done
+	Idle
+};
+
+/// <summary>
+/// Speeds of a test and how long it has left
+/// </summary>
+/// <remarks>
+/// Every chunk transferred goes into a cumulative average, a sliding window over the last SPEED_WINDOW seconds of
+/// transfers and a time weighted EWMA. Fake and cheap flash often writes fast until an SLC cache fills up and then
+/// drops to a fraction of that for the rest of the device. Once a full window is well below the speed of everything
+/// written before it the drop is recorded and the EWMA restarts from the latest chunk, so the estimate follows the
+/// slow part instead of slowly averaging out the fast start.
+/// Wall time not spent transferring (flushes, re-opens, quick checks, waiting for the bus) is tracked per phase and
+/// added to the estimate in proportion to the bytes left.
+/// </remarks>
+class SpeedEstimator
+{
+public:
+	SpeedEstimator();
+
+	/// <summary>
+	/// Forgets everything
+	/// </summary>
+	void Reset();
+
+	/// <summary>
+	/// Starts accounting wall time towards a phase
+	/// </summary>
+	void SetPhase(SpeedPhase phase);
+
+	/// <summary>
+	/// Adds a transferred chunk, reads that aren't part of the verification (quick checks) are left out and count as overhead
+	/// </summary>
+	/// <param name="write">Written if true, read otherwise</param>
+	/// <param name="bytes">Size of the chunk</param>
+	/// <param name="seconds">Time spent transferring it</param>
+	void AddSample(bool write, unsigned long long bytes, double seconds);
+
+	/// <summary>
+	/// Speeds in MB/s: since the start, over the last SPEED_WINDOW seconds of transfers and the EWMA. 0 if nothing was transferred
+	/// </summary>
+	double GetAverageSpeed(bool write);
+	double GetWindowSpeed(bool write);
+	double GetEwmaSpeed(bool write);
+
+	/// <summary>
+	/// Gets the write speed drop detected so far, if any
+	/// </summary>
+	/// <param name="offset">Bytes written when the drop happened, roughly the size of the write cache</param>
+	/// <param name="speedBefore">Average speed before the drop, in MB/s</param>
+	/// <param name="speedAfter">Write speed since, in MB/s</param>
+	/// <returns>False if the write speed didn't drop</returns>
+	bool GetCacheDrop(unsigned long long* offset, double* speedBefore, double* speedAfter);
+
+	/// <summary>
+	/// Estimates the time left
+	/// </summary>
+	/// <param name="writeBytes">Bytes left to write</param>
+	/// <param name="readBytes">Bytes left to verify</param>
+	/// <returns>Seconds, or a negative value if there's nothing to go by yet</returns>
+	double EstimateRemaining(unsigned long long writeBytes, unsigned long long readBytes);
+
+private:
+	struct Sample
+	{
+		unsigned long long bytes;
+		double seconds;
+	};
+
+	struct Direction
+	{
+		unsigned long long bytes = 0;
+		double seconds = 0;
+
+		std::deque<Sample> window;
+		unsigned long long windowBytes = 0;
+		double windowSeconds = 0;
+
+		double ewma = 0;
+
+		// Write speed drop, see GetCacheDrop
+		bool dropped = false;
+		unsigned long long dropOffset = 0;
+		double speedBeforeDrop = 0;
+	};
+
+	std::mutex mutex;
+
+	Direction directions[2];
+
+	// Wall time, transfer time and bytes moved in each phase, the difference is overhead
+	SpeedPhase phase;
+	std::chrono::steady_clock::time_point phaseStart;
+	double phaseWallSeconds[2];
+	double phaseTransferSeconds[2];
+	unsigned long long phaseBytes[2];
+
+	// When the last chunk of the phase finished, and the wall time between it and the one before
+	std::chrono::steady_clock::time_point lastSample;
+	double lastSampleInterval;
+
+	/// <summary>
+	/// Seconds of overhead per byte moved in a phase, mutex must be held
+	/// </summary>
+	double GetOverheadPerByte(SpeedPhase overheadPhase);
+
+	static double GetSpeed(unsigned long long bytes, double seconds);
+};
@@ -0,0 +1,151 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#include "TestEvents.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+EventQueue::EventQueue() : events(), head(0), tail(0), dropped(0) {}
+
+bool EventQueue::Push(const TestEvent& event)
+{
+	size_t currentTail = tail.load(std::memory_order_relaxed);
+
+	if (currentTail - head.load(std::memory_order_acquire) >= CAPACITY)
+	{
+		dropped.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	events[currentTail % CAPACITY] = event;
+	tail.store(currentTail + 1, std::memory_order_release);
+
+	return true;
+}
+
+size_t EventQueue::Poll(TestEvent* out, size_t maxEvents)
+{
+	size_t currentHead = head.load(std::memory_order_relaxed);
+	size_t available = tail.load(std::memory_order_acquire) - currentHead;
+	size_t count = std::min(available, maxEvents);
+
+	for (size_t i = 0; i < count; i++)
+		out[i] = events[(currentHead + i) % CAPACITY];
+
+	// The slots are only free for the producer once they were copied
+	head.store(currentHead + count, std::memory_order_release);
+
+	return count;
+}
+
+EventSnapshot::EventSnapshot() : sequence(0)
+{
+	for (auto& word : words)
+		word.store(0, std::memory_order_relaxed);
+}
+
+void EventSnapshot::Store(const TestEvent& event)
+{
+	uint64_t buffer[WORDS] = {};
+	memcpy(buffer, &event, sizeof(TestEvent));
+
+	// Odd while writing, readers that saw it or see it change start over
+	sequence.fetch_add(1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	for (size_t i = 0; i < WORDS; i++)
+		words[i].store(buffer[i], std::memory_order_relaxed);
+
+	sequence.fetch_add(1, std::memory_order_release);
+}
+
+TestEvent EventSnapshot::Load() const
+{
+	uint64_t buffer[WORDS];
+	uint64_t before, after;
+
+	do
+	{
+		before = sequence.load(std::memory_order_acquire);
+
+		for (size_t i = 0; i < WORDS; i++)
+			buffer[i] = words[i].load(std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		after = sequence.load(std::memory_order_relaxed);
+	} while ((before & 1) != 0 || before != after);
+
+	TestEvent event;
+	memcpy(&event, buffer, sizeof(TestEvent));
+
+	return event;
+}
+
+ProgressNotifier::ProgressNotifier() : interval(0), pending(false), stopping(false) {}
+
+ProgressNotifier::~ProgressNotifier()
+{
+	Stop();
+}
+
+void ProgressNotifier::Start(std::function<void()> notifyCallback, std::chrono::milliseconds notifyInterval)
+{
+	if (thread.joinable())
+		return;
+
+	callback = std::move(notifyCallback);
+	interval = notifyInterval;
+	pending = stopping = false;
+
+	thread = std::thread(&ProgressNotifier::NotifyLoop, this);
+}
+
+void ProgressNotifier::Notify()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pending = true;
+	}
+
+	changed.notify_one();
+}
+
+void ProgressNotifier::Stop()
+{
+	if (!thread.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+
+	changed.notify_one();
+	thread.join();
+}
+
+void ProgressNotifier::NotifyLoop()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (true)
+	{
+		changed.wait(lock, [&] { return pending || stopping; });
+
+		bool last = stopping;
+		pending = false;
+
+		// The test only ever waits for the lock, never for the callback
+		lock.unlock();
+		callback();
+		lock.lock();
+
+		if (last)
+			break;
+
+		changed.wait_for(lock, interval, [&] { return stopping; });
+	}
+}
@@ -0,0 +1,169 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+/// <summary>
+/// Kinds of TestEvent
+/// </summary>
+enum TestEventType
+{
+	// Progress was made, sent at most every EVENT_INTERVAL unless the percentage changes
+	TestEvent_Progress = 0,
+	// The test state changed, always sent
+	TestEvent_StateChanged
+};
+
+/// <summary>
+/// Where a test is at, handed out as is through the C API so only fixed size fields
+/// </summary>
+struct TestEvent
+{
+	int32_t type;
+
+	// DiskTest::State and percentage done
+	int32_t state;
+	int32_t progress;
+
+	// Seconds, see DiskTest::GetTimeRemaining
+	uint32_t timeRemaining;
+
+	uint64_t bytesWritten;
+	uint64_t bytesVerified;
+
+	// See DiskTest::GetLastSuccessfulVerifyPosition
+	uint64_t lastVerifiedPosition;
+
+	// Average speeds in MB/s
+	double writeSpeed;
+	double readSpeed;
+};
+
+/// <summary>
+/// Fixed size single producer, single consumer ring of events, lock-free on both ends
+/// </summary>
+/// <remarks>
+/// The producer (the test thread) never waits, an event that doesn't fit is dropped and counted. With progress
+/// events coalesced that only happens if nobody polled for a long time, and the latest state is always in the snapshot.
+/// </remarks>
+class EventQueue
+{
+public:
+	static const size_t CAPACITY = 1024;
+
+	EventQueue();
+
+	EventQueue(const EventQueue&) = delete;
+	EventQueue& operator=(const EventQueue&) = delete;
+
+	/// <summary>
+	/// Adds an event, producer only
+	/// </summary>
+	/// <returns>False if the queue was full and the event dropped</returns>
+	bool Push(const TestEvent& event);
+
+	/// <summary>
+	/// Takes the oldest events, consumer only
+	/// </summary>
+	/// <returns>Number of events stored</returns>
+	size_t Poll(TestEvent* events, size_t maxEvents);
+
+	/// <summary>
+	/// Events dropped because the queue was full
+	/// </summary>
+	unsigned long long GetDropped() const { return dropped.load(std::memory_order_relaxed); }
+
+private:
+	TestEvent events[CAPACITY];
+
+	// Apart so the two threads don't fight over a cache line
+	alignas(64) std::atomic<size_t> head;
+	alignas(64) std::atomic<size_t> tail;
+
+	std::atomic<unsigned long long> dropped;
+};
+
+/// <summary>
+/// Latest event, written by one thread and read consistently by any number of others (sequence lock)
+/// </summary>
+class EventSnapshot
+{
+public:
+	EventSnapshot();
+
+	/// <summary>
+	/// Replaces the snapshot, single writer only
+	/// </summary>
+	void Store(const TestEvent& event);
+
+	/// <summary>
+	/// Gets the snapshot, retrying while the writer is in the middle of a store
+	/// </summary>
+	TestEvent Load() const;
+
+private:
+	static const size_t WORDS = (sizeof(TestEvent) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+	std::atomic<uint64_t> sequence;
+	std::atomic<uint64_t> words[WORDS];
+};
+
+/// <summary>
+/// Calls the progress callback from a thread of its own, so a slow consumer never holds up the test
+/// </summary>
+/// <remarks>
+/// Notifications are coalesced: however many come in while the callback runs or waits out its interval, the next call
+/// sees only the latest snapshot.
+/// </remarks>
+class ProgressNotifier
+{
+public:
+	ProgressNotifier();
+	~ProgressNotifier();
+
+	ProgressNotifier(const ProgressNotifier&) = delete;
+	ProgressNotifier& operator=(const ProgressNotifier&) = delete;
+
+	/// <summary>
+	/// Starts the thread if it isn't running
+	/// </summary>
+	/// <param name="callback">Delivers the latest state, called at most once per interval</param>
+	/// <param name="interval">Least time between calls</param>
+	void Start(std::function<void()> callback, std::chrono::milliseconds interval);
+
+	/// <summary>
+	/// Asks for a call, never waits for the callback
+	/// </summary>
+	void Notify();
+
+	/// <summary>
+	/// Makes one last call and stops the thread
+	/// </summary>
+	void Stop();
+
+	bool IsRunning() const { return thread.joinable(); }
+
+private:
+	std::thread thread;
+	std::function<void()> callback;
+	std::chrono::milliseconds interval;
+
+	std::mutex mutex;
+	std::condition_variable changed;
+
+	bool pending;
+	bool stopping;
+
+	void NotifyLoop();
+};
@@ -5,8 +5,9 @@
  */
 #include "TestFile.hpp"
 
-TestFile::TestFile(const std::string& path, unsigned long long totalSize) : Path(path), TotalSize(totalSize) {
-    BytesWritten  = DataSize = 0;
+TestFile::TestFile(const std::string& path, unsigned long long totalSize, unsigned long long seed, unsigned long long streamOffset) : Path(path), TotalSize(totalSize), Seed(seed), StreamOffset(streamOffset) {
+    BytesWritten = 0;
+    Verified = false;
 }
 
 /// <summary>
@@ -17,18 +18,3 @@ void TestFile::SetBytesWritten(unsigned long long bytesWritten) {
     BytesWritten = bytesWritten;
 }
 
-/// <summary>
-/// Setter for Data
-/// </summary>
-/// <param name="data">Pointer to the data to copy to this TestFile</param>
-/// <param name="dataSize">Size of the data in our pointer</param>
-void TestFile::SetData(const unsigned char* pData, unsigned long long dataSize) {
-
-    DataSize = dataSize;
-
-    // Resize our Data vector and copy data
-    Data.resize(dataSize); 
-    memcpy(&Data[0], pData, dataSize);
-
-}
-
@@ -11,7 +11,7 @@
 class TestFile
 {
 public:
-    TestFile(const std::string& path, unsigned long long totalSize);
+    TestFile(const std::string& path, unsigned long long totalSize, unsigned long long seed, unsigned long long streamOffset);
 
     std::string Path;
     unsigned long long BytesWritten;
@@ -19,16 +19,24 @@ public:
     unsigned long long TotalSize;
 
     /// <summary>
-    /// We save part of the generated data to quickly verify later if necessary, Data is usually DataBlockSize
+    /// Pattern seed, any part of the file can be regenerated from it for verification
     /// </summary>
-    std::vector<unsigned char> Data;
-    unsigned long long DataSize;
+    unsigned long long Seed;
+
+    /// <summary>
+    /// Position of the file in everything written by the test, sector tags are based on it
+    /// </summary>
+    unsigned long long StreamOffset;
+
+    /// <summary>
+    /// Passed the final verification
+    /// </summary>
+    bool Verified;
 
     /// <summary>
     /// Setters
     /// </summary>
     void SetBytesWritten(unsigned long long bytesWritten);
-    void SetData(const unsigned char* pData, unsigned long long dataSize);
 
 private:
     
@@ -0,0 +1,236 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#include "TestJournal.hpp"
+
+#include "Platform.hpp"
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+#ifdef _WIN32
+#include <io.h>
+#endif
+
+// First word of the header, the number is bumped whenever the records change
+const char* JOURNAL_MAGIC = "TSC_JOURNAL";
+const int JOURNAL_VERSION = 1;
+
+// Record checksum, 8 hex digits and a space
+const size_t JOURNAL_CHECKSUM_SIZE = 9;
+
+/// <summary>
+/// FNV-1a, good enough to catch a torn or garbled line
+/// </summary>
+static uint32_t Checksum(const std::string& text)
+{
+	uint32_t hash = 2166136261u;
+
+	for (unsigned char c : text)
+	{
+		hash ^= c;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/// <summary>
+/// Reads whatever is left of a record after its fields, names can have spaces in them
+/// </summary>
+static std::string ReadRest(std::istringstream& stream)
+{
+	std::string rest;
+
+	if (stream.peek() == ' ')
+		stream.get();
+
+	std::getline(stream, rest);
+	return rest;
+}
+
+static FILE* OpenFile(const std::string& path, const char* mode)
+{
+#ifdef _WIN32
+	FILE* file = nullptr;
+	return fopen_s(&file, path.c_str(), mode) == 0 ? file : nullptr;
+#else
+	return fopen(path.c_str(), mode);
+#endif
+}
+
+TestJournal::TestJournal() : file(nullptr) {}
+
+TestJournal::~TestJournal()
+{
+	Close();
+}
+
+bool TestJournal::Load(const std::string& path, JournalState* state)
+{
+	std::ifstream stream(path, std::ios::binary);
+
+	if (!stream.is_open())
+		return false;
+
+	std::string content((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+
+	*state = JournalState();
+
+	bool hasHeader = false;
+	size_t position = 0;
+
+	// A line without its newline was cut short by a crash
+	for (size_t end = content.find('\n'); end != std::string::npos; position = end + 1, end = content.find('\n', position))
+	{
+		std::string line = content.substr(position, end - position);
+
+		if (line.size() <= JOURNAL_CHECKSUM_SIZE)
+			break;
+
+		std::string record = line.substr(JOURNAL_CHECKSUM_SIZE);
+		uint32_t checksum = (uint32_t)strtoul(line.substr(0, JOURNAL_CHECKSUM_SIZE - 1).c_str(), nullptr, 16);
+
+		if (checksum != Checksum(record))
+			break;
+
+		std::istringstream fields(record);
+		std::string type;
+		fields >> type;
+
+		if (!hasHeader)
+		{
+			int version = 0;
+			int tagging = 0;
+
+			fields >> version >> state->requestedCapacity >> state->capacity >> state->runId >> tagging;
+
+			if (type != JOURNAL_MAGIC || version != JOURNAL_VERSION || fields.fail())
+				return false;
+
+			state->sectorTagging = tagging != 0;
+			state->testPath = ReadRest(fields);
+			hasHeader = true;
+		}
+		else if (type == "F")
+		{
+			JournalFile journalFile;
+			fields >> journalFile.size >> journalFile.streamOffset;
+			journalFile.name = ReadRest(fields);
+
+			state->files.push_back(journalFile);
+		}
+		else if (type == "V")
+		{
+			int success = 0;
+			fields >> success;
+			std::string name = ReadRest(fields);
+
+			for (auto& journalFile : state->files)
+			{
+				if (journalFile.name == name)
+					journalFile.verified = success != 0;
+			}
+		}
+		else if (type == "END")
+		{
+			int success = 0;
+			fields >> success;
+
+			state->finished = true;
+			state->success = success != 0;
+		}
+
+		state->validLength = end + 1;
+	}
+
+	return hasHeader;
+}
+
+bool TestJournal::Create(const std::string& path, const JournalState& state)
+{
+	Close();
+
+	file = OpenFile(path, "wb");
+
+	if (file == nullptr)
+		return false;
+
+	std::ostringstream header;
+	header << JOURNAL_MAGIC << " " << JOURNAL_VERSION << " " << state.requestedCapacity << " " << state.capacity << " " << state.runId << " " << (state.sectorTagging ? 1 : 0) << " " << state.testPath;
+
+	return Append(header.str());
+}
+
+bool TestJournal::Continue(const std::string& path, const JournalState& state)
+{
+	Close();
+
+	std::error_code error;
+	std::filesystem::resize_file(path, state.validLength, error);
+
+	if (error)
+		return false;
+
+	file = OpenFile(path, "ab");
+
+	return file != nullptr;
+}
+
+bool TestJournal::AddFile(const JournalFile& journalFile)
+{
+	std::ostringstream record;
+	record << "F " << journalFile.size << " " << journalFile.streamOffset << " " << journalFile.name;
+
+	return Append(record.str());
+}
+
+bool TestJournal::SetVerified(const std::string& name, bool success)
+{
+	std::ostringstream record;
+	record << "V " << (success ? 1 : 0) << " " << name;
+
+	return Append(record.str());
+}
+
+bool TestJournal::Finish(bool success)
+{
+	bool ret = Append(std::string("END ") + (success ? "1" : "0"));
+	Close();
+
+	return ret;
+}
+
+void TestJournal::Close()
+{
+	if (file != nullptr)
+		fclose(file);
+
+	file = nullptr;
+}
+
+bool TestJournal::Append(const std::string& record)
+{
+	if (file == nullptr)
+		return false;
+
+	char checksum[JOURNAL_CHECKSUM_SIZE + 1];
+	snprintf(checksum, sizeof(checksum), "%08x ", Checksum(record));
+
+	std::string line = checksum + record + "\n";
+
+	if (fwrite(line.data(), 1, line.size(), file) != line.size() || fflush(file) != 0)
+		return false;
+
+	// Only worth anything if it survives a power cut
+#ifdef _WIN32
+	return _commit(_fileno(file)) == 0;
+#else
+	return fsync(fileno(file)) == 0;
+#endif
+}
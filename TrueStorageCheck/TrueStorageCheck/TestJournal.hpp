@@ -0,0 +1,124 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/// <summary>
+/// A test file as recorded in the journal
+/// </summary>
+struct JournalFile
+{
+	// File name inside TSC_Files
+	std::string name;
+
+	unsigned long long size = 0;
+
+	// See TestFile::StreamOffset
+	unsigned long long streamOffset = 0;
+
+	// Passed the final verification
+	bool verified = false;
+};
+
+/// <summary>
+/// Everything a journal says about a test
+/// </summary>
+struct JournalState
+{
+	// Drive root or mount point tested
+	std::string testPath;
+
+	// Capacity asked for (0 for all free space) and what that came down to, in bytes
+	unsigned long long requestedCapacity = 0;
+	unsigned long long capacity = 0;
+
+	uint32_t runId = 0;
+	bool sectorTagging = false;
+
+	// Files written and checked, in the order they were written
+	std::vector<JournalFile> files;
+
+	// The test ran to the end, there's nothing to resume
+	bool finished = false;
+	bool success = false;
+
+	// Bytes of the journal up to the last intact record
+	unsigned long long validLength = 0;
+};
+
+/// <summary>
+/// Append-only journal kept on the host, so a test that was interrupted (crash, reboot, ForceStopTest) can pick
+/// up where it left off instead of writing everything again
+/// </summary>
+/// <remarks>
+/// One text line per record, each starting with a checksum of the rest of the line. Records are flushed to disk
+/// as they are written, a record torn by a crash fails its checksum and everything from it on is ignored.
+/// </remarks>
+class TestJournal
+{
+public:
+	TestJournal();
+	~TestJournal();
+
+	TestJournal(const TestJournal&) = delete;
+	TestJournal& operator=(const TestJournal&) = delete;
+
+	/// <summary>
+	/// Reads a journal
+	/// </summary>
+	/// <param name="path">Journal path</param>
+	/// <param name="state">Receives what the journal says</param>
+	/// <returns>False if there's no journal or not even its header is intact</returns>
+	static bool Load(const std::string& path, JournalState* state);
+
+	/// <summary>
+	/// Starts a new journal, replacing any previous one
+	/// </summary>
+	/// <param name="path">Journal path</param>
+	/// <param name="state">Test settings, the files are ignored</param>
+	/// <returns>False if the journal couldn't be written</returns>
+	bool Create(const std::string& path, const JournalState& state);
+
+	/// <summary>
+	/// Continues a journal read with Load, dropping anything after its last intact record
+	/// </summary>
+	/// <returns>False if the journal couldn't be opened</returns>
+	bool Continue(const std::string& path, const JournalState& state);
+
+	/// <summary>
+	/// Records a test file that was written and passed the checks done while writing
+	/// </summary>
+	bool AddFile(const JournalFile& file);
+
+	/// <summary>
+	/// Records the final verification of a test file
+	/// </summary>
+	bool SetVerified(const std::string& name, bool success);
+
+	/// <summary>
+	/// Records the end of the test and closes the journal
+	/// </summary>
+	bool Finish(bool success);
+
+	/// <summary>
+	/// Closes the journal, leaving it to be resumed
+	/// </summary>
+	void Close();
+
+	bool IsOpen() const { return file != nullptr; }
+
+private:
+	FILE* file;
+
+	/// <summary>
+	/// Appends a record and waits for it to reach the disk
+	/// </summary>
+	bool Append(const std::string& record);
+};
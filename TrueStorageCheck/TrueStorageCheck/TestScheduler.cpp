@@ -0,0 +1,318 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#include "TestScheduler.hpp"
+
+#include <algorithm>
+
+// How often throughput is measured and slots are moved, long enough to average out chunk boundaries
+const std::chrono::milliseconds SCHEDULER_INTERVAL(2000);
+
+// A step is only considered worse if throughput dropped by more than this, anything less is noise
+const double SCHEDULER_TOLERANCE = 0.05;
+
+TestScheduler& TestScheduler::Instance()
+{
+	// Never destroyed on purpose, same as the WorkerPool
+	static TestScheduler* scheduler = new TestScheduler();
+	return *scheduler;
+}
+
+TestScheduler::TestScheduler() : stopping(false) {}
+
+TestScheduler::~TestScheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+
+	changed.notify_all();
+
+	if (controller.joinable())
+		controller.join();
+}
+
+bool TestScheduler::Add(DiskTest* test, TestKind kind)
+{
+	// Can take a moment (sysfs or SetupAPI), done before taking the lock
+	std::string busGroup = test->GetBusGroup();
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	for (const auto& device : devices)
+	{
+		if (device->test == test)
+			return false;
+	}
+
+	size_t groupIndex = groups.size();
+
+	// Unknown buses are never shared
+	for (size_t i = 0; i < groups.size() && !busGroup.empty(); i++)
+	{
+		if (groups[i]->name == busGroup)
+			groupIndex = i;
+	}
+
+	if (groupIndex == groups.size())
+	{
+		std::unique_ptr<Group> group = std::make_unique<Group>();
+		group->name = busGroup;
+		group->gate = std::make_shared<IoGate>(1);
+		groups.push_back(std::move(group));
+	}
+
+	std::unique_ptr<Device> device = std::make_unique<Device>();
+	device->test = test;
+	device->kind = kind;
+	device->group = groupIndex;
+
+	const IoUsage& usage = test->GetIoUsage();
+	device->lastBytes = usage.bytes;
+	device->lastBusyNs = usage.busyNs;
+	device->lastWaitNs = usage.waitNs;
+
+	devices.push_back(std::move(device));
+
+	// Everyone runs until the first measurement says otherwise
+	Group& group = *groups[groupIndex];
+	group.gate->SetSlots((unsigned int)std::count_if(devices.begin(), devices.end(), [&](const std::unique_ptr<Device>& d) { return d->group == groupIndex; }));
+	group.previousThroughput = 0;
+
+	test->SetIoGate(group.gate);
+
+	if (!controller.joinable())
+		controller = std::thread(&TestScheduler::ControlLoop, this);
+
+	return true;
+}
+
+void TestScheduler::Remove(DiskTest* test)
+{
+	std::unique_ptr<Device> removed;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		auto it = std::find_if(devices.begin(), devices.end(), [&](const std::unique_ptr<Device>& device) { return device->test == test; });
+
+		if (it == devices.end())
+			return;
+
+		removed = std::move(*it);
+		devices.erase(it);
+
+		// Drop the group if it's empty now, keeping the indexes of the others right
+		size_t groupIndex = removed->group;
+
+		if (std::none_of(devices.begin(), devices.end(), [&](const std::unique_ptr<Device>& device) { return device->group == groupIndex; }))
+		{
+			groups.erase(groups.begin() + groupIndex);
+
+			for (auto& device : devices)
+			{
+				if (device->group > groupIndex)
+					device->group--;
+			}
+		}
+	}
+
+	// The thread still uses the device, it's only destroyed once the thread is done with it
+	if (removed->thread.joinable())
+	{
+		test->ForceStopTest();
+		removed->thread.join();
+	}
+
+	test->SetIoGate(nullptr);
+}
+
+size_t TestScheduler::Start()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	size_t started = 0;
+
+	for (auto& device : devices)
+	{
+		if (device->thread.joinable() || device->finished)
+			continue;
+
+		device->thread = std::thread(&TestScheduler::RunTest, this, device.get());
+		started++;
+	}
+
+	return started;
+}
+
+void TestScheduler::Wait()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	changed.wait(lock, [&] {
+		return std::all_of(devices.begin(), devices.end(), [](const std::unique_ptr<Device>& device) { return !device->thread.joinable() || device->finished; });
+	});
+
+	// Finished threads only have to return, nothing they do needs the lock anymore
+	for (auto& device : devices)
+	{
+		if (device->thread.joinable())
+			device->thread.join();
+	}
+}
+
+void TestScheduler::RunTest(Device* device)
+{
+	device->test->Run(device->kind);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		device->finished = true;
+	}
+
+	changed.notify_all();
+}
+
+void TestScheduler::ControlLoop()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	auto lastRebalance = std::chrono::steady_clock::now();
+
+	while (!stopping)
+	{
+		changed.wait_for(lock, SCHEDULER_INTERVAL);
+
+		// Woken up by a test starting or finishing, wait for the full interval
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - lastRebalance).count();
+
+		if (seconds < std::chrono::duration<double>(SCHEDULER_INTERVAL).count())
+			continue;
+
+		Rebalance(seconds);
+		lastRebalance = std::chrono::steady_clock::now();
+	}
+}
+
+void TestScheduler::Rebalance(double seconds)
+{
+	const double nanoseconds = seconds * 1e9;
+
+	std::vector<size_t> activeDevices(groups.size(), 0);
+
+	for (auto& device : devices)
+	{
+		const IoUsage& usage = device->test->GetIoUsage();
+
+		unsigned long long bytes = usage.bytes;
+		unsigned long long busyNs = usage.busyNs;
+		unsigned long long waitNs = usage.waitNs;
+
+		device->throughput = (bytes - device->lastBytes) / seconds / (1024 * 1024);
+		// Transfers are accounted when they end, one running across the interval boundary can push these past 1
+		device->busy = std::min(1.0, (busyNs - device->lastBusyNs) / nanoseconds);
+		device->waiting = std::min(1.0, (waitNs - device->lastWaitNs) / nanoseconds);
+
+		device->lastBytes = bytes;
+		device->lastBusyNs = busyNs;
+		device->lastWaitNs = waitNs;
+
+		int state = device->test->GetTestState();
+
+		if (state == DiskTest::State_InProgress || state == DiskTest::State_Verification)
+			activeDevices[device->group]++;
+	}
+
+	for (size_t i = 0; i < groups.size(); i++)
+	{
+		Group& group = *groups[i];
+		const IoUsage& usage = group.gate->GetUsage();
+
+		unsigned int slots = group.gate->GetSlots();
+
+		unsigned long long bytes = usage.bytes;
+		unsigned long long busyNs = usage.busyNs;
+
+		group.throughput = (bytes - group.lastBytes) / seconds / (1024 * 1024);
+		group.busy = std::min(1.0, (busyNs - group.lastBusyNs) / (nanoseconds * slots));
+
+		group.lastBytes = bytes;
+		group.lastBusyNs = busyNs;
+
+		// A test started or finished, what we measured before doesn't apply anymore
+		if (activeDevices[i] != group.activeDevices)
+		{
+			group.activeDevices = activeDevices[i];
+			group.previousThroughput = 0;
+			group.step = -1;
+			group.gate->SetSlots((unsigned int)std::max<size_t>(1, activeDevices[i]));
+			continue;
+		}
+
+		// Nothing to share, or nothing moving to measure
+		if (activeDevices[i] < 2 || group.throughput <= 0)
+			continue;
+
+		if (group.previousThroughput > 0 && group.throughput < group.previousThroughput * (1 - SCHEDULER_TOLERANCE))
+			group.step = -group.step;
+
+		group.previousThroughput = group.throughput;
+
+		// Bounce off the edges, so a change in the devices (a cache filling up) is still noticed
+		long long next = (long long)slots + group.step;
+
+		if (next < 1 || next > (long long)activeDevices[i])
+		{
+			group.step = -group.step;
+			next = (long long)slots + group.step;
+		}
+
+		group.gate->SetSlots((unsigned int)std::clamp<long long>(next, 1, (long long)activeDevices[i]));
+	}
+}
+
+std::vector<GroupUtilization> TestScheduler::GetGroupUtilization()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	std::vector<GroupUtilization> result(groups.size());
+
+	for (size_t i = 0; i < groups.size(); i++)
+	{
+		result[i].name = groups[i]->name;
+		result[i].activeDevices = groups[i]->activeDevices;
+		result[i].slots = groups[i]->gate->GetSlots();
+		result[i].throughput = groups[i]->throughput;
+		result[i].busy = groups[i]->busy;
+		result[i].totalBytes = groups[i]->gate->GetUsage().bytes;
+	}
+
+	for (const auto& device : devices)
+		result[device->group].devices++;
+
+	return result;
+}
+
+bool TestScheduler::GetDeviceUtilization(DiskTest* test, DeviceUtilization* utilization)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	for (const auto& device : devices)
+	{
+		if (device->test != test)
+			continue;
+
+		utilization->group = device->group;
+		utilization->throughput = device->throughput;
+		utilization->busy = device->busy;
+		utilization->waiting = device->waiting;
+		utilization->totalBytes = test->GetIoUsage().bytes;
+
+		return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,173 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DiskTest.hpp"
+#include "IoGate.hpp"
+
+/// <summary>
+/// How a device used its bus over the last measuring interval
+/// </summary>
+struct DeviceUtilization
+{
+	// Index of the group the device belongs to
+	size_t group = 0;
+
+	// MB/s over the last interval
+	double throughput = 0;
+
+	// Fraction of the interval spent transferring / waiting for a slot
+	double busy = 0;
+	double waiting = 0;
+
+	// Bytes transferred since the device was added
+	unsigned long long totalBytes = 0;
+};
+
+/// <summary>
+/// How a group of devices sharing a bus used it over the last measuring interval
+/// </summary>
+struct GroupUtilization
+{
+	// Bus identifier, see IoBackend::GetBusGroup
+	std::string name;
+
+	// Devices in the group / of those, the ones running a test
+	size_t devices = 0;
+	size_t activeDevices = 0;
+
+	// Transfers allowed at the same time
+	unsigned int slots = 0;
+
+	// MB/s over the last interval, all devices together
+	double throughput = 0;
+
+	// Fraction of the slots kept busy over the last interval
+	double busy = 0;
+
+	// Bytes transferred since the group was created
+	unsigned long long totalBytes = 0;
+};
+
+/// <summary>
+/// Process wide owner of the tests of every device, groups devices that share a bus (same USB root port or
+/// storage controller) and decides how many of each group transfer at the same time
+/// </summary>
+/// <remarks>
+/// Every group gets an IoGate. While more than one of its devices is running, the number of slots is tuned by
+/// hill climbing on the aggregate throughput of the group: every interval the slot count moves one step, and the
+/// direction flips whenever the last step made things worse. A hub that can't keep up with twelve sticks at once
+/// ends up serving a few at a time at full speed instead of all of them thrashing.
+/// Devices the backend can't place on a bus get a group of their own, so they are never held back.
+/// </remarks>
+class TestScheduler
+{
+public:
+	/// <summary>
+	/// Gets the process wide scheduler
+	/// </summary>
+	static TestScheduler& Instance();
+
+	/// <summary>
+	/// Adds a device test to its bus group, its I/O goes through the group gate from now on
+	/// </summary>
+	/// <param name="test">Test that wasn't started yet, must stay alive until it's removed</param>
+	/// <param name="kind">Test to run when started</param>
+	/// <returns>False if the test was already added</returns>
+	bool Add(DiskTest* test, TestKind kind);
+
+	/// <summary>
+	/// Stops the test if it was started by the scheduler and forgets about it
+	/// </summary>
+	void Remove(DiskTest* test);
+
+	/// <summary>
+	/// Starts every added test that wasn't started yet, each on its own thread
+	/// </summary>
+	/// <returns>Number of tests started</returns>
+	size_t Start();
+
+	/// <summary>
+	/// Waits for every test started by the scheduler to finish
+	/// </summary>
+	void Wait();
+
+	/// <summary>
+	/// Gets the utilization of every group, indexes match DeviceUtilization::group
+	/// </summary>
+	std::vector<GroupUtilization> GetGroupUtilization();
+
+	/// <summary>
+	/// Gets the utilization of a device
+	/// </summary>
+	/// <returns>False if the test wasn't added</returns>
+	bool GetDeviceUtilization(DiskTest* test, DeviceUtilization* utilization);
+
+private:
+	TestScheduler();
+	~TestScheduler();
+
+	struct Group
+	{
+		std::string name;
+		std::shared_ptr<IoGate> gate;
+
+		// Last interval
+		unsigned long long lastBytes = 0;
+		unsigned long long lastBusyNs = 0;
+		double throughput = 0;
+		double busy = 0;
+
+		// Hill climbing state, the throughput before the last step and where we are heading
+		double previousThroughput = 0;
+		int step = -1;
+		size_t activeDevices = 0;
+	};
+
+	struct Device
+	{
+		DiskTest* test;
+		TestKind kind;
+		size_t group;
+
+		std::thread thread;
+		bool finished = false;
+
+		// Last interval
+		unsigned long long lastBytes = 0;
+		unsigned long long lastBusyNs = 0;
+		unsigned long long lastWaitNs = 0;
+		double throughput = 0;
+		double busy = 0;
+		double waiting = 0;
+	};
+
+	std::mutex mutex;
+	std::condition_variable changed;
+
+	std::vector<std::unique_ptr<Group>> groups;
+	std::vector<std::unique_ptr<Device>> devices;
+
+	std::thread controller;
+	bool stopping;
+
+	void ControlLoop();
+
+	/// <summary>
+	/// Measures the last interval and moves the slot count of each group, mutex must be held
+	/// </summary>
+	void Rebalance(double seconds);
+
+	void RunTest(Device* device);
+};
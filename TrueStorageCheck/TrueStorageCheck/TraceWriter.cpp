@@ -0,0 +1,150 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#include "TraceWriter.hpp"
+
+// Longest a record waits in memory before it's written out
+const std::chrono::milliseconds TRACE_FLUSH_INTERVAL(1000);
+
+// The writer is woken up early when this many records are waiting
+const size_t TRACE_BATCH_SIZE = 1024;
+
+static const char* GetPhaseName(TracePhase phase)
+{
+	switch (phase)
+	{
+	case TracePhase::Check:
+		return "check";
+	case TracePhase::Verify:
+		return "verify";
+	default:
+		return "write";
+	}
+}
+
+TraceWriter::TraceWriter() : file(nullptr), queued(0), written(0), flushRequested(false), stopping(false) {}
+
+TraceWriter::~TraceWriter()
+{
+	Close();
+}
+
+bool TraceWriter::Open(const std::string& path)
+{
+	Close();
+
+#ifdef _WIN32
+	if (fopen_s(&file, path.c_str(), "w") != 0)
+		file = nullptr;
+#else
+	file = fopen(path.c_str(), "w");
+#endif
+
+	if (file == nullptr)
+		return false;
+
+	fputs("time_s,phase,offset,bytes,duration_ms,speed_mbs\n", file);
+
+	start = std::chrono::steady_clock::now();
+	queued = written = 0;
+	flushRequested = stopping = false;
+
+	writer = std::thread(&TraceWriter::WriterLoop, this);
+
+	return true;
+}
+
+void TraceWriter::Add(TraceRecord record)
+{
+	if (file == nullptr)
+		return;
+
+	record.timeNs = (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+	bool wake;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pending.push_back(record);
+		queued++;
+
+		wake = pending.size() == TRACE_BATCH_SIZE;
+	}
+
+	if (wake)
+		changed.notify_all();
+}
+
+void TraceWriter::Flush()
+{
+	if (file == nullptr)
+		return;
+
+	std::unique_lock<std::mutex> lock(mutex);
+
+	unsigned long long target = queued;
+	flushRequested = true;
+
+	changed.notify_all();
+	changed.wait(lock, [&] { return written >= target; });
+}
+
+void TraceWriter::Close()
+{
+	if (file == nullptr)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+
+	changed.notify_all();
+	writer.join();
+
+	fclose(file);
+	file = nullptr;
+}
+
+void TraceWriter::WriterLoop()
+{
+	std::vector<TraceRecord> batch;
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (true)
+	{
+		changed.wait_for(lock, TRACE_FLUSH_INTERVAL, [&] { return stopping || flushRequested || pending.size() >= TRACE_BATCH_SIZE; });
+
+		flushRequested = false;
+
+		if (pending.empty())
+		{
+			if (stopping)
+				break;
+
+			continue;
+		}
+
+		// Formatting and writing is done without the lock, the test keeps adding in the meantime
+		batch.swap(pending);
+		lock.unlock();
+
+		for (const TraceRecord& record : batch)
+		{
+			double durationMs = record.durationNs / 1e6;
+			double speed = record.durationNs == 0 ? 0 : (record.bytes / (1024.0 * 1024.0)) / (record.durationNs / 1e9);
+
+			fprintf(file, "%.6f,%s,%llu,%llu,%.3f,%.2f\n", record.timeNs / 1e9, GetPhaseName(record.phase), record.offset, record.bytes, durationMs, speed);
+		}
+
+		fflush(file);
+
+		lock.lock();
+		written += batch.size();
+		batch.clear();
+
+		changed.notify_all();
+	}
+}
@@ -0,0 +1,103 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// <summary>
+/// What a traced chunk was part of
+/// </summary>
+enum class TracePhase
+{
+	// Writing the test data
+	Write = 0,
+	// Reading back while still writing (read speed sample, quick checks)
+	Check,
+	// Final verification
+	Verify
+};
+
+/// <summary>
+/// One chunk transferred by a test
+/// </summary>
+struct TraceRecord
+{
+	// Nanoseconds since the trace was opened, when the chunk finished
+	unsigned long long timeNs = 0;
+
+	TracePhase phase = TracePhase::Write;
+
+	// Position in everything written by the test (see TestFile::StreamOffset), the raw device offset for the destructive test
+	unsigned long long offset = 0;
+
+	unsigned long long bytes = 0;
+	unsigned long long durationNs = 0;
+};
+
+/// <summary>
+/// Streams a throughput vs offset trace to a CSV file on the host, one line per chunk
+/// </summary>
+/// <remarks>
+/// Add only appends to a buffer, the formatting and the file writes are done by a thread of its own so the trace
+/// doesn't get in the way of what it's measuring. Records reach the file within a second, or on Flush.
+/// </remarks>
+class TraceWriter
+{
+public:
+	TraceWriter();
+	~TraceWriter();
+
+	TraceWriter(const TraceWriter&) = delete;
+	TraceWriter& operator=(const TraceWriter&) = delete;
+
+	/// <summary>
+	/// Creates the trace file, replacing any previous one, and writes the header
+	/// </summary>
+	/// <param name="path">Trace path, on the host and not on the disk being tested</param>
+	/// <returns>False if the file couldn't be created</returns>
+	bool Open(const std::string& path);
+
+	/// <summary>
+	/// Queues a record, the time is filled in here
+	/// </summary>
+	void Add(TraceRecord record);
+
+	/// <summary>
+	/// Waits for every queued record to reach the file
+	/// </summary>
+	void Flush();
+
+	/// <summary>
+	/// Flushes and closes the file
+	/// </summary>
+	void Close();
+
+	bool IsOpen() const { return file != nullptr; }
+
+private:
+	FILE* file;
+	std::thread writer;
+
+	std::mutex mutex;
+	std::condition_variable changed;
+
+	// Records waiting for the writer, and the count it has written so far
+	std::vector<TraceRecord> pending;
+	unsigned long long queued;
+	unsigned long long written;
+	bool flushRequested;
+	bool stopping;
+
+	std::chrono::steady_clock::time_point start;
+
+	void WriterLoop();
+};
@@ -0,0 +1,300 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#include "UringIoQueue.hpp"
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "PosixIoBackend.hpp"
+
+static int SysSetup(unsigned entries, io_uring_params* params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int SysEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+static int SysRegister(int fd, unsigned opcode, const void* arg, unsigned count)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+/// <summary>
+/// Checks the ring takes the plain and fixed read and write opcodes, a ring that sets up isn't enough:
+/// IORING_OP_READ/WRITE only came with 5.6, before that every request would fail with EINVAL
+/// </summary>
+static bool SupportsReadWrite(int ringFd)
+{
+	const unsigned opCount = 256;
+	std::vector<unsigned char> probeData(sizeof(io_uring_probe) + opCount * sizeof(io_uring_probe_op), 0);
+	io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(probeData.data());
+
+	// The probe itself is a 5.6 addition, older kernels reject it
+	if (SysRegister(ringFd, IORING_REGISTER_PROBE, probe, opCount) != 0)
+		return false;
+
+	for (unsigned opcode : { IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED })
+	{
+		if (opcode >= probe->ops_len || (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) == 0)
+			return false;
+	}
+
+	return true;
+}
+
+UringIoQueue::UringIoQueue() : ringFd(-1), depth(0), sqRing(MAP_FAILED), sqRingSize(0), sqEntries(0), unsubmitted(0), sqes(nullptr), sqesSize(0), cqRing(MAP_FAILED), cqRingSize(0) {}
+
+std::unique_ptr<UringIoQueue> UringIoQueue::Create(unsigned int depth)
+{
+	std::unique_ptr<UringIoQueue> queue(new UringIoQueue());
+
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	queue->ringFd = SysSetup(depth, &params);
+
+	if (queue->ringFd < 0 || !SupportsReadWrite(queue->ringFd))
+		return nullptr;
+
+	queue->depth = depth;
+	queue->sqEntries = params.sq_entries;
+
+	// Map the rings, newer kernels share one mapping for both
+	queue->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	queue->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+	bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (singleMmap)
+		queue->sqRingSize = queue->cqRingSize = std::max(queue->sqRingSize, queue->cqRingSize);
+
+	queue->sqRing = mmap(nullptr, queue->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, queue->ringFd, IORING_OFF_SQ_RING);
+	if (queue->sqRing == MAP_FAILED)
+		return nullptr;
+
+	if (singleMmap)
+		queue->cqRing = queue->sqRing;
+	else
+	{
+		queue->cqRing = mmap(nullptr, queue->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, queue->ringFd, IORING_OFF_CQ_RING);
+		if (queue->cqRing == MAP_FAILED)
+			return nullptr;
+	}
+
+	queue->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	void* sqes = mmap(nullptr, queue->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, queue->ringFd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		return nullptr;
+	queue->sqes = static_cast<io_uring_sqe*>(sqes);
+
+	unsigned char* sq = static_cast<unsigned char*>(queue->sqRing);
+	queue->sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+	queue->sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+	queue->sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+	queue->sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+	unsigned char* cq = static_cast<unsigned char*>(queue->cqRing);
+	queue->cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+	queue->cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+	queue->cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+	queue->cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+	queue->slots.resize(depth);
+
+	return queue;
+}
+
+UringIoQueue::~UringIoQueue()
+{
+	if (sqes != nullptr)
+		munmap(sqes, sqesSize);
+
+	if (cqRing != MAP_FAILED && cqRing != sqRing)
+		munmap(cqRing, cqRingSize);
+
+	if (sqRing != MAP_FAILED)
+		munmap(sqRing, sqRingSize);
+
+	if (ringFd >= 0)
+		close(ringFd);
+}
+
+bool UringIoQueue::RegisterBuffers(const std::vector<std::pair<unsigned char*, size_t>>& buffers)
+{
+	if (!registeredBuffers.empty())
+	{
+		SysRegister(ringFd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+		registeredBuffers.clear();
+	}
+
+	std::vector<iovec> iovecs;
+	for (const auto& buffer : buffers)
+		iovecs.push_back({ buffer.first, buffer.second });
+
+	// Fails when the buffers don't fit in RLIMIT_MEMLOCK, we simply keep using normal requests then
+	if (iovecs.empty() || SysRegister(ringFd, IORING_REGISTER_BUFFERS, iovecs.data(), (unsigned)iovecs.size()) != 0)
+		return false;
+
+	registeredBuffers = buffers;
+
+	return true;
+}
+
+bool UringIoQueue::Queue(unsigned int slot)
+{
+	Slot& s = slots[slot];
+
+	PosixIoFile* file = dynamic_cast<PosixIoFile*>(s.request.file);
+	if (file == nullptr)
+		return false;
+
+	unsigned tail = *sqTail;
+
+	// No room in the ring, nothing has been published so the caller still owns the request
+	if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+		return false;
+
+	unsigned index = tail & *sqMask;
+	io_uring_sqe* sqe = &sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	unsigned char* pData = s.request.pData + s.done;
+	size_t size = s.request.size - s.done;
+
+	sqe->opcode = s.request.write ? IORING_OP_WRITE : IORING_OP_READ;
+
+	// Use the fixed variant if the data lives in one of the registered buffers
+	for (size_t i = 0; i < registeredBuffers.size(); i++)
+	{
+		const auto& buffer = registeredBuffers[i];
+
+		if (pData >= buffer.first && pData + size <= buffer.first + buffer.second)
+		{
+			sqe->opcode = s.request.write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+			sqe->buf_index = (unsigned short)i;
+			break;
+		}
+	}
+
+	sqe->fd = file->GetDescriptor();
+	sqe->off = s.request.offset + s.done;
+	sqe->addr = (unsigned long long)pData;
+	sqe->len = (unsigned)size;
+	sqe->user_data = slot;
+
+	sqArray[index] = index;
+
+	// Make the sqe visible before the kernel sees the new tail
+	__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+	// From here on the request is in flight, if the kernel can't take it right now the next Enter (or Reap) hands it over
+	unsubmitted++;
+	Enter(0);
+
+	return true;
+}
+
+bool UringIoQueue::Enter(unsigned int minComplete)
+{
+	int ret = SysEnter(ringFd, unsubmitted, minComplete, minComplete > 0 ? IORING_ENTER_GETEVENTS : 0);
+
+	if (ret < 0)
+		return errno == EINTR || errno == EAGAIN || errno == EBUSY;
+
+	unsubmitted -= std::min<unsigned>(unsubmitted, (unsigned)ret);
+
+	return true;
+}
+
+bool UringIoQueue::Submit(const IoRequest& request)
+{
+	for (unsigned int i = 0; i < slots.size(); i++)
+	{
+		if (slots[i].used)
+			continue;
+
+		slots[i].request = request;
+		slots[i].done = 0;
+		slots[i].used = true;
+
+		if (!Queue(i))
+		{
+			slots[i].used = false;
+			return false;
+		}
+
+		return true;
+	}
+
+	// Queue full
+	return false;
+}
+
+int UringIoQueue::Reap(IoCompletion* completions, int maxCompletions, int minCompletions)
+{
+	int count = 0;
+
+	// Requests the kernel couldn't take when they were queued
+	if (unsubmitted > 0)
+		Enter(0);
+
+	while (count < maxCompletions)
+	{
+		unsigned head = *cqHead;
+		unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+		if (head == tail)
+		{
+			if (count >= minCompletions)
+				break;
+
+			// What was already taken off the ring is handed back even if the ring broke
+			if (!Enter(1))
+				return count > 0 ? count : -1;
+
+			continue;
+		}
+
+		io_uring_cqe* cqe = &cqes[head & *cqMask];
+		unsigned int slot = (unsigned int)cqe->user_data;
+		int res = cqe->res;
+
+		__atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+
+		Slot& s = slots[slot];
+
+		// Short transfers are legal, queue the rest like pwrite/pread callers would
+		if (res > 0 && s.done + res < s.request.size)
+		{
+			s.done += res;
+
+			if (Queue(slot))
+				continue;
+
+			res = -EIO;
+		}
+
+		completions[count++] = { s.request.userData, res > 0 };
+		s.used = false;
+	}
+
+	return count;
+}
+
+#endif
@@ -0,0 +1,92 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#pragma once
+
+#ifdef __linux__
+
+#include <memory>
+#include <vector>
+
+#include "IoQueue.hpp"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/// <summary>
+/// io_uring queue for PosixIoBackend files, talks to the kernel directly so we don't need liburing
+/// </summary>
+class UringIoQueue : public IoQueue
+{
+public:
+	/// <summary>
+	/// Sets up the ring
+	/// </summary>
+	/// <returns>The queue, or nullptr if io_uring isn't available or lacks the read/write opcodes (kernel before 5.6, disabled, seccomp...)</returns>
+	static std::unique_ptr<UringIoQueue> Create(unsigned int depth);
+
+	~UringIoQueue();
+
+	const char* GetName() const override { return "io_uring"; }
+	unsigned int GetDepth() const override { return depth; }
+	bool IsAsynchronous() const override { return true; }
+
+	bool RegisterBuffers(const std::vector<std::pair<unsigned char*, size_t>>& buffers) override;
+	bool Submit(const IoRequest& request) override;
+	int Reap(IoCompletion* completions, int maxCompletions, int minCompletions) override;
+
+private:
+	UringIoQueue();
+
+	int ringFd;
+	unsigned int depth;
+
+	// Submission ring
+	void* sqRing;
+	size_t sqRingSize;
+	unsigned* sqHead;
+	unsigned* sqTail;
+	unsigned* sqMask;
+	unsigned* sqArray;
+	unsigned sqEntries;
+
+	// Published in the ring but not taken by the kernel yet, handed over by the next Enter
+	unsigned unsubmitted;
+	io_uring_sqe* sqes;
+	size_t sqesSize;
+
+	// Completion ring
+	void* cqRing;
+	size_t cqRingSize;
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned* cqMask;
+	io_uring_cqe* cqes;
+
+	// Requests in flight, indexed by the sqe user_data
+	struct Slot
+	{
+		IoRequest request;
+		size_t done;
+		bool used;
+	};
+	std::vector<Slot> slots;
+
+	std::vector<std::pair<unsigned char*, size_t>> registeredBuffers;
+
+	/// <summary>
+	/// Queues (or re-queues) the remaining part of a slot and tells the kernel about it
+	/// </summary>
+	/// <returns>False only if nothing was published, once it's in the ring the request is in flight even if the kernel didn't take it yet</returns>
+	bool Queue(unsigned int slot);
+
+	/// <summary>
+	/// Hands the unsubmitted sqes to the kernel and waits for minComplete completions
+	/// </summary>
+	/// <returns>False if the ring is unusable, a busy kernel (EAGAIN/EBUSY) just means trying again later</returns>
+	bool Enter(unsigned int minComplete);
+};
+
+#endif
@@ -0,0 +1,427 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#include "WinIoBackend.hpp"
+
+#ifdef _WIN32
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <thread>
+#include <vector>
+#include <winioctl.h>
+#include <setupapi.h>
+#include <cfgmgr32.h>
+
+WinIoFile::WinIoFile(HANDLE hFile, std::vector<HANDLE> lockedVolumes) : hFile(hFile), lockedVolumes(std::move(lockedVolumes)) {}
+
+WinIoFile::~WinIoFile()
+{
+	if (hFile != INVALID_HANDLE_VALUE)
+		::CloseHandle(hFile);
+
+	for (HANDLE hVolume : lockedVolumes)
+		::CloseHandle(hVolume);
+}
+
+bool WinIoFile::Read(unsigned long long offset, void* pData, size_t size)
+{
+	// Synchronous handle, the OVERLAPPED is only used to pass the position
+	OVERLAPPED overlapped = {};
+	overlapped.Offset = (DWORD)(offset & 0xFFFFFFFF);
+	overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+	unsigned long bytesRead = 0;
+
+	return ::ReadFile(hFile, pData, (DWORD)size, &bytesRead, &overlapped) && bytesRead == size;
+}
+
+bool WinIoFile::Write(unsigned long long offset, const void* pData, size_t size)
+{
+	OVERLAPPED overlapped = {};
+	overlapped.Offset = (DWORD)(offset & 0xFFFFFFFF);
+	overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+	unsigned long bytesWritten = 0;
+
+	return ::WriteFile(hFile, pData, (DWORD)size, &bytesWritten, &overlapped) && bytesWritten == size;
+}
+
+bool WinIoFile::Flush()
+{
+	return ::FlushFileBuffers(hFile);
+}
+
+unsigned long long WinIoFile::GetSize()
+{
+	LARGE_INTEGER fSize;
+
+	if (::GetFileSizeEx(hFile, &fSize))
+		return fSize.QuadPart;
+
+	// Volume handles have no file size, ask the driver
+	GET_LENGTH_INFORMATION lengthInfo;
+	unsigned long bytesReturned = 0;
+
+	if (::DeviceIoControl(hFile, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &lengthInfo, sizeof(lengthInfo), &bytesReturned, NULL))
+		return lengthInfo.Length.QuadPart;
+
+	return 0;
+}
+
+bool WinIoFile::Reserve(unsigned long long size)
+{
+	// Allocates the clusters but leaves the end of file (and valid data length) alone, writing sequentially
+	// moves them along without zero filling anything, unlike SetEndOfFile without SetFileValidData
+	FILE_ALLOCATION_INFO allocationInfo;
+	allocationInfo.AllocationSize.QuadPart = (LONGLONG)size;
+
+	return ::SetFileInformationByHandle(hFile, FileAllocationInfo, &allocationInfo, sizeof(allocationInfo));
+}
+
+void WinIoFile::CancelPending()
+{
+	// Also cancels synchronous requests made by other threads on the handle, they fail with ERROR_OPERATION_ABORTED
+	::CancelIoEx(hFile, NULL);
+}
+
+std::unique_ptr<IoFile> WinIoBackend::Open(const std::string& path, IoOpenMode mode)
+{
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+
+	// FILE_FLAG_NO_BUFFERING is important
+	switch (mode)
+	{
+	case IoOpenMode::CreateAlways:
+		hFile = ::CreateFileA(path.c_str(), FILE_READ_DATA | FILE_WRITE_DATA, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH, NULL);
+		break;
+	case IoOpenMode::OpenExisting:
+		hFile = ::CreateFileA(path.c_str(), FILE_READ_DATA | FILE_WRITE_DATA, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH, NULL);
+		break;
+	case IoOpenMode::ReadOnly:
+		hFile = ::CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, NULL);
+		break;
+	}
+
+	if (hFile == INVALID_HANDLE_VALUE)
+		return nullptr;
+
+	return std::make_unique<WinIoFile>(hFile);
+}
+
+bool WinIoBackend::MakeDirectory(const std::string& path)
+{
+	return ::CreateDirectoryA(path.c_str(), nullptr) || ::GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
+void WinIoBackend::RemoveTree(const std::string& path)
+{
+	if (std::filesystem::exists(path) && std::filesystem::is_directory(path)) {
+		try {
+			std::filesystem::remove_all(path);
+
+			// Removal succeeded, now flush any cached data
+			HANDLE handle = ::CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+			if (handle != INVALID_HANDLE_VALUE) {
+				::FlushFileBuffers(handle);
+				::CloseHandle(handle);
+			}
+		}
+		catch (const std::exception&) {}
+	}
+}
+
+bool WinIoBackend::RemoveFile(const std::string& path)
+{
+	return ::DeleteFileA(path.c_str()) || ::GetLastError() == ERROR_FILE_NOT_FOUND;
+}
+
+bool WinIoBackend::GetDiskSpace(const std::string& path, unsigned long long* totalSpace, unsigned long long* freeSpace)
+{
+	unsigned long long availableSpace;
+
+	if (::GetDiskFreeSpaceExA(path.c_str(), (PULARGE_INTEGER)&availableSpace, (PULARGE_INTEGER)totalSpace, (PULARGE_INTEGER)freeSpace) == 0)
+		return false;
+	else
+		return true;
+}
+
+unsigned long WinIoBackend::GetDataBlockSize(const std::string& path)
+{
+	unsigned long sectorsPerCluster;
+	unsigned long bytesPerSector;
+	unsigned long numberOfFreeClusters;
+	unsigned long totalNumberOfClusters;
+
+	if (::GetDiskFreeSpaceA(path.c_str(), &sectorsPerCluster, &bytesPerSector, &numberOfFreeClusters, &totalNumberOfClusters)) {
+		return sectorsPerCluster * bytesPerSector;
+	}
+	else {
+		return 0;
+	}
+}
+
+unsigned long long WinIoBackend::GetMaxFileSize(const std::string& path)
+{
+	char volumePath[MAX_PATH];
+	char fileSystemName[MAX_PATH];
+
+	if (!::GetVolumePathNameA(path.c_str(), volumePath, MAX_PATH) || !::GetVolumeInformationA(volumePath, NULL, 0, NULL, NULL, NULL, fileSystemName, MAX_PATH))
+		return 0;
+
+	// FAT and FAT32 keep the file size in 32 bits, exFAT doesn't
+	if (strcmp(fileSystemName, "FAT") == 0 || strcmp(fileSystemName, "FAT32") == 0)
+		return 0xFFFFFFFFull;
+
+	return 0;
+}
+
+/// <summary>
+/// Gets the disk (or CD-ROM, ...) number a volume or disk lives on
+/// </summary>
+static bool GetStorageDeviceNumber(const char* path, STORAGE_DEVICE_NUMBER* number)
+{
+	HANDLE hDevice = ::CreateFileA(path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+
+	if (hDevice == INVALID_HANDLE_VALUE)
+		return false;
+
+	unsigned long bytesReturned = 0;
+	bool success = ::DeviceIoControl(hDevice, IOCTL_STORAGE_GET_DEVICE_NUMBER, NULL, 0, number, sizeof(*number), &bytesReturned, NULL);
+
+	::CloseHandle(hDevice);
+	return success;
+}
+
+std::string WinIoBackend::GetDevicePath(const std::string& path)
+{
+	const std::string PHYSICAL_DRIVE = "\\\\.\\PhysicalDrive";
+
+	// Already a disk
+	if (path.compare(0, PHYSICAL_DRIVE.size(), PHYSICAL_DRIVE) == 0)
+		return path;
+
+	// Otherwise a drive root, E:\ is the volume \\.\E: which lives on a partition of some disk
+	if (path.size() < 2 || path[1] != ':')
+		return "";
+
+	STORAGE_DEVICE_NUMBER number;
+
+	if (!GetStorageDeviceNumber((std::string("\\\\.\\") + path[0] + ":").c_str(), &number) || number.DeviceType != FILE_DEVICE_DISK)
+		return "";
+
+	// Raw access covers the whole disk including the partition table, not just the partition
+	return PHYSICAL_DRIVE + std::to_string(number.DeviceNumber);
+}
+
+/// <summary>
+/// Locks every volume with a partition on the given disk, and dismounts it if asked to
+/// </summary>
+/// <returns>False if a volume couldn't be locked, the handles of the ones that were are left in volumes to be closed</returns>
+static bool LockDiskVolumes(DWORD diskNumber, bool dismount, std::vector<HANDLE>& volumes)
+{
+	char volumeName[MAX_PATH];
+	HANDLE hFind = ::FindFirstVolumeA(volumeName, MAX_PATH);
+
+	if (hFind == INVALID_HANDLE_VALUE)
+		return true;
+
+	bool success = true;
+
+	do
+	{
+		// \\?\Volume{GUID}\ without the trailing backslash opens the volume rather than its root directory
+		std::string volumePath = volumeName;
+
+		if (!volumePath.empty() && volumePath.back() == '\\')
+			volumePath.pop_back();
+
+		STORAGE_DEVICE_NUMBER number;
+
+		if (!GetStorageDeviceNumber(volumePath.c_str(), &number) || number.DeviceType != FILE_DEVICE_DISK || number.DeviceNumber != diskNumber)
+			continue;
+
+		HANDLE hVolume = ::CreateFileA(volumePath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+
+		if (hVolume == INVALID_HANDLE_VALUE)
+		{
+			success = false;
+			break;
+		}
+
+		volumes.push_back(hVolume);
+
+		unsigned long bytesReturned = 0;
+		bool locked = false;
+
+		// Explorer and friends like to keep handles open for a moment after we are done with the files, retry a few times
+		for (int i = 0; i < 10 && !locked; i++)
+		{
+			locked = ::DeviceIoControl(hVolume, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0, &bytesReturned, NULL);
+
+			if (!locked)
+				std::this_thread::sleep_for(std::chrono::milliseconds(500));
+		}
+
+		// Either is enough for Windows to allow writes to the sectors the volume owns. A locked volume that
+		// isn't dismounted carries on as it was once unlocked, as long as whatever we write there is put back
+		if (!locked || (dismount && !::DeviceIoControl(hVolume, FSCTL_DISMOUNT_VOLUME, NULL, 0, NULL, 0, &bytesReturned, NULL)))
+		{
+			success = false;
+			break;
+		}
+
+	} while (::FindNextVolumeA(hFind, volumeName, MAX_PATH));
+
+	::FindVolumeClose(hFind);
+
+	return success;
+}
+
+std::unique_ptr<IoFile> WinIoBackend::OpenDevice(const std::string& devicePath, unsigned long long* size, unsigned long* sectorSize, DeviceAccess access)
+{
+	STORAGE_DEVICE_NUMBER number;
+
+	if (!GetStorageDeviceNumber(devicePath.c_str(), &number))
+		return nullptr;
+
+	std::vector<HANDLE> volumes;
+
+	if (!LockDiskVolumes(number.DeviceNumber, access == DeviceAccess::Dismount, volumes))
+	{
+		for (HANDLE hVolume : volumes)
+			::CloseHandle(hVolume);
+
+		return nullptr;
+	}
+
+	HANDLE hDevice = ::CreateFileA(devicePath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH, NULL);
+
+	if (hDevice == INVALID_HANDLE_VALUE)
+	{
+		for (HANDLE hVolume : volumes)
+			::CloseHandle(hVolume);
+
+		return nullptr;
+	}
+
+	// From here on the handles are owned by the file, they are closed (and the volumes unlocked) when it goes away
+	std::unique_ptr<WinIoFile> device = std::make_unique<WinIoFile>(hDevice, std::move(volumes));
+
+	unsigned long bytesReturned = 0;
+
+	DISK_GEOMETRY geometry;
+
+	if (!::DeviceIoControl(hDevice, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0, &geometry, sizeof(geometry), &bytesReturned, NULL))
+		return nullptr;
+
+	*size = device->GetSize();
+	*sectorSize = geometry.BytesPerSector;
+
+	if (*size == 0)
+		return nullptr;
+
+	return device;
+}
+
+// GUID_DEVINTERFACE_DISK, spelled out so we don't depend on initguid.h being included in the right place
+static const GUID DISK_INTERFACE_GUID = { 0x53f56307, 0xb6bf, 0x11d0, { 0x94, 0xf2, 0x00, 0xa0, 0xc9, 0x1e, 0xfb, 0x8b } };
+
+/// <summary>
+/// Finds the device tree node of a disk, or of the disk a volume lives on
+/// </summary>
+static DEVINST FindDiskNode(const std::string& devicePath)
+{
+	STORAGE_DEVICE_NUMBER volumeNumber;
+
+	if (!GetStorageDeviceNumber(devicePath.c_str(), &volumeNumber))
+		return 0;
+
+	HDEVINFO deviceInfo = ::SetupDiGetClassDevsA(&DISK_INTERFACE_GUID, NULL, NULL, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
+
+	if (deviceInfo == INVALID_HANDLE_VALUE)
+		return 0;
+
+	DEVINST diskNode = 0;
+
+	SP_DEVICE_INTERFACE_DATA interfaceData = {};
+	interfaceData.cbSize = sizeof(interfaceData);
+
+	for (DWORD i = 0; diskNode == 0 && ::SetupDiEnumDeviceInterfaces(deviceInfo, NULL, &DISK_INTERFACE_GUID, i, &interfaceData); i++)
+	{
+		DWORD requiredSize = 0;
+		::SetupDiGetDeviceInterfaceDetailA(deviceInfo, &interfaceData, NULL, 0, &requiredSize, NULL);
+
+		if (requiredSize < sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_A))
+			continue;
+
+		std::vector<char> buffer(requiredSize);
+		SP_DEVICE_INTERFACE_DETAIL_DATA_A* detail = reinterpret_cast<SP_DEVICE_INTERFACE_DETAIL_DATA_A*>(buffer.data());
+		detail->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_A);
+
+		SP_DEVINFO_DATA deviceData = {};
+		deviceData.cbSize = sizeof(deviceData);
+
+		if (!::SetupDiGetDeviceInterfaceDetailA(deviceInfo, &interfaceData, detail, requiredSize, NULL, &deviceData))
+			continue;
+
+		STORAGE_DEVICE_NUMBER diskNumber;
+
+		if (GetStorageDeviceNumber(detail->DevicePath, &diskNumber) && diskNumber.DeviceType == volumeNumber.DeviceType && diskNumber.DeviceNumber == volumeNumber.DeviceNumber)
+			diskNode = deviceData.DevInst;
+	}
+
+	::SetupDiDestroyDeviceInfoList(deviceInfo);
+
+	return diskNode;
+}
+
+std::string WinIoBackend::GetBusGroup(const std::string& path)
+{
+	std::string devicePath = GetDevicePath(path);
+
+	if (devicePath.empty())
+		return "";
+
+	DEVINST node = FindDiskNode(devicePath);
+
+	if (node == 0)
+		return "";
+
+	// Walk up the device tree, a USB disk goes disk -> USB device -> hubs -> root hub -> host controller
+	char instanceId[MAX_DEVICE_ID_LEN];
+	std::string childId;
+	std::string controller;
+	DEVINST parent;
+
+	if (::CM_Get_Device_IDA(node, instanceId, MAX_DEVICE_ID_LEN, 0) == CR_SUCCESS)
+		childId = instanceId;
+
+	while (::CM_Get_Parent(&parent, node, 0) == CR_SUCCESS && ::CM_Get_Device_IDA(parent, instanceId, MAX_DEVICE_ID_LEN, 0) == CR_SUCCESS)
+	{
+		std::string id = instanceId;
+
+		// Whatever is plugged into the root port (the stick itself or a hub) and everything under it share that one link
+		if (id.compare(0, 12, "USB\\ROOT_HUB") == 0)
+			return "usb:" + childId;
+
+		// Otherwise the closest PCI device is the controller, every SATA port of an AHCI controller shares it
+		if (controller.empty() && id.compare(0, 4, "PCI\\") == 0)
+			controller = id;
+
+		childId = id;
+		node = parent;
+	}
+
+	return controller.empty() ? "" : "pci:" + controller;
+}
+
+std::shared_ptr<IoBackend> IoBackend::CreateNative()
+{
+	return std::make_shared<WinIoBackend>();
+}
+
+#endif
@@ -0,0 +1,58 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#pragma once
+
+#ifdef _WIN32
+
+#include "Platform.hpp"
+#include "IoBackend.hpp"
+
+#include <vector>
+
+/// <summary>
+/// File opened with FILE_FLAG_NO_BUFFERING
+/// </summary>
+class WinIoFile : public IoFile
+{
+public:
+	/// <param name="hFile">Opened handle, we take ownership</param>
+	/// <param name="lockedVolumes">Locked volumes of a disk opened for raw access, closed (and so unlocked) after the disk</param>
+	WinIoFile(HANDLE hFile, std::vector<HANDLE> lockedVolumes = {});
+	~WinIoFile();
+
+	bool Read(unsigned long long offset, void* pData, size_t size) override;
+	bool Write(unsigned long long offset, const void* pData, size_t size) override;
+	bool Flush() override;
+	unsigned long long GetSize() override;
+	bool Reserve(unsigned long long size) override;
+	void CancelPending() override;
+
+private:
+	HANDLE hFile;
+	std::vector<HANDLE> lockedVolumes;
+};
+
+/// <summary>
+/// Native Windows backend (CreateFile/ReadFile/WriteFile)
+/// </summary>
+class WinIoBackend : public IoBackend
+{
+public:
+	const char* GetName() const override { return "win32"; }
+
+	std::unique_ptr<IoFile> Open(const std::string& path, IoOpenMode mode) override;
+	bool MakeDirectory(const std::string& path) override;
+	void RemoveTree(const std::string& path) override;
+	bool RemoveFile(const std::string& path) override;
+	bool GetDiskSpace(const std::string& path, unsigned long long* totalSpace, unsigned long long* freeSpace) override;
+	unsigned long GetDataBlockSize(const std::string& path) override;
+	unsigned long long GetMaxFileSize(const std::string& path) override;
+	std::string GetDevicePath(const std::string& path) override;
+	std::unique_ptr<IoFile> OpenDevice(const std::string& devicePath, unsigned long long* size, unsigned long* sectorSize, DeviceAccess access) override;
+	std::string GetBusGroup(const std::string& path) override;
+};
+
+#endif
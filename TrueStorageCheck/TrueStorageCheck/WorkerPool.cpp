@@ -0,0 +1,169 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#include "WorkerPool.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+// Index of the queue owned by the current thread, or -1 if it isn't one of our workers
+static thread_local size_t workerIndex = (size_t)-1;
+
+WorkerPool& WorkerPool::Instance()
+{
+	// Never destroyed on purpose, joining threads while the DLL is being unloaded is asking for a deadlock
+	static WorkerPool* pool = new WorkerPool(std::max<size_t>(1, std::thread::hardware_concurrency()));
+	return *pool;
+}
+
+WorkerPool::WorkerPool(size_t threadCount) : nextQueue(0), queuedTasks(0), stopping(false)
+{
+	for (size_t i = 0; i < threadCount; i++)
+		queues.push_back(std::make_unique<Queue>());
+
+	for (size_t i = 0; i < threadCount; i++)
+		threads.push_back(std::thread(&WorkerPool::WorkerLoop, this, i));
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		stopping = true;
+	}
+
+	wakeUp.notify_all();
+
+	for (auto& thread : threads)
+		thread.join();
+}
+
+void WorkerPool::Submit(TaskGroup& group, std::function<void()> task)
+{
+	group.pending.fetch_add(1, std::memory_order_relaxed);
+
+	// Workers push to their own queue, everyone else spreads the tasks around
+	size_t index = workerIndex != (size_t)-1 ? workerIndex : nextQueue.fetch_add(1, std::memory_order_relaxed) % queues.size();
+
+	{
+		std::lock_guard<std::mutex> lock(queues[index]->mutex);
+		queues[index]->tasks.push_back({ std::move(task), &group });
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		queuedTasks.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	wakeUp.notify_one();
+}
+
+void WorkerPool::Run(Task& task)
+{
+	task.fn();
+
+	TaskGroup* group = task.group;
+
+	// Under the lock so the waiter can't miss the notification, or destroy the group while we still use it
+	std::lock_guard<std::mutex> lock(group->mutex);
+
+	if (group->pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		group->done.notify_all();
+}
+
+bool WorkerPool::TryRunOne(size_t preferredQueue)
+{
+	size_t count = queues.size();
+
+	for (size_t i = 0; i < count; i++)
+	{
+		size_t index = (preferredQueue + i) % count;
+		Queue& queue = *queues[index];
+
+		Task task;
+
+		{
+			std::lock_guard<std::mutex> lock(queue.mutex);
+
+			if (queue.tasks.empty())
+				continue;
+
+			// Newest from our own queue (still hot in cache), oldest when stealing
+			if (index == workerIndex)
+			{
+				task = std::move(queue.tasks.back());
+				queue.tasks.pop_back();
+			}
+			else
+			{
+				task = std::move(queue.tasks.front());
+				queue.tasks.pop_front();
+			}
+		}
+
+		queuedTasks.fetch_sub(1, std::memory_order_relaxed);
+		Run(task);
+
+		return true;
+	}
+
+	return false;
+}
+
+void WorkerPool::WorkerLoop(size_t index)
+{
+	workerIndex = index;
+
+	while (true)
+	{
+		if (TryRunOne(index))
+			continue;
+
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		wakeUp.wait(lock, [this] { return stopping || queuedTasks.load(std::memory_order_relaxed) > 0; });
+
+		if (stopping)
+			return;
+	}
+}
+
+void WorkerPool::Wait(TaskGroup& group)
+{
+	size_t preferred = workerIndex != (size_t)-1 ? workerIndex : 0;
+
+	while (!group.IsDone())
+	{
+		// Help instead of sitting idle, whatever we run is work someone is waiting for
+		if (TryRunOne(preferred))
+			continue;
+
+		// Nothing left to steal, the remaining tasks are already running
+		std::unique_lock<std::mutex> lock(group.mutex);
+		group.done.wait_for(lock, std::chrono::milliseconds(1), [&group] { return group.IsDone(); });
+	}
+
+	// The last task may still be holding the lock it used to notify us
+	std::lock_guard<std::mutex> lock(group.mutex);
+}
+
+void WorkerPool::ParallelFor(size_t count, const std::function<void(size_t)>& fn)
+{
+	if (count == 0)
+		return;
+
+	// Not worth a round trip through the queues
+	if (count == 1)
+	{
+		fn(0);
+		return;
+	}
+
+	TaskGroup group;
+
+	for (size_t i = 0; i < count; i++)
+		Submit(group, [&fn, i] { fn(i); });
+
+	Wait(group);
+}
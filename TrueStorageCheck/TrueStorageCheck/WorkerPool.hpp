@@ -0,0 +1,113 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// <summary>
+/// A set of tasks submitted together that can be waited on
+/// </summary>
+class TaskGroup
+{
+public:
+	TaskGroup() : pending(0) {}
+
+	TaskGroup(const TaskGroup&) = delete;
+	TaskGroup& operator=(const TaskGroup&) = delete;
+
+	/// <summary>
+	/// True if every task of the group has finished
+	/// </summary>
+	bool IsDone() const { return pending.load(std::memory_order_acquire) == 0; }
+
+private:
+	friend class WorkerPool;
+
+	std::atomic<size_t> pending;
+	std::mutex mutex;
+	std::condition_variable done;
+};
+
+/// <summary>
+/// Process wide pool of long lived worker threads, shared by every DiskTest instance
+/// </summary>
+/// <remarks>
+/// Each worker has its own queue and steals from the others when it runs dry. Threads waiting on a
+/// group help running tasks instead of blocking, so the number of threads generating data is bounded by
+/// the pool size plus the callers, no matter how many devices are being tested.
+/// </remarks>
+class WorkerPool
+{
+public:
+	/// <summary>
+	/// Gets the process wide pool, created on first use with one worker per hardware thread
+	/// </summary>
+	static WorkerPool& Instance();
+
+	/// <summary>
+	/// Queues a task
+	/// </summary>
+	void Submit(TaskGroup& group, std::function<void()> task);
+
+	/// <summary>
+	/// Waits for all tasks of the group, running queued tasks in the meantime
+	/// </summary>
+	void Wait(TaskGroup& group);
+
+	/// <summary>
+	/// Runs fn(0) ... fn(count - 1) on the pool and waits for them
+	/// </summary>
+	void ParallelFor(size_t count, const std::function<void(size_t)>& fn);
+
+	/// <summary>
+	/// Number of worker threads
+	/// </summary>
+	size_t GetThreadCount() const { return threads.size(); }
+
+private:
+	WorkerPool(size_t threadCount);
+	~WorkerPool();
+
+	struct Task
+	{
+		std::function<void()> fn;
+		TaskGroup* group;
+	};
+
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	std::vector<std::unique_ptr<Queue>> queues;
+	std::vector<std::thread> threads;
+
+	// Round robin for tasks submitted from outside the pool
+	std::atomic<size_t> nextQueue;
+
+	// Idle workers sleep here
+	std::mutex sleepMutex;
+	std::condition_variable wakeUp;
+	std::atomic<size_t> queuedTasks;
+	bool stopping;
+
+	void WorkerLoop(size_t index);
+
+	/// <summary>
+	/// Pops a task from our own queue, or steals one from another
+	/// </summary>
+	bool TryRunOne(size_t preferredQueue);
+
+	void Run(Task& task);
+};
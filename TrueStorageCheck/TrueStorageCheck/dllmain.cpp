@@ -4,24 +4,35 @@
  * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
  */
 // dllmain.cpp : Defines the entry point for the DLL application.
-#include <windows.h>
+#include "Platform.hpp"
 #include <vector>
 #include <string>
-#include <windows.h>
+#include <cstring>
+#include <algorithm>
+#ifdef _WIN32
 #include <setupapi.h>
 #include <devguid.h>
 #include <initguid.h>
 #include <cfgmgr32.h>
+#endif
 #include "DiskTest.hpp"
+#include "FakeFlashBackend.hpp"
+#include "TestScheduler.hpp"
 
 // Lazy me
+#ifdef _WIN32
 #define EXPORT_C extern "C" __declspec(dllexport)
+#else
+#define EXPORT_C extern "C" __attribute__((visibility("default")))
+#endif
 #define WRAP(expression) { return expression; }
 
 // DLL Version
 #define DLL_VERSION_MAJOR int(0x0)
 #define DLL_VERSION_MINOR int(0x10)
 
+#ifdef _WIN32
+
 BOOL APIENTRY DllMain(HMODULE hModule,
 	DWORD  ul_reason_for_call,
 	LPVOID lpReserved
@@ -135,6 +146,8 @@ EXPORT_C int GetDevices(bool includeLocalDisks, DeviceInfo **devices)
 	return deviceCount;
 }
 
+#endif
+
 EXPORT_C int GetMajorVersion() {
 	return DLL_VERSION_MAJOR;
 }
@@ -146,30 +159,297 @@ EXPORT_C int GetMinorVersion() {
 /// Just in case someone asks "Why didn't you do it in C++/CLI?!"
 /// Because I like my programming languages like I like my coffee. Without unnecessary complexity.
 
+#ifdef _MSC_VER
 #pragma region ExternadoAficionado
+#endif
 
 EXPORT_C DiskTest * DiskTest_Create(char driveLetter, unsigned long long capacityToTest, bool stopOnFirstError, bool deleteTempFiles, bool writeLogFile, DiskTest::ProgressDelegate callback)
 {
 	return new DiskTest(driveLetter, capacityToTest, stopOnFirstError, deleteTempFiles, writeLogFile, callback);
 }
 
+// Same as DiskTest_Create but takes a full path, used on Linux where there are no drive letters
+EXPORT_C DiskTest * DiskTest_CreateWithPath(const char* path, unsigned long long capacityToTest, bool stopOnFirstError, bool deleteTempFiles, bool writeLogFile, DiskTest::ProgressDelegate callback)
+{
+	return new DiskTest(std::string(path), capacityToTest, stopOnFirstError, deleteTempFiles, writeLogFile, callback);
+}
+
 EXPORT_C void DiskTest_Destroy(DiskTest* instance) {
 
+	TestScheduler::Instance().Remove(instance);
+
 	instance->Dispose();
 	delete instance;
 }
 
 // Bool seems to be non-blittable type and can't be used as a return value
 EXPORT_C byte DiskTest_PerformTest(DiskTest* instance) WRAP(instance->PerformTest())
+EXPORT_C byte DiskTest_PerformVerifyOnly(DiskTest* instance) WRAP(instance->PerformVerifyOnly())
 EXPORT_C byte DiskTest_PerformDestructiveTest(DiskTest* instance) WRAP(instance->PerformDestructiveTest())
+EXPORT_C byte DiskTest_PerformCapacityProbe(DiskTest* instance) WRAP(instance->PerformCapacityProbe())
+EXPORT_C void DiskTest_GetProbeCapacityBounds(DiskTest* instance, unsigned long long* lowerBound, unsigned long long* upperBound) WRAP(instance->GetProbeCapacityBounds(lowerBound, upperBound))
 EXPORT_C byte DiskTest_ForceStopTest(DiskTest* instance) WRAP(instance->ForceStopTest())
+
+/// <summary>
+/// Runs a test on a thread of its own, so the caller doesn't have to dedicate one to it
+/// </summary>
+/// <param name="kind">0 - Normal test, 1 - Destructive test, 2 - Capacity probe, 3 - Verify only</param>
+/// <returns>False if a test was already started</returns>
+EXPORT_C byte DiskTest_StartAsync(DiskTest* instance, int kind) WRAP(instance->StartAsync((TestKind)kind))
+
+// Waits up to timeoutMs (0xFFFFFFFF for ever) for the test to end, false on timeout. Cancel stops it from any thread, in-flight I/O included
+EXPORT_C byte DiskTest_Wait(DiskTest* instance, unsigned int timeoutMs) WRAP(instance->Wait(timeoutMs))
+EXPORT_C byte DiskTest_Cancel(DiskTest* instance) WRAP(instance->ForceStopTest())
 EXPORT_C int DiskTest_GetTestState(DiskTest* instance) WRAP(instance->GetTestState())
 EXPORT_C int DiskTest_GetTestProgress(DiskTest* instance) WRAP(instance->GetTestProgress())
-EXPORT_C int DiskTest_GetLastSuccessfulVerifyPosition(DiskTest* instance) WRAP(instance->GetLastSuccessfulVerifyPosition())
+EXPORT_C unsigned long long DiskTest_GetLastSuccessfulVerifyPosition(DiskTest* instance) WRAP(instance->GetLastSuccessfulVerifyPosition())
 EXPORT_C double DiskTest_GetAverageWriteSpeed(DiskTest* instance) WRAP(instance->GetAverageWriteSpeed())
 EXPORT_C double DiskTest_GetAverageReadSpeed(DiskTest* instance) WRAP(instance->GetAverageReadSpeed())
 EXPORT_C long DiskTest_GetTimeRemaining(DiskTest* instance) WRAP(instance->GetTimeRemaining())
 EXPORT_C byte DiskTest_IsDiskEmpty(DiskTest* instance) WRAP(instance->IsDiskEmpty())
 EXPORT_C void DiskTest_DeleteTestFiles(DiskTest* instance) WRAP(instance->DeleteTestFiles())
+EXPORT_C void DiskTest_SetIoQueueDepth(DiskTest* instance, unsigned int depth) WRAP(instance->SetIoQueueDepth(depth))
+EXPORT_C void DiskTest_SetIoRequestSize(DiskTest* instance, unsigned long long size) WRAP(instance->SetIoRequestSize(size))
+EXPORT_C void DiskTest_SetIoAutoTune(DiskTest* instance, bool enabled) WRAP(instance->SetIoAutoTune(enabled))
+EXPORT_C byte DiskTest_GetIoTuning(DiskTest* instance, unsigned long long* requestSize, unsigned int* queueDepth, double* speed) WRAP(instance->GetIoTuning(requestSize, queueDepth, speed))
+EXPORT_C void DiskTest_SetVerifyReaders(DiskTest* instance, unsigned int readers) WRAP(instance->SetVerifyReaders(readers))
+EXPORT_C void DiskTest_SetTestFileSize(DiskTest* instance, unsigned long long size) WRAP(instance->SetTestFileSize(size))
+
+EXPORT_C void DiskTest_SetJournalPath(DiskTest* instance, const char* path) WRAP(instance->SetJournalPath(path != nullptr ? std::string(path) : std::string()))
+EXPORT_C byte DiskTest_CanResume(DiskTest* instance) WRAP(instance->CanResume())
+EXPORT_C byte DiskTest_SetTraceFile(DiskTest* instance, const char* path) WRAP(instance->SetTraceFile(path != nullptr ? std::string(path) : std::string()))
+
+EXPORT_C void DiskTest_SetSectorTagging(DiskTest* instance, bool enabled) WRAP(instance->SetSectorTagging(enabled))
+
+/// <summary>
+/// Gets what the verification found out about a fake device, only filled when sector tagging is enabled
+/// </summary>
+/// <param name="realCapacity">Estimated real capacity in bytes</param>
+/// <param name="wrapModulus">Distance at which the device wraps around in bytes, 0 if it doesn't</param>
+/// <param name="aliasedSectors">Sectors that held the data of another address</param>
+/// <param name="lostSectors">Sectors that held no valid data at all</param>
+/// <returns>True if any bad sector was found</returns>
+EXPORT_C byte DiskTest_GetAliasMap(DiskTest* instance, unsigned long long* realCapacity, unsigned long long* wrapModulus, unsigned long long* aliasedSectors, unsigned long long* lostSectors)
+{
+	const AliasMap& aliasMap = instance->GetAliasMap();
+
+	*realCapacity = aliasMap.GetRealCapacity();
+	*wrapModulus = aliasMap.GetWrapModulus();
+	*aliasedSectors = aliasMap.GetAliasedSectors();
+	*lostSectors = aliasMap.GetLostSectors();
+
+	return aliasMap.GetAliasedSectors() + aliasMap.GetLostSectors() != 0;
+}
+
+/// <summary>
+/// Gets the memory used by the I/O buffers of a test
+/// </summary>
+/// <param name="reservedBytes">Memory held for the I/O buffers right now (the steady state while a test runs)</param>
+/// <param name="peakBytes">Most memory ever held for the I/O buffers</param>
+/// <param name="backing">0 - Nothing allocated, 1 - Normal pages, 2 - Transparent huge pages, 3 - Huge/large pages</param>
+EXPORT_C void DiskTest_GetBufferStats(DiskTest* instance, unsigned long long* reservedBytes, unsigned long long* peakBytes, int* backing)
+{
+	BufferArenaStats stats = instance->GetBufferStats();
+
+	*reservedBytes = stats.reservedBytes;
+	*peakBytes = stats.peakReservedBytes;
+	*backing = (int)stats.backing;
+}
+
+/// <summary>
+/// Takes the oldest progress events of a test, instead of (or as well as) the progress callback
+/// </summary>
+/// <remarks>Events are queued without ever holding up the test, only one thread may poll a test</remarks>
+/// <param name="buffer">Receives the events</param>
+/// <param name="maxEvents">Size of the buffer</param>
+/// <returns>Number of events stored</returns>
+EXPORT_C int DiskTest_PollEvents(DiskTest* instance, TestEvent* buffer, int maxEvents) WRAP((int)instance->PollEvents(buffer, (size_t)std::max(maxEvents, 0)))
+
+/// <summary>
+/// Gets the latest progress of a test, every field from the same moment
+/// </summary>
+EXPORT_C void DiskTest_GetSnapshot(DiskTest* instance, TestEvent* snapshot) { *snapshot = instance->GetSnapshot(); }
+
+/// <summary>
+/// Gets the number of events dropped because the queue was full
+/// </summary>
+EXPORT_C unsigned long long DiskTest_GetDroppedEvents(DiskTest* instance) WRAP(instance->GetDroppedEvents())
+
+/// <summary>
+/// Gets the recent speeds, the averages from DiskTest_GetAverageWriteSpeed/ReadSpeed go all the way back to the start
+/// </summary>
+/// <param name="write">Write speeds if true, read speeds otherwise</param>
+/// <param name="windowSpeed">MB/s over the last 5 seconds of transfers</param>
+/// <param name="ewmaSpeed">MB/s, exponentially weighted with a 5 second time constant, what the time remaining goes by</param>
+EXPORT_C void DiskTest_GetRecentSpeed(DiskTest* instance, bool write, double* windowSpeed, double* ewmaSpeed)
+{
+	*windowSpeed = instance->GetSpeedEstimator().GetWindowSpeed(write);
+	*ewmaSpeed = instance->GetSpeedEstimator().GetEwmaSpeed(write);
+}
+
+/// <summary>
+/// Gets the write speed drop of a device whose write cache ran out, common with fake and cheap flash
+/// </summary>
+/// <param name="offset">Bytes written when the speed dropped, roughly the size of the cache</param>
+/// <param name="speedBefore">MB/s before the drop</param>
+/// <param name="speedAfter">MB/s since</param>
+/// <returns>False if the write speed didn't drop (yet)</returns>
+EXPORT_C byte DiskTest_GetWriteCacheDrop(DiskTest* instance, unsigned long long* offset, double* speedBefore, double* speedAfter) WRAP(instance->GetSpeedEstimator().GetCacheDrop(offset, speedBefore, speedAfter))
+
+/// <summary>
+/// Gets the latency distribution of the I/O requests made so far, from submission to completion
+/// </summary>
+/// <param name="write">Write requests if true, read requests otherwise</param>
+/// <param name="p50">Median, in microseconds</param>
+/// <param name="p99">99th percentile, in microseconds</param>
+/// <param name="p999">99.9th percentile, in microseconds</param>
+/// <param name="maxUs">Slowest request, in microseconds</param>
+/// <param name="count">Number of requests</param>
+/// <returns>False if no request was made yet</returns>
+EXPORT_C byte DiskTest_GetLatencyPercentiles(DiskTest* instance, bool write, double* p50, double* p99, double* p999, double* maxUs, unsigned long long* count)
+{
+	const LatencyHistogram& histogram = instance->GetLatencyHistogram(write);
+
+	*p50 = histogram.GetPercentile(50) / 1000.0;
+	*p99 = histogram.GetPercentile(99) / 1000.0;
+	*p999 = histogram.GetPercentile(99.9) / 1000.0;
+	*maxUs = histogram.GetMax() / 1000.0;
+	*count = histogram.GetCount();
+
+	return *count != 0;
+}
+
+/// <summary>
+/// Copies the raw latency histogram, for callers that want to draw it or merge several devices
+/// </summary>
+/// <param name="write">Write requests if true, read requests otherwise</param>
+/// <param name="counts">Receives the number of requests per bucket, can be null to get the bucket count</param>
+/// <param name="upperBoundsNs">Receives the largest latency of each bucket in nanoseconds, can be null</param>
+/// <param name="size">Size of the arrays</param>
+/// <returns>Number of buckets</returns>
+EXPORT_C int DiskTest_GetLatencyHistogram(DiskTest* instance, bool write, unsigned long long* counts, unsigned long long* upperBoundsNs, int size)
+{
+	const LatencyHistogram& histogram = instance->GetLatencyHistogram(write);
+
+	for (size_t i = 0; i < LatencyHistogram::BUCKET_COUNT && i < (size_t)std::max(size, 0); i++)
+	{
+		if (counts != nullptr)
+			counts[i] = histogram.GetBucketCount(i);
+
+		if (upperBoundsNs != nullptr)
+			upperBoundsNs[i] = LatencyHistogram::GetBucketUpperBound(i);
+	}
+
+	return (int)LatencyHistogram::BUCKET_COUNT;
+}
+
+/// <summary>
+/// Replaces the disk under test with a simulated fake device, so the engine can be tested without the real thing
+/// </summary>
+/// <param name="backingPath">File (preferably on tmpfs) or loop device holding the real capacity</param>
+/// <param name="advertisedMB">Capacity the device claims to have</param>
+/// <param name="realMB">Capacity the device can actually store</param>
+/// <param name="mode">0 - Wrap around, 1 - Drop writes, 2 - Return stale data</param>
+/// <param name="latencyUs">Added to every request</param>
+/// <param name="readSpeed">MB/s, 0 for unlimited</param>
+/// <param name="writeSpeed">MB/s, 0 for unlimited</param>
+/// <param name="slowAfterMB">Simulates a write cache, after this amount of MB is written slowWriteSpeed is used. 0 for none</param>
+/// <param name="slowWriteSpeed">MB/s after the cache is full</param>
+/// <returns>True if the simulated device is ready</returns>
+EXPORT_C byte DiskTest_UseFakeFlash(DiskTest* instance, const char* backingPath, unsigned long long advertisedMB, unsigned long long realMB, int mode, unsigned int latencyUs, double readSpeed, double writeSpeed, unsigned long long slowAfterMB, double slowWriteSpeed)
+{
+	auto backend = std::make_shared<FakeFlashBackend>(std::string(backingPath), advertisedMB * (1024 * 1024), realMB * (1024 * 1024), (FakeFlashMode)mode);
+
+	if (!backend->IsValid())
+		return false;
+
+	FakeFlashProfile profile;
+	profile.latencyUs = latencyUs;
+	profile.readSpeed = readSpeed;
+	profile.writeSpeedCurve.push_back({ 0, writeSpeed });
+
+	if (slowAfterMB != 0)
+		profile.writeSpeedCurve.push_back({ slowAfterMB * (1024 * 1024), slowWriteSpeed });
+
+	backend->SetProfile(profile);
+	instance->SetIoBackend(backend);
+
+	return true;
+}
+
+/// <summary>
+/// Hands a test over to the scheduler, which groups it with the other devices on the same bus
+/// </summary>
+/// <param name="kind">0 - Normal test, 1 - Destructive test, 2 - Capacity probe, 3 - Verify only</param>
+/// <returns>False if it was already added</returns>
+EXPORT_C byte TestScheduler_AddTest(DiskTest* instance, int kind) WRAP(TestScheduler::Instance().Add(instance, (TestKind)kind))
+EXPORT_C void TestScheduler_RemoveTest(DiskTest* instance) WRAP(TestScheduler::Instance().Remove(instance))
+
+// Starts every added test on its own thread and returns the number started, Wait blocks until they are all done
+EXPORT_C int TestScheduler_Start() WRAP((int)TestScheduler::Instance().Start())
+EXPORT_C void TestScheduler_Wait() WRAP(TestScheduler::Instance().Wait())
+
+EXPORT_C int TestScheduler_GetGroupCount() WRAP((int)TestScheduler::Instance().GetGroupUtilization().size())
+
+/// <summary>
+/// Gets how a group of devices sharing a bus used it over the last few seconds
+/// </summary>
+/// <param name="name">Receives the bus identifier, empty for a device whose bus is unknown</param>
+/// <param name="nameSize">Size of the name buffer</param>
+/// <param name="devices">Devices in the group</param>
+/// <param name="activeDevices">Devices running a test</param>
+/// <param name="slots">Devices allowed to transfer at the same time</param>
+/// <param name="throughput">MB/s, all devices together</param>
+/// <param name="busy">Fraction of the slots kept busy</param>
+/// <returns>False if there's no such group</returns>
+EXPORT_C byte TestScheduler_GetGroupUtilization(int index, char* name, int nameSize, int* devices, int* activeDevices, unsigned int* slots, double* throughput, double* busy)
+{
+	std::vector<GroupUtilization> groups = TestScheduler::Instance().GetGroupUtilization();
+
+	if (index < 0 || index >= (int)groups.size())
+		return false;
+
+	const GroupUtilization& group = groups[index];
+
+	if (name != nullptr && nameSize > 0)
+	{
+		size_t length = std::min(group.name.size(), (size_t)nameSize - 1);
+		memcpy(name, group.name.c_str(), length);
+		name[length] = '\0';
+	}
+
+	*devices = (int)group.devices;
+	*activeDevices = (int)group.activeDevices;
+	*slots = group.slots;
+	*throughput = group.throughput;
+	*busy = group.busy;
+
+	return true;
+}
+
+/// <summary>
+/// Gets how a device used its bus over the last few seconds
+/// </summary>
+/// <param name="group">Index of its group</param>
+/// <param name="throughput">MB/s</param>
+/// <param name="busy">Fraction of the time spent transferring</param>
+/// <param name="waiting">Fraction of the time spent waiting for the other devices of the group</param>
+/// <returns>False if the test wasn't added to the scheduler</returns>
+EXPORT_C byte TestScheduler_GetDeviceUtilization(DiskTest* instance, int* group, double* throughput, double* busy, double* waiting)
+{
+	DeviceUtilization utilization;
+
+	if (!TestScheduler::Instance().GetDeviceUtilization(instance, &utilization))
+		return false;
+
+	*group = (int)utilization.group;
+	*throughput = utilization.throughput;
+	*busy = utilization.busy;
+	*waiting = utilization.waiting;
+
+	return true;
+}
 
+#ifdef _MSC_VER
 #pragma endregion
+#endif
@@ -0,0 +1,413 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+
+// Benchmarks of the test pipeline: pattern generation and comparison, buffer allocation and whole
+// write/verify runs. Results are printed as JSON so runs of different builds can be diffed.
+
+#include "AlignedBuffer.hpp"
+#include "BufferArena.hpp"
+#include "DiskTest.hpp"
+#include "PatternGenerator.hpp"
+#include "WorkerPool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Buffer the micro benchmarks work on, large enough to get out of the caches
+const size_t BENCH_BUFFER_SIZE = 256 * (1024 * 1024);
+
+// Size of the pieces handed to the worker pool, same as DiskTest
+const size_t BENCH_TASK_SIZE = 1024 * 1024;
+
+// Size of the buffers DiskTest allocates per chunk
+const size_t BENCH_CHUNK_SIZE = 64 * (1024 * 1024);
+
+const unsigned long long BENCH_SEED = 0x5453434245434831ULL;
+
+struct BenchOptions
+{
+	// Each micro benchmark is run this many times, the best run counts
+	int repeat = 3;
+
+	// End to end runs: test directory (tmpfs by default), raw device (e.g. a loop device) and how much to write in MB
+	std::string directory;
+	std::string device;
+	unsigned long long sizeMB = 1024;
+
+	std::string outputPath;
+	bool skipMicro = false;
+};
+
+/// <summary>
+/// A flat JSON object, enough for one result line
+/// </summary>
+class JsonObject
+{
+public:
+	JsonObject& Add(const char* key, const std::string& value)
+	{
+		std::string escaped;
+
+		for (char c : value)
+		{
+			if (c == '"' || c == '\\')
+				escaped += '\\';
+
+			if ((unsigned char)c < 0x20)
+				continue;
+
+			escaped += c;
+		}
+
+		return AddRaw(key, "\"" + escaped + "\"");
+	}
+
+	JsonObject& Add(const char* key, const char* value) { return Add(key, std::string(value)); }
+
+	JsonObject& Add(const char* key, double value)
+	{
+		char text[32];
+		snprintf(text, sizeof(text), "%.4f", value);
+		return AddRaw(key, text);
+	}
+
+	JsonObject& Add(const char* key, unsigned long long value) { return AddRaw(key, std::to_string(value)); }
+	JsonObject& Add(const char* key, int value) { return AddRaw(key, std::to_string(value)); }
+	JsonObject& Add(const char* key, bool value) { return AddRaw(key, value ? "true" : "false"); }
+
+	std::string ToString() const { return "{" + body + "}"; }
+
+private:
+	std::string body;
+
+	JsonObject& AddRaw(const char* key, const std::string& value)
+	{
+		if (!body.empty())
+			body += ", ";
+
+		body += "\"" + std::string(key) + "\": " + value;
+		return *this;
+	}
+};
+
+static std::vector<JsonObject> results;
+
+static double Seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/// <summary>
+/// Runs fn repeat times and returns the shortest run in seconds
+/// </summary>
+template<typename Fn>
+static double Best(int repeat, Fn fn)
+{
+	double best = 0;
+
+	for (int i = 0; i < repeat; i++)
+	{
+		auto start = std::chrono::steady_clock::now();
+		fn();
+		double seconds = Seconds(start);
+
+		if (i == 0 || seconds < best)
+			best = seconds;
+	}
+
+	return best;
+}
+
+static double GBps(size_t bytes, double seconds)
+{
+	return seconds > 0 ? bytes / seconds / (1024.0 * 1024 * 1024) : 0;
+}
+
+/// <summary>
+/// Splits [0, size) in threadCount slices and runs fn(start, end) on each from a thread of its own
+/// </summary>
+template<typename Fn>
+static void RunThreads(size_t threadCount, size_t size, Fn fn)
+{
+	std::vector<std::thread> threads;
+	size_t slice = (size / threadCount) & ~(size_t)63;
+
+	for (size_t i = 0; i < threadCount; i++)
+	{
+		size_t start = i * slice;
+		size_t end = i + 1 == threadCount ? size : start + slice;
+		threads.emplace_back([=] { fn(start, end); });
+	}
+
+	for (auto& thread : threads)
+		thread.join();
+}
+
+static std::vector<size_t> GetThreadCounts()
+{
+	size_t hardwareThreads = std::max<size_t>(1, std::thread::hardware_concurrency());
+	std::vector<size_t> counts;
+
+	for (size_t count = 1; count < hardwareThreads; count *= 2)
+		counts.push_back(count);
+
+	counts.push_back(hardwareThreads);
+	return counts;
+}
+
+/// <summary>
+/// Pattern generation per kernel and thread count, then through the worker pool the way DiskTest::GenerateData does it
+/// </summary>
+static void BenchGenerate(const BenchOptions& options, unsigned char* buffer)
+{
+	PatternGenerator pattern(BENCH_SEED);
+
+	const PatternKernel kernels[] = { PatternKernel::Scalar, PatternKernel::SSE2, PatternKernel::AVX2, PatternKernel::AVX512 };
+
+	for (PatternKernel kernel : kernels)
+	{
+		if (!PatternGenerator::SetKernel(kernel))
+			continue;
+
+		for (size_t threadCount : GetThreadCounts())
+		{
+			double seconds = Best(options.repeat, [&] {
+				RunThreads(threadCount, BENCH_BUFFER_SIZE, [&](size_t start, size_t end) { pattern.Fill(buffer + start, end - start, start); });
+			});
+
+			results.push_back(JsonObject().Add("name", "generate").Add("kernel", PatternGenerator::GetKernelName()).Add("threads", (unsigned long long)threadCount).Add("gbps", GBps(BENCH_BUFFER_SIZE, seconds)));
+		}
+	}
+
+	PatternGenerator::SetKernel(PatternKernel::Auto);
+
+	double seconds = Best(options.repeat, [&] {
+		TaskGroup group;
+
+		for (size_t start = 0; start < BENCH_BUFFER_SIZE; start += BENCH_TASK_SIZE)
+			WorkerPool::Instance().Submit(group, [&, start] { pattern.Fill(buffer + start, BENCH_TASK_SIZE, start); });
+
+		WorkerPool::Instance().Wait(group);
+	});
+
+	results.push_back(JsonObject().Add("name", "generate_pool").Add("kernel", PatternGenerator::GetKernelName()).Add("threads", (unsigned long long)WorkerPool::Instance().GetThreadCount()).Add("gbps", GBps(BENCH_BUFFER_SIZE, seconds)));
+}
+
+/// <summary>
+/// Verifying against the pattern, single threaded and through the worker pool, and a plain memcmp of the same data for reference
+/// </summary>
+static void BenchCompare(const BenchOptions& options, unsigned char* buffer, unsigned char* copy)
+{
+	PatternGenerator pattern(BENCH_SEED);
+	pattern.Fill(buffer, BENCH_BUFFER_SIZE, 0);
+	memcpy(copy, buffer, BENCH_BUFFER_SIZE);
+
+	size_t mismatch = 0;
+
+	double seconds = Best(options.repeat, [&] { mismatch = pattern.Compare(buffer, BENCH_BUFFER_SIZE, 0); });
+	results.push_back(JsonObject().Add("name", "compare").Add("kernel", PatternGenerator::GetKernelName()).Add("threads", 1ULL).Add("gbps", GBps(BENCH_BUFFER_SIZE, seconds)).Add("ok", mismatch == BENCH_BUFFER_SIZE));
+
+	std::atomic<bool> ok(true);
+
+	seconds = Best(options.repeat, [&] {
+		WorkerPool::Instance().ParallelFor(BENCH_BUFFER_SIZE / BENCH_TASK_SIZE, [&](size_t task) {
+			if (pattern.Compare(buffer + task * BENCH_TASK_SIZE, BENCH_TASK_SIZE, task * BENCH_TASK_SIZE) != BENCH_TASK_SIZE)
+				ok = false;
+		});
+	});
+	results.push_back(JsonObject().Add("name", "compare_pool").Add("kernel", PatternGenerator::GetKernelName()).Add("threads", (unsigned long long)WorkerPool::Instance().GetThreadCount()).Add("gbps", GBps(BENCH_BUFFER_SIZE, seconds)).Add("ok", ok.load()));
+
+	int difference = 0;
+
+	seconds = Best(options.repeat, [&] { difference = memcmp(buffer, copy, BENCH_BUFFER_SIZE); });
+	results.push_back(JsonObject().Add("name", "memcmp").Add("threads", 1ULL).Add("gbps", GBps(BENCH_BUFFER_SIZE, seconds)).Add("ok", difference == 0));
+}
+
+/// <summary>
+/// Writes a byte to every page, through a volatile pointer so the compiler can't drop it along with the buffer
+/// </summary>
+static void TouchPages(unsigned char* buffer, size_t size)
+{
+	volatile unsigned char* pages = buffer;
+
+	for (size_t i = 0; i < size; i += IO_BUFFER_ALIGNMENT)
+		pages[i] = 1;
+}
+
+/// <summary>
+/// Cost of getting the chunk buffers of a test ready to use, pages touched included
+/// </summary>
+static void BenchAllocation(const BenchOptions& options)
+{
+	BufferArenaBacking backing = BufferArenaBacking::None;
+
+	double seconds = Best(options.repeat, [&] {
+		BufferArena arena;
+		arena.Reserve(BENCH_CHUNK_SIZE, 2);
+
+		unsigned char* buffers[2] = { arena.Acquire(), arena.Acquire() };
+
+		for (unsigned char* buffer : buffers)
+			TouchPages(buffer, BENCH_CHUNK_SIZE);
+
+		backing = arena.GetStats().backing;
+
+		for (unsigned char* buffer : buffers)
+			arena.Release(buffer);
+	});
+
+	const char* backingNames[] = { "none", "normal", "thp", "hugepages" };
+
+	results.push_back(JsonObject().Add("name", "alloc_arena").Add("backing", backingNames[(int)backing]).Add("bytes", (unsigned long long)BENCH_CHUNK_SIZE * 2).Add("ms", seconds * 1000));
+
+	seconds = Best(options.repeat, [&] {
+		AlignedBuffer first(BENCH_CHUNK_SIZE);
+		AlignedBuffer second(BENCH_CHUNK_SIZE);
+
+		TouchPages(first.data(), BENCH_CHUNK_SIZE);
+		TouchPages(second.data(), BENCH_CHUNK_SIZE);
+	});
+
+	results.push_back(JsonObject().Add("name", "alloc_aligned").Add("bytes", (unsigned long long)BENCH_CHUNK_SIZE * 2).Add("ms", seconds * 1000));
+}
+
+/// <summary>
+/// A whole test through the public API, so WriteAndVerifyTestFile and InternalVerifyTestFile (or the raw device
+/// loops) are measured with everything around them
+/// </summary>
+static void BenchEndToEnd(const BenchOptions& options, const std::string& path, TestKind kind)
+{
+	DiskTest test(path, options.sizeMB, true, true, false, nullptr);
+
+	auto start = std::chrono::steady_clock::now();
+	bool success = test.Run(kind) != 0;
+	double seconds = Seconds(start);
+
+	results.push_back(JsonObject()
+		.Add("name", kind == TestKind::Destructive ? "end_to_end_device" : "end_to_end_file")
+		.Add("path", path)
+		.Add("mb", options.sizeMB)
+		.Add("write_mbs", test.GetAverageWriteSpeed())
+		.Add("read_mbs", test.GetAverageReadSpeed())
+		.Add("seconds", seconds)
+		.Add("ok", success && test.GetTestState() == DiskTest::State_Success));
+
+	if (kind == TestKind::Normal)
+		test.DeleteTestFiles();
+
+	test.Dispose();
+}
+
+static void PrintUsage()
+{
+	printf("Usage: TrueStorageCheck_Bench [options]\n"
+		"  --repeat N      Runs of each micro benchmark, the best one counts (default 3)\n"
+		"  --dir PATH      Directory for the end to end file test (default /dev/shm when there is one)\n"
+		"  --device PATH   Raw device for the end to end destructive test, e.g. a loop device. Its content is destroyed\n"
+		"  --size MB       Data written by the end to end tests (default 1024)\n"
+		"  --no-micro      Only run the end to end tests\n"
+		"  --output FILE   Writes the JSON results to FILE instead of stdout\n");
+}
+
+static bool ParseOptions(int argc, char** argv, BenchOptions* options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+
+		if (arg == "--repeat" && hasValue)
+			options->repeat = std::max(1, atoi(argv[++i]));
+		else if (arg == "--dir" && hasValue)
+			options->directory = argv[++i];
+		else if (arg == "--device" && hasValue)
+			options->device = argv[++i];
+		else if (arg == "--size" && hasValue)
+			options->sizeMB = strtoull(argv[++i], nullptr, 10);
+		else if (arg == "--output" && hasValue)
+			options->outputPath = argv[++i];
+		else if (arg == "--no-micro")
+			options->skipMicro = true;
+		else
+			return false;
+	}
+
+	return options->sizeMB > 0;
+}
+
+int main(int argc, char** argv)
+{
+	BenchOptions options;
+
+	if (!ParseOptions(argc, argv, &options))
+	{
+		PrintUsage();
+		return 2;
+	}
+
+#ifndef _WIN32
+	std::error_code error;
+	if (options.directory.empty() && std::filesystem::is_directory("/dev/shm", error))
+		options.directory = "/dev/shm";
+#endif
+
+	if (!options.skipMicro)
+	{
+		AlignedBuffer buffer(BENCH_BUFFER_SIZE);
+		AlignedBuffer copy(BENCH_BUFFER_SIZE);
+
+		BenchGenerate(options, buffer.data());
+		BenchCompare(options, buffer.data(), copy.data());
+		BenchAllocation(options);
+	}
+
+	if (!options.directory.empty())
+		BenchEndToEnd(options, options.directory, TestKind::Normal);
+
+	if (!options.device.empty())
+		BenchEndToEnd(options, options.device, TestKind::Destructive);
+
+	std::ostringstream json;
+	json << "{\n\t\"version\": 1,\n\t\"kernel\": \"" << PatternGenerator::GetKernelName() << "\",\n\t\"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n\t\"results\": [\n";
+
+	for (size_t i = 0; i < results.size(); i++)
+		json << "\t\t" << results[i].ToString() << (i + 1 < results.size() ? ",\n" : "\n");
+
+	json << "\t]\n}\n";
+
+	if (options.outputPath.empty())
+	{
+		fputs(json.str().c_str(), stdout);
+		return 0;
+	}
+
+	FILE* file = nullptr;
+#ifdef _WIN32
+	fopen_s(&file, options.outputPath.c_str(), "wb");
+#else
+	file = fopen(options.outputPath.c_str(), "wb");
+#endif
+
+	if (file == nullptr)
+	{
+		fprintf(stderr, "Can't write %s\n", options.outputPath.c_str());
+		return 1;
+	}
+
+	fputs(json.str().c_str(), file);
+	fclose(file);
+
+	return 0;
+}
@@ -0,0 +1,460 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+
+// Headless front-end: tests any number of devices in one process through the TestScheduler, prints
+// a progress line per device every few seconds and writes a JSON report once every test is done.
+
+#include "DiskTest.hpp"
+#include "TestScheduler.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define BYTES_TO_MB(x) ((x) / (1024 * 1024))
+
+/// <summary>
+/// Options of a single device, every option applies to the paths that come after it on the command line
+/// </summary>
+struct DeviceOptions
+{
+	TestKind kind = TestKind::Normal;
+	unsigned long long capacityMB = 0;
+
+	// Test file size of the normal test, 0 for a single file and -1 for the engine default
+	long long fileSizeMB = -1;
+
+	// Lets the normal test pick its request size and queue depth
+	bool autoTune = true;
+
+	bool stopOnFirstError = true;
+	bool deleteTempFiles = true;
+	bool writeLogFile = false;
+
+	// Journal directory on the host, the journal of each device is named after its path
+	std::string journalDirectory;
+};
+
+struct Device
+{
+	std::string path;
+	DeviceOptions options;
+	std::unique_ptr<DiskTest> test;
+
+	int lastState = -1;
+	std::chrono::steady_clock::time_point start;
+	double seconds = 0;
+};
+
+struct CliOptions
+{
+	std::vector<Device> devices;
+	std::string reportPath;
+	int intervalSeconds = 5;
+};
+
+// Set by SIGINT/SIGTERM, the main loop stops every test when it sees it
+static volatile std::sig_atomic_t stopRequested = 0;
+
+static void OnSignal(int)
+{
+	stopRequested = 1;
+}
+
+static const char* GetKindName(TestKind kind)
+{
+	switch (kind)
+	{
+	case TestKind::Destructive: return "destructive";
+	case TestKind::CapacityProbe: return "probe";
+	case TestKind::VerifyOnly: return "verify";
+	default: return "normal";
+	}
+}
+
+static const char* GetStateName(int state)
+{
+	switch (state)
+	{
+	case DiskTest::State_Waiting: return "waiting";
+	case DiskTest::State_InProgress: return "writing";
+	case DiskTest::State_Verification: return "verifying";
+	case DiskTest::State_Success: return "success";
+	case DiskTest::State_Error: return "error";
+	case DiskTest::State_Aborted: return "aborted";
+	default: return "unknown";
+	}
+}
+
+static bool IsFinalState(int state)
+{
+	return state == DiskTest::State_Success || state == DiskTest::State_Error || state == DiskTest::State_Aborted;
+}
+
+static std::string Escape(const std::string& text)
+{
+	std::string escaped;
+
+	for (char c : text)
+	{
+		if (c == '"' || c == '\\')
+			escaped += '\\';
+
+		if ((unsigned char)c >= 0x20)
+			escaped += c;
+	}
+
+	return escaped;
+}
+
+static std::string GetTimestamp()
+{
+	std::time_t now = std::time(nullptr);
+	std::tm utc;
+
+#ifdef _WIN32
+	gmtime_s(&utc, &now);
+#else
+	gmtime_r(&now, &utc);
+#endif
+
+	char text[32];
+	std::strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%SZ", &utc);
+	return text;
+}
+
+/// <summary>
+/// Turns a device path into something usable as a file name
+/// </summary>
+static std::string GetSafeName(const std::string& path)
+{
+	std::string name;
+
+	for (char c : path)
+		name += isalnum((unsigned char)c) ? c : '_';
+
+	return name;
+}
+
+static void PrintUsage()
+{
+	printf("Usage: TrueStorageCheck_CLI [options] PATH [[options] PATH...]\n"
+		"Tests every PATH (drive root, mount point or raw device) at the same time. Options apply to the paths after them.\n"
+		"\n"
+		"Per device:\n"
+		"  --mode MODE           normal (default), destructive, probe or verify\n"
+		"  --capacity MB         Capacity to test, 0 for all free space / the whole device (default 0)\n"
+		"  --file-size MB        Size of the test files, 0 for a single file (default 512)\n"
+		"  --no-autotune         Skip the request size / queue depth calibration of the normal test\n"
+		"  --autotune            Calibrate them (default)\n"
+		"  --stop-on-error       Stop at the first error (default)\n"
+		"  --no-stop-on-error    Carry on after errors\n"
+		"  --keep-files          Leave the test files on the disk, e.g. for a later --mode verify\n"
+		"  --delete-files        Delete the test files afterwards (default)\n"
+		"  --log / --no-log      Write the test log to the disk (default off)\n"
+		"  --journal DIR         Keep a resumable journal per device in DIR, on the host\n"
+		"\n"
+		"Global:\n"
+		"  --report FILE         Writes the JSON report to FILE instead of stdout\n"
+		"  --interval SECONDS    Time between progress lines (default 5)\n");
+}
+
+static bool ParseOptions(int argc, char** argv, CliOptions* cli)
+{
+	DeviceOptions options;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+
+		if (arg == "--mode" && hasValue)
+		{
+			std::string mode = argv[++i];
+
+			if (mode == "normal")
+				options.kind = TestKind::Normal;
+			else if (mode == "destructive")
+				options.kind = TestKind::Destructive;
+			else if (mode == "probe")
+				options.kind = TestKind::CapacityProbe;
+			else if (mode == "verify")
+				options.kind = TestKind::VerifyOnly;
+			else
+				return false;
+		}
+		else if (arg == "--capacity" && hasValue)
+			options.capacityMB = strtoull(argv[++i], nullptr, 10);
+		else if (arg == "--file-size" && hasValue)
+			options.fileSizeMB = (long long)strtoull(argv[++i], nullptr, 10);
+		else if (arg == "--autotune")
+			options.autoTune = true;
+		else if (arg == "--no-autotune")
+			options.autoTune = false;
+		else if (arg == "--stop-on-error")
+			options.stopOnFirstError = true;
+		else if (arg == "--no-stop-on-error")
+			options.stopOnFirstError = false;
+		else if (arg == "--keep-files")
+			options.deleteTempFiles = false;
+		else if (arg == "--delete-files")
+			options.deleteTempFiles = true;
+		else if (arg == "--log")
+			options.writeLogFile = true;
+		else if (arg == "--no-log")
+			options.writeLogFile = false;
+		else if (arg == "--journal" && hasValue)
+			options.journalDirectory = argv[++i];
+		else if (arg == "--report" && hasValue)
+			cli->reportPath = argv[++i];
+		else if (arg == "--interval" && hasValue)
+			cli->intervalSeconds = std::max(1, atoi(argv[++i]));
+		else if (arg.size() > 1 && arg[0] == '-' && arg[1] == '-')
+			return false;
+		else
+		{
+			Device device;
+			device.path = arg;
+			device.options = options;
+			cli->devices.push_back(std::move(device));
+		}
+	}
+
+	return !cli->devices.empty();
+}
+
+static void PrintProgress(Device& device, bool onlyStateChanges)
+{
+	TestEvent snapshot = device.test->GetSnapshot();
+
+	if (onlyStateChanges && snapshot.state == device.lastState)
+		return;
+
+	device.lastState = snapshot.state;
+
+	// stderr, so the report can be piped from stdout
+	fprintf(stderr, "%s %s %d%% written=%lluMB verified=%lluMB write=%.1fMB/s read=%.1fMB/s eta=%us\n",
+		device.path.c_str(), GetStateName(snapshot.state), snapshot.progress,
+		(unsigned long long)BYTES_TO_MB(snapshot.bytesWritten), (unsigned long long)BYTES_TO_MB(snapshot.bytesVerified),
+		snapshot.writeSpeed, snapshot.readSpeed, snapshot.timeRemaining);
+}
+
+/// <summary>
+/// Latency of one direction as a JSON object, in microseconds
+/// </summary>
+static std::string GetLatencyJson(const LatencyHistogram& histogram)
+{
+	std::ostringstream json;
+	json << "{\"count\": " << histogram.GetCount()
+		<< ", \"p50_us\": " << histogram.GetPercentile(50) / 1000.0
+		<< ", \"p99_us\": " << histogram.GetPercentile(99) / 1000.0
+		<< ", \"p999_us\": " << histogram.GetPercentile(99.9) / 1000.0
+		<< ", \"max_us\": " << histogram.GetMax() / 1000.0 << "}";
+
+	return json.str();
+}
+
+static std::string GetReport(const CliOptions& cli, const std::string& started)
+{
+	std::ostringstream json;
+	json << "{\n\t\"version\": 1,\n\t\"started\": \"" << started << "\",\n\t\"finished\": \"" << GetTimestamp() << "\",\n\t\"devices\": [\n";
+
+	for (size_t i = 0; i < cli.devices.size(); i++)
+	{
+		const Device& device = cli.devices[i];
+		DiskTest& test = *device.test;
+		int state = test.GetTestState();
+
+		json << "\t\t{\"path\": \"" << Escape(device.path) << "\""
+			<< ", \"mode\": \"" << GetKindName(device.options.kind) << "\""
+			<< ", \"capacity_mb\": " << device.options.capacityMB
+			<< ", \"stop_on_first_error\": " << (device.options.stopOnFirstError ? "true" : "false")
+			<< ", \"state\": \"" << (state == DiskTest::State_Waiting ? "not_started" : GetStateName(state)) << "\""
+			<< ", \"success\": " << (state == DiskTest::State_Success ? "true" : "false")
+			<< ", \"seconds\": " << device.seconds;
+
+		TestEvent snapshot = test.GetSnapshot();
+
+		json << ", \"bytes_written\": " << snapshot.bytesWritten
+			<< ", \"bytes_verified\": " << snapshot.bytesVerified
+			<< ", \"last_successful_verify_position\": " << test.GetLastSuccessfulVerifyPosition()
+			<< ", \"write_mbs\": " << test.GetAverageWriteSpeed()
+			<< ", \"read_mbs\": " << test.GetAverageReadSpeed();
+
+		unsigned long long requestSize = 0;
+		unsigned int queueDepth = 0;
+		double tunedSpeed = 0;
+		bool tuned = test.GetIoTuning(&requestSize, &queueDepth, &tunedSpeed);
+
+		json << ", \"io\": {\"request_size\": " << requestSize << ", \"queue_depth\": " << queueDepth << ", \"calibrated\": " << (tuned ? "true" : "false");
+
+		if (tuned)
+			json << ", \"calibration_mbs\": " << tunedSpeed;
+
+		json << "}";
+
+		unsigned long long dropOffset = 0;
+		double speedBefore = 0, speedAfter = 0;
+
+		if (test.GetSpeedEstimator().GetCacheDrop(&dropOffset, &speedBefore, &speedAfter))
+			json << ", \"write_cache_drop\": {\"offset\": " << dropOffset << ", \"before_mbs\": " << speedBefore << ", \"after_mbs\": " << speedAfter << "}";
+
+		if (device.options.kind == TestKind::CapacityProbe)
+		{
+			unsigned long long lowerBound = 0, upperBound = 0;
+			test.GetProbeCapacityBounds(&lowerBound, &upperBound);
+
+			json << ", \"probe_lower_bound\": " << lowerBound << ", \"probe_upper_bound\": " << upperBound;
+		}
+
+		json << ", \"write_latency\": " << GetLatencyJson(test.GetLatencyHistogram(true))
+			<< ", \"read_latency\": " << GetLatencyJson(test.GetLatencyHistogram(false)) << "}"
+			<< (i + 1 < cli.devices.size() ? ",\n" : "\n");
+	}
+
+	json << "\t]\n}\n";
+	return json.str();
+}
+
+int main(int argc, char** argv)
+{
+	CliOptions cli;
+
+	if (!ParseOptions(argc, argv, &cli))
+	{
+		PrintUsage();
+		return 2;
+	}
+
+	for (auto& device : cli.devices)
+	{
+		const DeviceOptions& options = device.options;
+
+		try
+		{
+			device.test = std::make_unique<DiskTest>(device.path, options.capacityMB, options.stopOnFirstError, options.deleteTempFiles, options.writeLogFile, nullptr);
+		}
+		catch (const char*)
+		{
+			fprintf(stderr, "Refusing to test %s\n", device.path.c_str());
+			return 2;
+		}
+
+		device.test->SetIoAutoTune(options.autoTune);
+
+		if (options.fileSizeMB >= 0)
+			device.test->SetTestFileSize((unsigned long long)options.fileSizeMB * (1024 * 1024));
+
+		if (!options.journalDirectory.empty())
+			device.test->SetJournalPath(options.journalDirectory + PATH_SEPARATOR + GetSafeName(device.path) + ".journal");
+	}
+
+	std::signal(SIGINT, OnSignal);
+	std::signal(SIGTERM, OnSignal);
+
+	std::string started = GetTimestamp();
+	TestScheduler& scheduler = TestScheduler::Instance();
+
+	for (auto& device : cli.devices)
+	{
+		scheduler.Add(device.test.get(), device.options.kind);
+		device.start = std::chrono::steady_clock::now();
+	}
+
+	scheduler.Start();
+
+	// A test that can't start (missing path, no manifest to verify) returns without ever changing state, so
+	// it's the scheduler that tells when everything is over
+	std::atomic<bool> done(false);
+	std::thread waiter([&] {
+		scheduler.Wait();
+		done = true;
+	});
+
+	// Progress every interval, state changes as soon as they are seen
+	auto lastProgress = std::chrono::steady_clock::now();
+	bool stopping = false;
+
+	while (true)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+		if (stopRequested && !stopping)
+		{
+			fprintf(stderr, "Stopping...\n");
+
+			for (auto& device : cli.devices)
+				device.test->ForceStopTest();
+
+			stopping = true;
+		}
+
+		bool finished = done;
+		bool progressDue = finished || std::chrono::steady_clock::now() - lastProgress >= std::chrono::seconds(cli.intervalSeconds);
+
+		for (auto& device : cli.devices)
+		{
+			PrintProgress(device, !progressDue);
+
+			if (device.seconds == 0 && (finished || IsFinalState(device.test->GetTestState())))
+				device.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - device.start).count();
+		}
+
+		if (progressDue)
+			lastProgress = std::chrono::steady_clock::now();
+
+		if (finished)
+			break;
+	}
+
+	waiter.join();
+
+	std::string report = GetReport(cli, started);
+	bool allPassed = true;
+
+	for (auto& device : cli.devices)
+	{
+		allPassed &= device.test->GetTestState() == DiskTest::State_Success;
+
+		scheduler.Remove(device.test.get());
+		device.test->Dispose();
+	}
+
+	if (cli.reportPath.empty())
+	{
+		fputs(report.c_str(), stdout);
+	}
+	else
+	{
+		FILE* file = nullptr;
+#ifdef _WIN32
+		fopen_s(&file, cli.reportPath.c_str(), "wb");
+#else
+		file = fopen(cli.reportPath.c_str(), "wb");
+#endif
+
+		if (file == nullptr)
+		{
+			fprintf(stderr, "Can't write %s\n", cli.reportPath.c_str());
+			return 1;
+		}
+
+		fputs(report.c_str(), file);
+		fclose(file);
+	}
+
+	return allPassed ? 0 : 1;
+}
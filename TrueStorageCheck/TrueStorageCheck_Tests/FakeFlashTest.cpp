@@ -0,0 +1,186 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+
+// Regression test of fake detection: runs the normal and destructive tests and the capacity probe against simulated devices
+// with a known real capacity and checks that they fail and that what they report brackets the real capacity.
+
+#include "DiskTest.hpp"
+#include "FakeFlashBackend.hpp"
+
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <string>
+
+const unsigned long long MB = 1024 * 1024;
+
+// Small enough to run in a few seconds, large enough for the calibration and several test files
+const unsigned long long ADVERTISED_SIZE = 256 * MB;
+
+// A power of two, the probe only catches a wrapping fake where two probes alias
+const unsigned long long REAL_SIZE = 64 * MB;
+
+const unsigned long long TEST_FILE_SIZE = 16 * MB;
+
+// The simulated device has no directories, the test path is only a name
+const char* TEST_PATH = "fakeflash/";
+
+struct Scenario
+{
+	const char* name;
+	FakeFlashMode mode;
+	unsigned long long realSize;
+};
+
+static int failures = 0;
+
+static void Check(bool condition, const char* scenario, const char* what)
+{
+	if (!condition)
+	{
+		fprintf(stderr, "FAIL %s: %s\n", scenario, what);
+		failures++;
+	}
+}
+
+/// <summary>
+/// Creates a test on a fresh simulated device
+/// </summary>
+static std::unique_ptr<DiskTest> CreateTest(const Scenario& scenario, const std::string& backingPath, bool stopOnFirstError)
+{
+	auto backend = std::make_shared<FakeFlashBackend>(backingPath, ADVERTISED_SIZE, scenario.realSize, scenario.mode);
+
+	if (!backend->IsValid())
+		return nullptr;
+
+	std::unique_ptr<DiskTest> test(new DiskTest(TEST_PATH, 0, stopOnFirstError, true, false, nullptr));
+	test->SetIoBackend(backend);
+	test->SetTestFileSize(TEST_FILE_SIZE);
+
+	return test;
+}
+
+static void RunNormalTest(const Scenario& scenario, const std::string& backingPath, bool stopOnFirstError)
+{
+	std::unique_ptr<DiskTest> test = CreateTest(scenario, backingPath, stopOnFirstError);
+	Check(test != nullptr, scenario.name, "simulated device not created");
+
+	if (test == nullptr)
+		return;
+
+	bool genuine = scenario.realSize == ADVERTISED_SIZE;
+	bool ret = test->PerformTest();
+	unsigned long long position = test->GetLastSuccessfulVerifyPosition();
+
+	printf("%s: normal test%s %s, last verified position %llu\n", scenario.name, stopOnFirstError ? " (stop on first error)" : "", ret ? "passed" : "failed", position);
+
+	if (genuine)
+	{
+		Check(ret && test->GetTestState() == DiskTest::State_Success, scenario.name, "normal test failed on a genuine device");
+		return;
+	}
+
+	Check(!ret && test->GetTestState() == DiskTest::State_Error, scenario.name, "normal test didn't fail");
+	Check(position <= scenario.realSize, scenario.name, "last verified position past the real capacity");
+
+	// Without stopping, the final verification finds the lowest failing offset: wrapping overwrites the first files,
+	// everything else is good up to the test file the capacity ends in
+	if (!stopOnFirstError && scenario.mode != FakeFlashMode::Wrap)
+		Check(position + TEST_FILE_SIZE >= scenario.realSize, scenario.name, "last verified position well below the real capacity");
+}
+
+static void RunDestructiveTest(const Scenario& scenario, const std::string& backingPath, bool stopOnFirstError)
+{
+	std::unique_ptr<DiskTest> test = CreateTest(scenario, backingPath, stopOnFirstError);
+	Check(test != nullptr, scenario.name, "simulated device not created");
+
+	if (test == nullptr)
+		return;
+
+	bool genuine = scenario.realSize == ADVERTISED_SIZE;
+	bool ret = test->PerformDestructiveTest();
+	unsigned long long position = test->GetLastSuccessfulVerifyPosition();
+
+	printf("%s: destructive test%s %s, last verified position %llu\n", scenario.name, stopOnFirstError ? " (stop on first error)" : "", ret ? "passed" : "failed", position);
+
+	if (genuine)
+	{
+		Check(ret && test->GetTestState() == DiskTest::State_Success, scenario.name, "destructive test failed on a genuine device");
+		return;
+	}
+
+	Check(!ret && test->GetTestState() == DiskTest::State_Error, scenario.name, "destructive test didn't fail");
+	Check(position <= scenario.realSize, scenario.name, "last verified position past the real capacity");
+
+	// The whole device is one stream, without wrapping nothing below the real capacity is lost
+	if (!stopOnFirstError && scenario.mode != FakeFlashMode::Wrap)
+		Check(position == scenario.realSize, scenario.name, "last verified position isn't the real capacity");
+}
+
+static void RunCapacityProbe(const Scenario& scenario, const std::string& backingPath)
+{
+	std::unique_ptr<DiskTest> test = CreateTest(scenario, backingPath, true);
+	Check(test != nullptr, scenario.name, "simulated device not created");
+
+	if (test == nullptr)
+		return;
+
+	bool genuine = scenario.realSize == ADVERTISED_SIZE;
+	bool ret = test->PerformCapacityProbe();
+
+	unsigned long long lowerBound = 0, upperBound = 0;
+	test->GetProbeCapacityBounds(&lowerBound, &upperBound);
+
+	printf("%s: capacity probe %s, bounds %llu - %llu\n", scenario.name, ret ? "passed" : "failed", lowerBound, upperBound);
+
+	if (genuine)
+	{
+		Check(ret && test->GetTestState() == DiskTest::State_Success, scenario.name, "capacity probe failed on a genuine device");
+		Check(lowerBound == ADVERTISED_SIZE && upperBound == ADVERTISED_SIZE, scenario.name, "probe bounds aren't the device size");
+		return;
+	}
+
+	Check(!ret && test->GetTestState() == DiskTest::State_Error, scenario.name, "capacity probe didn't fail");
+	Check(lowerBound <= scenario.realSize && scenario.realSize <= upperBound, scenario.name, "probe bounds don't bracket the real capacity");
+	Check(test->GetLastSuccessfulVerifyPosition() == lowerBound, scenario.name, "last verified position isn't the lower bound");
+}
+
+int main()
+{
+	const Scenario scenarios[] = {
+		{ "genuine", FakeFlashMode::Wrap, ADVERTISED_SIZE },
+		{ "wrap", FakeFlashMode::Wrap, REAL_SIZE },
+		{ "drop", FakeFlashMode::Drop, REAL_SIZE },
+		{ "stale", FakeFlashMode::Stale, REAL_SIZE },
+	};
+
+	std::error_code error;
+	std::filesystem::path directory = std::filesystem::temp_directory_path(error);
+
+#ifndef _WIN32
+	// tmpfs keeps the simulated devices off the real disk
+	if (std::filesystem::is_directory("/dev/shm", error))
+		directory = "/dev/shm";
+#endif
+
+	std::string backingPath = (directory / "TSC_FakeFlashTest.img").string();
+
+	for (const auto& scenario : scenarios)
+	{
+		RunNormalTest(scenario, backingPath, true);
+		RunNormalTest(scenario, backingPath, false);
+		RunDestructiveTest(scenario, backingPath, true);
+		RunDestructiveTest(scenario, backingPath, false);
+		RunCapacityProbe(scenario, backingPath);
+	}
+
+	std::filesystem::remove(backingPath, error);
+
+	if (failures != 0)
+		fprintf(stderr, "%d check(s) failed\n", failures);
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,138 @@
+/* Copyright (C) 2023 - Mywk.Net
+ * Licensed under the EUPL, Version 1.2
+ * You may obtain a copy of the Licence at: https://joinup.ec.europa.eu/community/eupl/og_page/eupl
+ * Unless required by applicable law or agreed to in writing, software distributed under the Licence is distributed on an "AS IS" basis, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ */
+
+// Checks that every pattern kernel the CPU supports fills and compares exactly like the scalar one, data written on one
+// host has to verify on any other.
+
+#include "PatternGenerator.hpp"
+
+#include <cstdio>
+#include <vector>
+
+// Word index 2^32 starts at this byte offset, the high half of the index feeds the hash from there on
+const unsigned long long WORD_INDEX_WRAP = 4ULL << 32;
+
+struct Kernel
+{
+	const char* name;
+	PatternKernel kernel;
+};
+
+static int failures = 0;
+
+static void Check(bool condition, const char* kernel, const char* what, unsigned long long offset, size_t size)
+{
+	if (!condition)
+	{
+		fprintf(stderr, "FAIL %s: %s (offset %llu, size %zu)\n", kernel, what, offset, size);
+		failures++;
+	}
+}
+
+/// <summary>
+/// Fills with the kernel and compares against the scalar bytes, then checks Compare finds the same mismatches
+/// </summary>
+static void CheckRange(const Kernel& kernel, const PatternGenerator& generator, unsigned long long offset, size_t size)
+{
+	// Guard bytes on both sides catch a kernel writing outside the range
+	const unsigned char GUARD = 0xA5;
+
+	std::vector<unsigned char> expected(size + 2, GUARD);
+	PatternGenerator::SetKernel(PatternKernel::Scalar);
+	generator.Fill(expected.data() + 1, size, offset);
+
+	std::vector<unsigned char> data(size + 2, GUARD);
+	PatternGenerator::SetKernel(kernel.kernel);
+	generator.Fill(data.data() + 1, size, offset);
+
+	Check(data == expected, kernel.name, "Fill differs from scalar", offset, size);
+	Check(data[0] == GUARD && data[size + 1] == GUARD, kernel.name, "Fill wrote outside the range", offset, size);
+
+	unsigned char* pData = expected.data() + 1;
+	Check(generator.Compare(pData, size, offset) == size, kernel.name, "Compare rejects the scalar bytes", offset, size);
+
+	if (size == 0)
+		return;
+
+	// First, last and a few positions in between, each landing in a different lane or tile
+	const size_t positions[] = { 0, size - 1, size / 2, size / 3, (size / 7) * 5 };
+
+	for (size_t position : positions)
+	{
+		pData[position] ^= 0x10;
+		Check(generator.Compare(pData, size, offset) == position, kernel.name, "Compare missed a flipped byte", offset, size);
+		pData[position] ^= 0x10;
+	}
+
+	// Everything wrong past a point, only the first one counts
+	if (size > 1)
+	{
+		size_t position = size / 2;
+		for (size_t i = position; i < size; i++)
+			pData[i] ^= 0xFF;
+
+		Check(generator.Compare(pData, size, offset) == position, kernel.name, "Compare didn't report the first mismatch", offset, size);
+	}
+}
+
+int main()
+{
+	const Kernel kernels[] = {
+		{ "sse2", PatternKernel::SSE2 },
+		{ "avx2", PatternKernel::AVX2 },
+		{ "avx512", PatternKernel::AVX512 },
+	};
+
+	// Unaligned starts, just before and after sector and word index boundaries
+	const unsigned long long offsets[] = {
+		0, 1, 3, 4, 5, 63, 511, 513, 4096 + 7, 1000003,
+		WORD_INDEX_WRAP - 4096 - 3, WORD_INDEX_WRAP - 5, WORD_INDEX_WRAP - 1, WORD_INDEX_WRAP, WORD_INDEX_WRAP + 2,
+		(WORD_INDEX_WRAP * 3) - 13, 1ULL << 40,
+	};
+
+	// Shorter than a vector, odd, around the compare tile and across several tiles
+	const size_t sizes[] = { 0, 1, 2, 3, 7, 15, 31, 33, 63, 65, 127, 511, 513, 4097, 64 * 1024 - 1, 64 * 1024 + 3, 300 * 1024 + 5 };
+
+	const unsigned long long seeds[] = { 0, 0xFFFFFFFFFFFFFFFFULL, PatternGenerator::SeedFromString("0123abcd/TSC_0001.bin") };
+
+	for (const Kernel& kernel : kernels)
+	{
+		if (!PatternGenerator::SetKernel(kernel.kernel))
+		{
+			printf("%s: not supported by this CPU, skipped\n", kernel.name);
+			continue;
+		}
+
+		int before = failures;
+
+		for (unsigned long long seed : seeds)
+		{
+			PatternGenerator plain(seed);
+
+			// Tagged sectors, with addresses past 4GB so the tag uses both halves
+			PatternGenerator tagged(seed);
+			tagged.SetSectorTags(0x1234ABCD, (1ULL << 34) + 512 * 3);
+
+			for (unsigned long long offset : offsets)
+			{
+				for (size_t size : sizes)
+				{
+					CheckRange(kernel, plain, offset, size);
+					CheckRange(kernel, tagged, offset, size);
+				}
+			}
+		}
+
+		printf("%s: %s\n", kernel.name, failures == before ? "same as scalar" : "differs from scalar");
+	}
+
+	PatternGenerator::SetKernel(PatternKernel::Auto);
+
+	if (failures != 0)
+		fprintf(stderr, "%d check(s) failed\n", failures);
+
+	return failures == 0 ? 0 : 1;
+}